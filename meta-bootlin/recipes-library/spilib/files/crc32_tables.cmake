@@ -0,0 +1,72 @@
+# Generates the CRC32 lookup tables used by spi_crc.c.
+#
+# Usage: cmake -DOUTPUT=<file> -P crc32_tables.cmake
+#
+# The tables are computed with CMake arithmetic so that cross builds need no
+# host tool. Table 0 is the classic byte table for the MSB-first polynomial
+# 0x04C11DB7; table k advances a byte that is followed by k more bytes.
+
+# math(OUTPUT_FORMAT) needs 3.13
+cmake_minimum_required(VERSION 3.13)
+
+if(NOT OUTPUT)
+    message(FATAL_ERROR "OUTPUT is not set")
+endif()
+
+set(POLYNOMIAL 0x04C11DB7)
+set(SLICES 8)
+
+set(content "/* Generated by crc32_tables.cmake, do not edit. */\n\n")
+string(APPEND content "#include \"spi_crc.h\"\n\n")
+string(APPEND content "const uint32_t crc32_table[CRC32_TABLE_SLICES][256] = {\n")
+
+foreach(dividend RANGE 255)
+    math(EXPR remainder "${dividend} << 24")
+    foreach(bit RANGE 7)
+        math(EXPR top "${remainder} & 0x80000000")
+        if(top)
+            math(EXPR remainder "((${remainder} << 1) ^ ${POLYNOMIAL}) & 0xFFFFFFFF")
+        else()
+            math(EXPR remainder "(${remainder} << 1) & 0xFFFFFFFF")
+        endif()
+    endforeach()
+    set(table_0_${dividend} ${remainder})
+endforeach()
+
+math(EXPR last_slice "${SLICES} - 1")
+foreach(slice RANGE 1 ${last_slice})
+    math(EXPR previous "${slice} - 1")
+    foreach(dividend RANGE 255)
+        set(remainder ${table_${previous}_${dividend}})
+        math(EXPR index "${remainder} >> 24")
+        math(EXPR value "((${remainder} << 8) & 0xFFFFFFFF) ^ ${table_0_${index}}")
+        set(table_${slice}_${dividend} ${value})
+    endforeach()
+endforeach()
+
+foreach(slice RANGE ${last_slice})
+    string(APPEND content "    {\n")
+    foreach(row RANGE 0 255 4)
+        set(line "       ")
+        math(EXPR row_end "${row} + 3")
+        foreach(dividend RANGE ${row} ${row_end})
+            math(EXPR hex "${table_${slice}_${dividend}}" OUTPUT_FORMAT HEXADECIMAL)
+            string(SUBSTRING "${hex}" 2 -1 digits)
+            string(LENGTH "${digits}" length)
+            while(length LESS 8)
+                set(digits "0${digits}")
+                math(EXPR length "${length} + 1")
+            endwhile()
+            string(TOUPPER "${digits}" digits)
+            string(APPEND line " 0x${digits}U,")
+        endforeach()
+        string(APPEND content "${line}\n")
+    endforeach()
+    string(APPEND content "    },\n")
+endforeach()
+
+string(APPEND content "};\n")
+
+file(WRITE "${OUTPUT}.tmp" "${content}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different "${OUTPUT}.tmp" "${OUTPUT}")
+file(REMOVE "${OUTPUT}.tmp")
@@ -0,0 +1,371 @@
+/**
+ * @file spi_coro.hpp
+ * @brief C++20 coroutine interface to the SPI communication library.
+ *
+ * A coroutine co_awaits executor::request() and is suspended until its
+ * response frame has been read and validated, or its request has failed.
+ * One executor drives every coroutine of a device from a single thread:
+ * it resumes the coroutines whose requests completed, then waits for the
+ * next GPIO interrupt in spi_process_responses(). Coroutines are never
+ * resumed from inside the library, so they may submit further requests at
+ * any point.
+ */
+
+#ifndef SPI_CORO_HPP
+#define SPI_CORO_HPP
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+#include "spi_lib.hpp"
+
+namespace spi {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+/**
+ * @brief State shared by the promises of all task types.
+ */
+struct promise_base {
+    std::coroutine_handle<> continuation;  // Coroutine awaiting this one, if any
+    std::exception_ptr exception;
+
+    /**
+     * @brief Resumes the awaiting coroutine once the task has finished.
+     */
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept {
+            std::coroutine_handle<> next = self.promise().continuation;
+            return (next != nullptr) ? next : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U &&result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T take() {
+        if (exception != nullptr) {
+            std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object();
+
+    void return_void() const noexcept {}
+
+    void take() const {
+        if (exception != nullptr) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Lazily started coroutine returning a T.
+ *
+ * A task runs when it is co_awaited, or when it is spawned on an executor.
+ * Exceptions propagate to the awaiting coroutine, or out of
+ * executor::run_once() for spawned tasks.
+ */
+template <typename T>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (handle_ != nullptr) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (handle_ != nullptr) {
+            handle_.destroy();
+        }
+    }
+
+    /** @brief Checks whether the coroutine has run to completion. */
+    bool done() const noexcept { return handle_.done(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().take(); }
+
+private:
+    friend class executor;
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/**
+ * @brief Outcome of a request, as returned by co_await executor::request().
+ */
+struct reply {
+    spi_error_t error;             /**< SPI_SUCCESS or the reason the request failed */
+    std::uint8_t function_id;      /**< Function ID of the response */
+    std::uint16_t sequence;        /**< Sequence tag of the request, 0 if it was never submitted */
+    std::uint16_t payload_size;    /**< Bytes of data in use */
+    std::array<std::uint8_t, max_payload_size> data;  /**< Copy of the response payload */
+
+    /** @brief Returns the response payload. */
+    std::span<const std::uint8_t> payload() const noexcept { return {data.data(), payload_size}; }
+};
+
+/**
+ * @brief Single-threaded executor of the coroutines of one device.
+ *
+ * Any number of coroutines may have requests outstanding; the pipeline of
+ * the device bounds how many are on the wire, and requests beyond the
+ * submission queue wait in the executor until room frees up. All calls must
+ * come from the thread running the executor. Destroying an executor
+ * destroys the coroutines still running; their requests must not complete
+ * afterwards, so release the device first.
+ */
+class executor {
+    class request_awaitable;
+
+public:
+    /**
+     * @brief Creates an executor for a device.
+     *
+     * @param dev The device; it must outlive the executor, and its callbacks
+     *            must not be used by anything else.
+     */
+    explicit executor(device &dev) : dev_(dev) {}
+
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+
+    /**
+     * @brief Starts a coroutine on the next run_once().
+     *
+     * @param root The coroutine; the executor owns it until it finishes.
+     */
+    void spawn(task<void> root) {
+        ready_.push_back(root.handle_);
+        roots_.push_back(std::move(root));
+    }
+
+    /**
+     * @brief Returns an awaitable submitting a request and suspending until it completes.
+     *
+     * @param function_id The function ID for the request.
+     * @param payload The payload; it must stay valid until the co_await returns.
+     * @return The awaitable, whose co_await yields a reply.
+     */
+    request_awaitable request(std::uint8_t function_id, std::span<const std::uint8_t> payload) {
+        return request_awaitable(*this, function_id, payload);
+    }
+
+    /**
+     * @brief Resumes every runnable coroutine, then waits for responses once.
+     *
+     * @param timeout_ms Passed to spi_process_responses(), -1 to wait until a
+     *                   response arrives or a deadline expires.
+     * @return Number of spawned coroutines still running, or -1 if processing failed.
+     */
+    int run_once(int timeout_ms) {
+        resume_ready();
+        if (roots_.empty()) {
+            return 0;
+        }
+        if (dev_.process_responses(timeout_ms) < 0) {
+            return -1;
+        }
+        resume_ready();
+        return static_cast<int>(roots_.size());
+    }
+
+    /**
+     * @brief Runs until every spawned coroutine has finished.
+     *
+     * @return 0 on success, -1 if processing failed.
+     */
+    int run() {
+        int live;
+        do {
+            live = run_once(-1);
+        } while (live > 0);
+        return live;
+    }
+
+private:
+    /**
+     * @brief Awaitable of one request.
+     */
+    class request_awaitable {
+    public:
+        request_awaitable(executor &exec, std::uint8_t function_id, std::span<const std::uint8_t> payload)
+            : exec_(exec), function_id_(function_id), payload_(payload) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            awaiting_ = awaiting;
+            if (exec_.blocked_.empty() && submit()) {
+                return true;
+            }
+            if (exec_.blocked_.empty() && (errno != EAGAIN)) {
+                fail();
+                return false;
+            }
+            exec_.blocked_.push_back(this);
+            return true;
+        }
+
+        reply await_resume() const noexcept { return reply_; }
+
+    private:
+        friend class executor;
+
+        /**
+         * @brief Submits the request.
+         *
+         * @return True if the request was accepted, otherwise errno is set.
+         */
+        bool submit() {
+            return exec_.dev_.submit(function_id_, payload_, [this](spi_error_t error, const response &resp) {
+                reply_.error = error;
+                reply_.function_id = resp.function_id;
+                reply_.sequence = resp.sequence;
+                reply_.payload_size = static_cast<std::uint16_t>(resp.payload.size());
+                (void)std::memcpy(reply_.data.data(), resp.payload.data(), resp.payload.size());
+                exec_.ready_.push_back(awaiting_);
+            }) >= 0;
+        }
+
+        /**
+         * @brief Completes a request that could not be submitted.
+         */
+        void fail() noexcept {
+            reply_.error = (errno == EMSGSIZE) ? SPI_ERROR_INVALID_FORMAT : SPI_ERROR_UNKNOWN;
+            reply_.function_id = function_id_;
+            reply_.sequence = 0U;
+            reply_.payload_size = 0U;
+        }
+
+        executor &exec_;
+        std::uint8_t function_id_;
+        std::span<const std::uint8_t> payload_;
+        std::coroutine_handle<> awaiting_;
+        reply reply_;
+    };
+
+    /**
+     * @brief Submits waiting requests, then resumes the runnable coroutines.
+     *
+     * Resumed coroutines may make further coroutines runnable; they are
+     * resumed in the same call. Finished spawned coroutines are destroyed,
+     * and the first exception one of them threw is rethrown.
+     */
+    void resume_ready() {
+        std::size_t waiting = 0U;
+        for (request_awaitable *req : blocked_) {
+            // Keep submission order: once one is refused, the rest wait too
+            if (waiting == 0U) {
+                if (req->submit()) {
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    req->fail();
+                    ready_.push_back(req->awaiting_);
+                    continue;
+                }
+            }
+            blocked_[waiting++] = req;
+        }
+        blocked_.resize(waiting);
+
+        while (!ready_.empty()) {
+            resuming_.swap(ready_);
+            for (std::coroutine_handle<> handle : resuming_) {
+                handle.resume();
+            }
+            resuming_.clear();
+        }
+
+        auto finished = std::stable_partition(roots_.begin(), roots_.end(), [](const task<void> &root) {
+            return !root.done();
+        });
+        std::exception_ptr failure;
+        for (auto it = finished; it != roots_.end(); ++it) {
+            if ((failure == nullptr) && (it->handle_.promise().exception != nullptr)) {
+                failure = it->handle_.promise().exception;
+            }
+        }
+        roots_.erase(finished, roots_.end());
+        if (failure != nullptr) {
+            std::rethrow_exception(failure);
+        }
+    }
+
+    device &dev_;
+    std::vector<task<void>> roots_;                 // Spawned coroutines still running
+    std::vector<std::coroutine_handle<>> ready_;    // Coroutines to resume
+    std::vector<std::coroutine_handle<>> resuming_; // Coroutines being resumed
+    std::vector<request_awaitable *> blocked_;      // Requests refused with EAGAIN, in order
+};
+
+} // namespace spi
+
+#endif // SPI_CORO_HPP
@@ -0,0 +1,114 @@
+#include "spi_crc.h"
+
+typedef uint32_t (*crc32_engine_t)(uint32_t crc, const uint8_t *data, size_t length);
+
+// SPI_CRC_ENGINE_AUTO: slice-by-8 is the fastest engine built, so it is
+// selected statically rather than probed at spi_open()
+static crc32_engine_t crc32_engine = crc32_update_slice8;
+
+/**
+ * @brief Reference engine: one table lookup per byte.
+ *
+ * @param crc The running CRC value.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update_bytewise(uint32_t crc, const uint8_t *data, size_t length) {
+    size_t byte;
+    uint8_t index;
+
+    for (byte = 0U; byte < length; byte++) {
+        index = (uint8_t)((crc >> 24U) ^ data[byte]);
+        crc = (crc32_table[0][index] ^ (crc << 8U));
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Slice-by-8 engine: eight independent table lookups per 8 bytes.
+ *
+ * The lookups of one block do not depend on each other, which lets the
+ * Cortex-A7 dual-issue them instead of waiting on the previous byte.
+ *
+ * @param crc The running CRC value.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= 8U) {
+        // Bytes are loaded one by one: no alignment requirement, endian independent
+        uint32_t high = crc ^ (((uint32_t)data[0] << 24U) | ((uint32_t)data[1] << 16U) |
+                               ((uint32_t)data[2] << 8U) | (uint32_t)data[3]);
+        crc = crc32_table[7][high >> 24U] ^
+              crc32_table[6][(high >> 16U) & 0xFFU] ^
+              crc32_table[5][(high >> 8U) & 0xFFU] ^
+              crc32_table[4][high & 0xFFU] ^
+              crc32_table[3][data[4]] ^
+              crc32_table[2][data[5]] ^
+              crc32_table[1][data[6]] ^
+              crc32_table[0][data[7]];
+        data += 8U;
+        length -= 8U;
+    }
+
+    return crc32_update_bytewise(crc, data, length);
+}
+
+/**
+ * @brief Feeds data into a running CRC with the selected engine.
+ *
+ * @param crc The running CRC value, CRC32_INITIAL_VALUE for a new CRC.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length) {
+    return crc32_engine(crc, data, length);
+}
+
+/**
+ * @brief Calculates the CRC32 checksum for a given data array.
+ *
+ * @param data The data array to calculate the CRC for.
+ * @param length The length of the data array.
+ * @return The CRC32 checksum.
+ */
+uint32_t calculate_crc32(const uint8_t *data, size_t length) {
+    return crc32_update(CRC32_INITIAL_VALUE, data, length) ^ CRC32_FINAL_XOR_VALUE;
+}
+
+/**
+ * @brief Returns the least significant byte (LSB) of the CRC32 checksum.
+ *
+ * @param data The data array to calculate the CRC for.
+ * @param length The length of the data array.
+ * @return The LSB of the CRC32 checksum.
+ */
+uint8_t get_crc32_lsb_byte(const uint8_t *data, size_t length) {
+    uint32_t crc32_value = calculate_crc32(data, length);
+    return (uint8_t)(crc32_value & 0xFF);
+}
+
+/**
+ * @brief Selects the engine used for frame CRCs.
+ *
+ * @param engine The engine to use, SPI_CRC_ENGINE_AUTO for the fastest one.
+ * @return 0 on success, -1 if the engine is not available.
+ */
+int spi_crc_select(spi_crc_engine_t engine) {
+    switch (engine) {
+    case SPI_CRC_ENGINE_BYTEWISE:
+        crc32_engine = crc32_update_bytewise;
+        break;
+    case SPI_CRC_ENGINE_AUTO:
+    case SPI_CRC_ENGINE_SLICE8:
+        crc32_engine = crc32_update_slice8;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file spi_crc.h
+ * @brief Internal interface of the CRC32 engines used for frame validation.
+ *
+ * The frame CRC is the CRC-32/MPEG-2 variant (polynomial 0x04C11DB7, MSB
+ * first, initial value 0xFFFFFFFF, no final XOR); only its least significant
+ * byte is transmitted. Several engines compute the same value; the lookup
+ * tables they share are generated at build time by crc32_tables.cmake.
+ */
+
+#ifndef SPI_CRC_H
+#define SPI_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spi_lib.h"
+
+// CRC32 constants
+#define CRC32_POLYNOMIAL 0x04C11DB7U
+#define CRC32_INITIAL_VALUE 0xFFFFFFFFU
+#define CRC32_FINAL_XOR_VALUE 0x00000000U
+
+// Number of slice tables generated by crc32_tables.cmake
+#define CRC32_TABLE_SLICES 8U
+
+/**
+ * @brief Precomputed CRC32 tables, read-only.
+ *
+ * crc32_table[0] is the classic byte table; crc32_table[k] advances a byte
+ * that is followed by k more bytes.
+ */
+extern const uint32_t crc32_table[CRC32_TABLE_SLICES][256];
+
+/**
+ * @brief Reference engine: one table lookup per byte.
+ *
+ * @param crc The running CRC value.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update_bytewise(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief Slice-by-8 engine: eight independent table lookups per 8 bytes.
+ *
+ * @param crc The running CRC value.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief Feeds data into a running CRC with the selected engine.
+ *
+ * @param crc The running CRC value, CRC32_INITIAL_VALUE for a new CRC.
+ * @param data The data array to feed into the CRC.
+ * @param length The length of the data array.
+ * @return The updated CRC value.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief Calculates the CRC32 checksum for a given data array.
+ *
+ * @param data The data array to calculate the CRC for.
+ * @param length The length of the data array.
+ * @return The CRC32 checksum.
+ */
+uint32_t calculate_crc32(const uint8_t *data, size_t length);
+
+/**
+ * @brief Returns the least significant byte (LSB) of the CRC32 checksum.
+ *
+ * @param data The data array to calculate the CRC for.
+ * @param length The length of the data array.
+ * @return The LSB of the CRC32 checksum.
+ */
+uint8_t get_crc32_lsb_byte(const uint8_t *data, size_t length);
+
+#endif // SPI_CRC_H
@@ -0,0 +1,136 @@
+/**
+ * @file spi_crc_test.c
+ * @brief Unit test of the CRC32 engines.
+ *
+ * Checks the generated tables against the bit-by-bit computation the
+ * library used to run at startup, the engines against each other for every
+ * payload length and alignment, and the frame CRC against known vectors.
+ */
+
+#include "spi_crc.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_MAX_LENGTH 1024U
+#define TEST_MAX_OFFSET 8U
+
+static int failures;
+
+/**
+ * @brief Records a failed check.
+ *
+ * @param condition The checked condition.
+ * @param what Description of the check, printed when it fails.
+ */
+static void check(int condition, const char *what) {
+    if (!condition) {
+        (void)fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * @brief Computes one entry of the byte table bit by bit.
+ *
+ * @param dividend The table index.
+ * @return The table entry.
+ */
+static uint32_t reference_entry(uint32_t dividend) {
+    uint32_t remainder = dividend << 24U;
+
+    for (uint8_t bit = 8U; bit > 0U; bit--) {
+        if ((remainder & 0x80000000U) != 0U) {
+            remainder = (remainder << 1U) ^ CRC32_POLYNOMIAL;
+        } else {
+            remainder = (remainder << 1U);
+        }
+    }
+    return remainder;
+}
+
+/**
+ * @brief Checks the generated tables against the bit-by-bit computation.
+ */
+static void test_tables(void) {
+    for (uint32_t dividend = 0U; dividend < 256U; dividend++) {
+        if (crc32_table[0][dividend] != reference_entry(dividend)) {
+            check(0, "crc32_table[0] matches the bit-by-bit table");
+            return;
+        }
+        // Table k advances a byte followed by k zero bytes
+        uint32_t value = crc32_table[0][dividend];
+        for (size_t k = 1U; k < CRC32_TABLE_SLICES; k++) {
+            value = crc32_table[0][value >> 24U] ^ (value << 8U);
+            if (crc32_table[k][dividend] != value) {
+                check(0, "crc32_table[k] advances the byte table by k bytes");
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks that slice-by-8 matches the bytewise engine for every length and alignment.
+ */
+static void test_engines(void) {
+    static uint8_t data[TEST_MAX_LENGTH + TEST_MAX_OFFSET];
+    static const uint32_t seeds[] = {CRC32_INITIAL_VALUE, 0x00000000U, 0x12345678U};
+    uint32_t random = 0x2545F491U;
+
+    for (size_t i = 0U; i < sizeof(data); i++) {
+        random ^= random << 13U;
+        random ^= random >> 17U;
+        random ^= random << 5U;
+        data[i] = (uint8_t)random;
+    }
+
+    for (size_t s = 0U; s < sizeof(seeds) / sizeof(seeds[0]); s++) {
+        for (size_t offset = 0U; offset < TEST_MAX_OFFSET; offset++) {
+            for (size_t length = 0U; length <= TEST_MAX_LENGTH; length++) {
+                if (crc32_update_slice8(seeds[s], &data[offset], length) !=
+                    crc32_update_bytewise(seeds[s], &data[offset], length)) {
+                    (void)fprintf(stderr, "seed 0x%08X, offset %zu, length %zu\n", seeds[s], offset, length);
+                    check(0, "slice-by-8 matches bytewise");
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks the frame CRC of every engine against known vectors.
+ */
+static void test_vectors(void) {
+    static const uint8_t check_string[] = "123456789";
+    static const spi_crc_engine_t engines[] = {SPI_CRC_ENGINE_BYTEWISE, SPI_CRC_ENGINE_SLICE8, SPI_CRC_ENGINE_AUTO};
+
+    for (size_t i = 0U; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        check(spi_crc_select(engines[i]) == 0, "spi_crc_select() accepts the engine");
+        // CRC-32/MPEG-2 check value
+        check(calculate_crc32(check_string, sizeof(check_string) - 1U) == 0x0376E6E7U,
+              "CRC-32/MPEG-2 of \"123456789\" is 0x0376E6E7");
+        check(calculate_crc32(NULL, 0U) == CRC32_INITIAL_VALUE, "CRC of no data is the initial value");
+        check(get_crc32_lsb_byte(check_string, sizeof(check_string) - 1U) == 0xE7U,
+              "frame CRC byte of \"123456789\" is 0xE7");
+    }
+    check(spi_crc_select((spi_crc_engine_t)-1) == -1, "spi_crc_select() rejects an unknown engine");
+}
+
+/**
+ * @brief Runs every check.
+ *
+ * @return 0 if all checks passed, 1 otherwise.
+ */
+int main(void) {
+    test_tables();
+    test_engines();
+    test_vectors();
+
+    if (failures != 0) {
+        (void)fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    (void)printf("All CRC checks passed\n");
+    return 0;
+}
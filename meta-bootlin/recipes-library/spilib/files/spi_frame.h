@@ -0,0 +1,43 @@
+/**
+ * @file spi_frame.h
+ * @brief Internal interface of the frame codec.
+ *
+ * The library encodes and validates frames on its own; these entry points
+ * exist so that spi_lib_bench can time the codec without a bus.
+ */
+
+#ifndef SPI_FRAME_H
+#define SPI_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spi_lib.h"
+
+#define SPI_FRAME_MAX_SIZE 1033U  // Version 2 frame with a 1024-byte payload
+
+/**
+ * @brief Encodes a request frame into a buffer.
+ *
+ * @param protocol The framing protocol.
+ * @param buffer Destination buffer, at least SPI_FRAME_MAX_SIZE bytes.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data, at most 1024 bytes.
+ * @return The total size of the encoded frame.
+ */
+size_t spi_frame_encode(spi_protocol_t protocol, uint8_t *buffer, uint16_t sequence, uint8_t function_id,
+                        const uint8_t *payload, uint16_t payload_size);
+
+/**
+ * @brief Validates a received frame and parses it into a response.
+ *
+ * @param protocol The framing protocol of the frame.
+ * @param frame The received bytes.
+ * @param length The number of received bytes.
+ * @param response The response structure to fill; its payload points into frame.
+ * @return SPI_SUCCESS or the error code describing why the frame was rejected.
+ */
+spi_error_t spi_frame_decode(spi_protocol_t protocol, const uint8_t *frame, size_t length, spi_response_t *response);
+
+#endif // SPI_FRAME_H
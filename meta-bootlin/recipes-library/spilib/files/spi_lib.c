@@ -1,5 +1,13 @@
+#define _GNU_SOURCE // For pthread_attr_setaffinity_np
 #include "spi_lib.h"
+#include "spi_crc.h"
+#include "spi_pool.h"
+#include "spi_stats.h"
+#include "spi_transport.h"
+#include "spi_frame.h"
+#include "spi_stream.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -9,6 +17,15 @@
 #include <poll.h>
 #include <errno.h>
 #include <stdarg.h> // Include for va_start and va_end
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #define SPI_DEVICE "/dev/spidev0.0"
 #define SPI_MODE SPI_MODE_0
@@ -24,8 +41,23 @@
 #define MAX_PAYLOAD_SIZE 1024
 #define MESSAGE_SIZE (START_IDENTIFIER_SIZE + 1 + 2 + MAX_PAYLOAD_SIZE + 1 + STOP_IDENTIFIER_SIZE)
 #define SIZE_CRC8   1
+#define FRAME_HEADER_SIZE (START_IDENTIFIER_SIZE + 1U + 2U)
+#define FRAME_SIZE(payload_size) (START_IDENTIFIER_SIZE + 1U + 2U + (size_t)(payload_size) + SIZE_CRC8 + STOP_IDENTIFIER_SIZE)
+#define SIZE_SEQUENCE 1U  // Version 2 frames carry a sequence byte after the function ID
+#define FRAME_BUFFER_SIZE (MESSAGE_SIZE + SIZE_SEQUENCE)
+#define PENDING_TABLE_SIZE 256U  // One entry per value of the sequence byte
+#define BATCH_MAX_BYTES 4096U  // spidev default bufsiz, the limit for one SPI_IOC_MESSAGE
+#define SUBMIT_QUEUE_SIZE 32U  // Requests waiting for a free in-flight slot
+#define RX_RING_SIZE 32U       // Frames buffered between receiver thread and application
+#define RECEIVER_POLL_MS 100   // Receiver thread checks for stop requests at this interval
+#define RECEIVER_DEFAULT_PRIORITY 80
+#define STREAM_CHUNK_DEFAULT 1024U
+#define STREAM_MAX_CHUNKS 16U    // Chunks read back to back for one edge before waiting again
+#define CACHE_LINE_SIZE 64
+#define DEVICE_PATH_SIZE 64
 
 const uint8_t START_IDENTIFIER[START_IDENTIFIER_SIZE] = {0x48, 0x5A};
+const uint8_t START_IDENTIFIER_V2[START_IDENTIFIER_SIZE] = {0x48, 0x5B};
 const uint8_t STOP_IDENTIFIER[STOP_IDENTIFIER_SIZE] = {0x0D, 0x0A};
 
 typedef struct {
@@ -37,18 +69,170 @@ typedef struct {
     // uint8_t stop_identifier[STOP_IDENTIFIER_SIZE];  // Same as above
 } spi_message_t;
 
-// CRC32 constants
-#define CRC32_POLYNOMIAL 0x04C11DB7U
-#define CRC32_INITIAL_VALUE 0xFFFFFFFFU
-#define CRC32_FINAL_XOR_VALUE 0x00000000U
+/**
+ * @brief A transfer split into fragments by spi_submit_bulk().
+ */
+typedef struct {
+    uint8_t active;              // Slot in use, until every fragment has completed
+    uint8_t finished;            // The callback has run
+    uint8_t function_id;
+    const uint8_t *request;      // Request data, borrowed from the caller
+    uint32_t request_size;
+    uint32_t request_sent;       // Request bytes submitted
+    uint8_t request_done;        // The last request fragment has been submitted
+    uint8_t acknowledged;        // The last request fragment has been answered
+    uint16_t last_sequence;      // Sequence tag of the last request fragment
+    uint8_t *response;           // Response buffer, borrowed from the caller
+    size_t response_capacity;
+    uint8_t response_known;      // response_total has been announced by the slave
+    uint32_t response_total;
+    uint32_t response_received;
+    uint32_t chunk;              // Data bytes of the latest response fragment
+    unsigned int outstanding;    // Fragments submitted and not completed
+    unsigned int polls;          // Of those, fragments polling for the response
+    spi_bulk_callback_t callback;
+} spi_bulk_t;
+
+/**
+ * @brief A request that has been transmitted and awaits its response.
+ */
+typedef struct {
+    uint16_t sequence;        // Sequence tag handed out by spi_submit()
+    uint8_t function_id;      // Function ID of the request
+    uint8_t active;           // Non-zero while the request awaits its response
+    spi_callback_t callback;  // Callback to invoke on completion
+    spi_bulk_t *bulk;         // Transfer the request is a fragment of, NULL for ordinary requests
+    uint64_t deadline_ns;     // CLOCK_MONOTONIC deadline, 0 for none
+    uint64_t submit_ns;       // CLOCK_MONOTONIC time the request was submitted
+} spi_inflight_t;
+
+/**
+ * @brief A request waiting in the submission queue for an in-flight slot.
+ */
+typedef struct {
+    uint16_t sequence;
+    uint8_t function_id;
+    uint16_t payload_size;
+    spi_priority_t priority;
+    spi_callback_t callback;
+    spi_bulk_t *bulk;
+    uint64_t deadline_ns;
+    uint64_t submit_ns;
+    uint8_t payload[MAX_PAYLOAD_SIZE];  // Private copy, the caller's buffer may be gone
+} spi_queued_request_t;
+
+/**
+ * @brief A frame read and validated by the receiver thread.
+ */
+typedef struct {
+    spi_error_t error;                // Result of the frame validation
+    spi_response_t response;          // Parsed response, payload points into frame
+    uint8_t *frame;                   // FRAME_BUFFER_SIZE bytes from the context's pool
+} spi_rx_slot_t;
 
-static int spi_fd;
-static struct gpiod_line *gpio_line;
-static struct gpiod_chip *gpio_chip;
-static uint8_t response_buffer[MESSAGE_SIZE];
+/**
+ * @brief Entry of the per-function ID handler table.
+ */
+typedef struct {
+    spi_handler_t handler;  // NULL when no handler is registered
+    void *user;
+} spi_handler_entry_t;
 
-// Precomputed CRC32 table for fast CRC calculations
-static uint32_t crc32_table[256];
+/**
+ * @brief State of one SPI slave: its spidev node, interrupt line and buffers.
+ */
+struct spi_ctx {
+    char spi_device[DEVICE_PATH_SIZE];
+    char gpio_chip_path[DEVICE_PATH_SIZE];
+    unsigned int gpio_pin;
+    uint8_t mode;
+    uint8_t bits_per_word;
+    uint32_t speed_hz;
+
+    const spi_transport_ops_t *transport;
+    void *transport_priv;
+    int spi_fd;
+    struct gpiod_line *gpio_line;
+    struct gpiod_chip *gpio_chip;
+    // Every transfer buffer comes from these locked pools: frames for reads,
+    // a staging area for batches, the stream reassembly buffer, and the 0xFF
+    // filler clocked out on reads
+    spi_pool_t frame_pool;
+    spi_pool_t batch_pool;
+    spi_pool_t stream_pool;
+    uint8_t *response_buffer;
+    uint8_t *batch_buffer;
+
+    // Pending table of the in-flight requests, indexed by the low byte of their
+    // sequence tag. Tags are handed out in transmission order, so every active
+    // entry lies between inflight_oldest and next_sequence.
+    spi_inflight_t inflight[PENDING_TABLE_SIZE];
+    uint16_t inflight_oldest;
+    size_t inflight_count;
+    size_t exchanging;      // 1 while a transmitted duplex request waits to be recorded in flight
+    unsigned int pipeline_depth;
+
+    // Queued requests share one pool of slots; every priority class keeps
+    // the indices of its slots in submission order
+    spi_queued_request_t submit_queue[SUBMIT_QUEUE_SIZE];
+    uint32_t queue_used;    // Bit n set while slot n holds a request
+    uint8_t class_queue[SPI_PRIORITY_CLASSES][SUBMIT_QUEUE_SIZE];
+    size_t class_head[SPI_PRIORITY_CLASSES];
+    size_t class_count[SPI_PRIORITY_CLASSES];
+    size_t queue_count;     // Requests queued in all classes
+
+    // Bulk transfers in progress; their fragments carry a pointer to them
+    // through the submission queue and the pending table
+    spi_bulk_t bulks[SPI_MAX_BULK];
+
+    uint16_t next_sequence;
+    spi_read_mode_t read_mode;
+    spi_protocol_t protocol;
+    spi_stream_t stream;    // Reassembler of SPI_READ_STREAM, used by the reading thread only
+    size_t stream_chunk;
+    int request_timeout_ms;
+    size_t duplex_window;   // Bytes clocked in while transmitting, 0 when duplex is off
+
+    // Single-producer (receiver thread) / single-consumer (application) ring.
+    // Head and tail live on separate cache lines so that the two sides do not
+    // bounce a shared line on every frame.
+    spi_rx_slot_t rx_ring[RX_RING_SIZE];
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t rx_head;  // Written by the receiver thread only
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t rx_tail;  // Written by the application only
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong rx_dropped;
+    uint8_t *rx_scratch;   // Sink for frames that do not fit in the ring
+
+    // Serializes bus access between the application and the receiver thread;
+    // a two-phase read spans two ioctls that nothing may be interleaved with
+    pthread_mutex_t bus_lock;
+
+    // Transfer counters and histograms are updated under bus_lock, the request
+    // ones by the thread that completes requests, which also owns the context
+    spi_stats_t stats;
+    uint64_t edges_ns[SPI_DRAIN_BUDGET_MAX];  // Kernel timestamps of the edges read by the last wakeup
+    unsigned int edge_count;
+    unsigned int edge_next;    // Oldest of those edges whose frame has not been read
+    unsigned int edges_early;  // Frames a duplex exchange clocked in before their edge was read
+    uint64_t last_wakeup_ns;   // When poll() returned for those edges
+    int last_wakeup_cpu;
+    unsigned int drain_budget; // Edges read and frames serviced per wakeup
+    uint64_t slow_wakeup_ns;   // Tracing threshold, 0 when disabled
+    spi_wakeup_trace_t slow_wakeups[SPI_WAKEUP_TRACE_SIZE];
+    size_t slow_wakeup_head;   // Oldest trace
+    size_t slow_wakeup_count;
+
+    pthread_t receiver_thread;
+    atomic_int receiver_running;
+    int receiver_event_fd;   // Signalled after every frame pushed to the ring
+    int receiver_priority;
+    int receiver_cpu;
+    spi_callback_t receive_callback;
+    spi_handler_entry_t handlers[PENDING_TABLE_SIZE];  // Indexed by function ID
+};
+
+// Context behind the original single-device API (spi_init(), send_request(), ...)
+static spi_ctx_t default_ctx;
+static pthread_once_t default_ctx_once = PTHREAD_ONCE_INIT;
 
 /**
  * @brief Prints a formatted debug message if DEBUG is enabled.
@@ -66,58 +250,27 @@ static void debug_print(const char* format, ...) {
 }
 
 /**
- * @brief Initializes the CRC32 lookup table.
+ * @brief Returns the current CLOCK_MONOTONIC time.
  *
- * This function precomputes the CRC32 lookup table for efficient CRC calculation.
+ * @return Time in nanoseconds.
  */
-static void crc32_init_table(void) {
-    uint32_t remainder;
-    uint32_t dividend;
-    uint8_t bit;
-
-    for (dividend = 0U; dividend < 256U; dividend++) {
-        remainder = dividend << 24U;
-        for (bit = 8U; bit > 0U; bit--) {
-            if ((remainder & 0x80000000U) != 0U) {
-                remainder = (remainder << 1U) ^ CRC32_POLYNOMIAL;
-            } else {
-                remainder = (remainder << 1U);
-            }
-        }
-        crc32_table[dividend] = remainder;
-    }
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
 }
 
 /**
- * @brief Calculates the CRC32 checksum for a given data array.
+ * @brief Converts a relative timeout into an absolute deadline.
  *
- * @param data The data array to calculate the CRC for.
- * @param length The length of the data array.
- * @return The CRC32 checksum.
+ * @param timeout_ms Timeout in milliseconds, 0 or negative for none.
+ * @return The CLOCK_MONOTONIC deadline in nanoseconds, 0 for none.
  */
-uint32_t calculate_crc32(const uint8_t *data, size_t length) {
-    uint32_t crc = CRC32_INITIAL_VALUE;
-    size_t byte;
-    uint8_t index;
-
-    for (byte = 0U; byte < length; byte++) {
-        index = (uint8_t)((crc >> 24U) ^ data[byte]);
-        crc = (crc32_table[index] ^ (crc << 8U));
+static uint64_t deadline_after(int timeout_ms) {
+    if (timeout_ms <= 0) {
+        return 0U;
     }
-
-    return crc ^ CRC32_FINAL_XOR_VALUE;
-}
-
-/**
- * @brief Returns the least significant byte (LSB) of the CRC32 checksum.
- *
- * @param data The data array to calculate the CRC for.
- * @param length The length of the data array.
- * @return The LSB of the CRC32 checksum.
- */
-uint8_t get_crc32_lsb_byte(const uint8_t *data, size_t length) {
-    uint32_t crc32_value = calculate_crc32(data, length);
-    return (uint8_t)(crc32_value & 0xFF);
+    return monotonic_ns() + ((uint64_t)timeout_ms * 1000000ULL);
 }
 
 /**
@@ -153,49 +306,324 @@ void bind_spidev_driver(void) {
 }
 
 /**
- * @brief Initializes the SPI device.
+ * @brief Issues one SPI message on the spidev node of a context.
+ *
+ * @param priv The device context.
+ * @param segments The transfer segments of the message.
+ * @param count Number of transfer segments.
+ * @return The bytes transferred, or -1 with errno set.
+ */
+static int spidev_transfer(void *priv, struct spi_ioc_transfer *segments, size_t count) {
+    const spi_ctx_t *ctx = priv;
+    return ioctl(ctx->spi_fd, SPI_IOC_MESSAGE(count), segments);
+}
+
+/**
+ * @brief Changes the default clock frequency of the spidev node.
+ *
+ * @param priv The device context.
+ * @param speed_hz The clock frequency in Hz.
+ * @return 0 on success, -1 with errno set.
+ */
+static int spidev_set_speed(void *priv, uint32_t speed_hz) {
+    const spi_ctx_t *ctx = priv;
+    uint32_t speed = speed_hz;
+    return (ioctl(ctx->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) ? -1 : 0;
+}
+
+/**
+ * @brief Returns the line event file descriptor of the interrupt line.
+ *
+ * @param priv The device context.
+ * @return The file descriptor.
+ */
+static int spidev_event_fd(void *priv) {
+    const spi_ctx_t *ctx = priv;
+    return gpiod_line_event_get_fd(ctx->gpio_line);
+}
+
+/**
+ * @brief Reads the queued events of the interrupt line with a single read().
+ *
+ * Only called once the line polled readable, so the read does not block; it
+ * returns at least one and at most max of the events queued by the kernel.
+ *
+ * @param priv The device context.
+ * @param timestamps_ns Receives the kernel timestamps of the rising edges.
+ * @param max Maximum number of events to read, at most SPI_DRAIN_BUDGET_MAX.
+ * @return Number of rising edges read, -1 on error.
+ */
+static int spidev_read_events(void *priv, uint64_t *timestamps_ns, unsigned int max) {
+    const spi_ctx_t *ctx = priv;
+    struct gpiod_line_event events[SPI_DRAIN_BUDGET_MAX];
+    int rising = 0;
+
+    int count = gpiod_line_event_read_multiple(ctx->gpio_line, events, max);
+    if (count < 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (events[i].event_type == GPIOD_LINE_EVENT_RISING_EDGE) {
+            // Line event timestamps are taken from CLOCK_MONOTONIC since Linux 5.7
+            timestamps_ns[rising++] = ((uint64_t)events[i].ts.tv_sec * 1000000000ULL) + (uint64_t)events[i].ts.tv_nsec;
+        }
+    }
+    return rising;
+}
+
+/**
+ * @brief Releases the interrupt line and closes the spidev node.
+ *
+ * @param priv The device context.
+ */
+static void spidev_close(void *priv) {
+    spi_ctx_t *ctx = priv;
+    gpiod_line_release(ctx->gpio_line);
+    gpiod_chip_close(ctx->gpio_chip);
+    (void)close(ctx->spi_fd);
+}
+
+static const spi_transport_ops_t spidev_transport = {
+    .name = "spidev",
+    .transfer = spidev_transfer,
+    .set_speed = spidev_set_speed,
+    .event_fd = spidev_event_fd,
+    .read_events = spidev_read_events,
+    .close = spidev_close,
+};
+
+/**
+ * @brief Fills a configuration with the settings of the original single-device API.
+ *
+ * @param config The configuration to initialize.
+ */
+void spi_config_init(spi_config_t *config) {
+    (void)memset(config, 0, sizeof(*config));
+    config->spi_device = SPI_DEVICE;
+    config->mode = SPI_MODE;
+    config->bits_per_word = SPI_BITS_PER_WORD;
+    config->speed_hz = SPI_SPEED;
+    config->gpio_chip = GPIO_CHIP;
+    config->gpio_pin = GPIO_PIN;
+    config->backend = SPI_BACKEND_SPIDEV;
+    config->loopback = NULL;
+}
+
+/**
+ * @brief Initializes a context from a configuration, without opening any device.
+ *
+ * @param ctx The context to initialize.
+ * @param config The configuration, or NULL for the defaults of spi_config_init().
+ */
+static void init_context(spi_ctx_t *ctx, const spi_config_t *config) {
+    spi_config_t defaults;
+
+    if (config == NULL) {
+        spi_config_init(&defaults);
+        config = &defaults;
+    }
+
+    (void)snprintf(ctx->spi_device, sizeof(ctx->spi_device), "%s", config->spi_device);
+    (void)snprintf(ctx->gpio_chip_path, sizeof(ctx->gpio_chip_path), "%s", config->gpio_chip);
+    ctx->gpio_pin = config->gpio_pin;
+    ctx->mode = config->mode;
+    ctx->bits_per_word = config->bits_per_word;
+    ctx->speed_hz = config->speed_hz;
+
+    ctx->transport = &spidev_transport;
+    ctx->transport_priv = ctx;
+    ctx->spi_fd = -1;
+    ctx->pipeline_depth = 1U;
+    ctx->read_mode = SPI_READ_FIXED;
+    ctx->protocol = SPI_PROTOCOL_V1;
+    ctx->stream_chunk = STREAM_CHUNK_DEFAULT;
+    ctx->drain_budget = 1U;
+    ctx->request_timeout_ms = SPI_DEFAULT_TIMEOUT_MS;
+    ctx->receiver_event_fd = -1;
+    ctx->receiver_priority = RECEIVER_DEFAULT_PRIORITY;
+    ctx->receiver_cpu = -1;
+    ctx->slow_wakeup_ns = (uint64_t)SPI_SLOW_WAKEUP_DEFAULT_US * 1000U;
+    (void)pthread_mutex_init(&ctx->bus_lock, NULL);
+}
+
+/**
+ * @brief Initializes the context behind the original single-device API.
+ */
+static void init_default_ctx(void) {
+    init_context(&default_ctx, NULL);
+}
+
+/**
+ * @brief Allocates the transfer buffers of a context from its locked pools.
+ *
+ * @param ctx The context to allocate the buffers for.
+ * @return 0 on success, -1 on failure.
+ */
+static int create_buffers(spi_ctx_t *ctx) {
+    // One frame per ring slot, plus the response buffer and the scratch frame
+    if (spi_pool_create(&ctx->frame_pool, RX_RING_SIZE + 2U, FRAME_BUFFER_SIZE, FRAME_BUFFER_SIZE) < 0) {
+        perror("Failed to allocate SPI frame buffers");
+        return -1;
+    }
+    if (spi_pool_create(&ctx->batch_pool, 1U, BATCH_MAX_BYTES, 0U) < 0) {
+        perror("Failed to allocate SPI batch buffer");
+        spi_pool_destroy(&ctx->frame_pool);
+        return -1;
+    }
+    // A partial frame carried over plus a whole chunk, and a chunk of filler
+    if (spi_pool_create(&ctx->stream_pool, 1U, SPI_STREAM_CARRY_MAX + SPI_STREAM_CHUNK_MAX, SPI_STREAM_CHUNK_MAX) < 0) {
+        perror("Failed to allocate SPI stream buffer");
+        spi_pool_destroy(&ctx->batch_pool);
+        spi_pool_destroy(&ctx->frame_pool);
+        return -1;
+    }
+    if (!ctx->frame_pool.locked || !ctx->batch_pool.locked || !ctx->stream_pool.locked) {
+        debug_print("Warning: SPI buffers could not be locked in memory\n");
+    }
+
+    ctx->response_buffer = spi_pool_get(&ctx->frame_pool);
+    ctx->rx_scratch = spi_pool_get(&ctx->frame_pool);
+    for (size_t i = 0U; i < RX_RING_SIZE; i++) {
+        ctx->rx_ring[i].frame = spi_pool_get(&ctx->frame_pool);
+    }
+    ctx->batch_buffer = spi_pool_get(&ctx->batch_pool);
+    spi_stream_init(&ctx->stream, spi_pool_get(&ctx->stream_pool), SPI_STREAM_CARRY_MAX + SPI_STREAM_CHUNK_MAX);
+    return 0;
+}
+
+/**
+ * @brief Returns the transfer buffers of a context to the system.
+ *
+ * @param ctx The context to free the buffers of.
+ */
+static void destroy_buffers(spi_ctx_t *ctx) {
+    spi_pool_destroy(&ctx->stream_pool);
+    spi_pool_destroy(&ctx->batch_pool);
+    spi_pool_destroy(&ctx->frame_pool);
+    ctx->response_buffer = NULL;
+    ctx->rx_scratch = NULL;
+    ctx->batch_buffer = NULL;
+    spi_stream_init(&ctx->stream, NULL, 0U);
+    for (size_t i = 0U; i < RX_RING_SIZE; i++) {
+        ctx->rx_ring[i].frame = NULL;
+    }
+}
+
+/**
+ * @brief Opens and configures the spidev node of a context.
  *
  * This function configures the SPI device with the specified mode, bits per word, and speed.
+ *
+ * @param ctx The context to open the SPI device for.
+ * @return 0 on success, -1 on failure.
  */
-void spi_init(void) {
+static int open_spi_device(spi_ctx_t *ctx) {
     int ret;
-    uint8_t mode = SPI_MODE;
-    uint8_t bits = SPI_BITS_PER_WORD;
-    uint32_t speed = SPI_SPEED;
+    uint8_t mode = ctx->mode;
+    uint8_t bits = ctx->bits_per_word;
+    uint32_t speed = ctx->speed_hz;
 
-    // Initialize the CRC32 table
-    crc32_init_table();
+    if (create_buffers(ctx) < 0) {
+        return -1;
+    }
 
-    spi_fd = open(SPI_DEVICE, O_RDWR);
-    if (spi_fd < 0) {
+    ctx->spi_fd = open(ctx->spi_device, O_RDWR);
+    if (ctx->spi_fd < 0) {
         perror("Failed to open SPI device");
-        exit(EXIT_FAILURE);
+        destroy_buffers(ctx);
+        return -1;
     }
-    debug_print("SPI device opened: %s\n", SPI_DEVICE);
+    debug_print("SPI device opened: %s\n", ctx->spi_device);
 
-    ret = ioctl(spi_fd, SPI_IOC_WR_MODE, &mode);
+    ret = ioctl(ctx->spi_fd, SPI_IOC_WR_MODE, &mode);
     if (ret < 0) {
         perror("Failed to set SPI mode");
-        (void)close(spi_fd);
-        exit(EXIT_FAILURE);
+        (void)close(ctx->spi_fd);
+        destroy_buffers(ctx);
+        return -1;
     }
     debug_print("SPI mode set to %d\n", (int)mode);
 
-    ret = ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+    ret = ioctl(ctx->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
     if (ret < 0) {
         perror("Failed to set bits per word");
-        (void)close(spi_fd);
-        exit(EXIT_FAILURE);
+        (void)close(ctx->spi_fd);
+        destroy_buffers(ctx);
+        return -1;
     }
     debug_print("SPI bits per word set to %d\n", (int)bits);
 
-    ret = ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+    ret = ioctl(ctx->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
     if (ret < 0) {
         perror("Failed to set SPI speed");
-        (void)close(spi_fd);
-        exit(EXIT_FAILURE);
+        (void)close(ctx->spi_fd);
+        destroy_buffers(ctx);
+        return -1;
     }
     debug_print("SPI speed set to %u Hz\n", speed);
+    return 0;
+}
+
+/**
+ * @brief Requests the interrupt line of a context for rising edge events.
+ *
+ * @param ctx The context to open the GPIO line for.
+ * @return 0 on success, -1 on failure.
+ */
+static int open_gpio_line(spi_ctx_t *ctx) {
+    ctx->gpio_chip = gpiod_chip_open(ctx->gpio_chip_path);
+    if (ctx->gpio_chip == NULL) {
+        perror("Failed to open GPIO chip");
+        return -1;
+    }
+
+    ctx->gpio_line = gpiod_chip_get_line(ctx->gpio_chip, ctx->gpio_pin);
+    if (ctx->gpio_line == NULL) {
+        perror("Failed to get GPIO line");
+        gpiod_chip_close(ctx->gpio_chip);
+        return -1;
+    }
+
+    if (gpiod_line_request_rising_edge_events(ctx->gpio_line, CONSUMER) < 0) {
+        perror("Failed to request GPIO line as interrupt");
+        gpiod_chip_close(ctx->gpio_chip);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Connects a context to a simulated slave instead of a device.
+ *
+ * @param ctx The context to connect.
+ * @param params Behaviour of the simulated slave, or NULL for the defaults.
+ * @return 0 on success, -1 on failure.
+ */
+static int open_loopback(spi_ctx_t *ctx, const spi_loopback_params_t *params) {
+    if (create_buffers(ctx) < 0) {
+        return -1;
+    }
+    ctx->transport_priv = spi_loopback_open(params, ctx->speed_hz);
+    if (ctx->transport_priv == NULL) {
+        perror("Failed to create loopback SPI slave");
+        destroy_buffers(ctx);
+        return -1;
+    }
+    ctx->transport = &spi_loopback_transport;
+    debug_print("SPI loopback slave created\n");
+    return 0;
+}
+
+/**
+ * @brief Initializes the SPI device.
+ *
+ * This function configures the SPI device with the specified mode, bits per word, and speed.
+ */
+void spi_init(void) {
+    (void)pthread_once(&default_ctx_once, init_default_ctx);
+    if (open_spi_device(&default_ctx) < 0) {
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
@@ -204,7 +632,8 @@ void spi_init(void) {
  * This function closes the file descriptor for the SPI device.
  */
 void spi_close(void) {
-    (void)close(spi_fd);
+    (void)close(default_ctx.spi_fd);
+    destroy_buffers(&default_ctx);
     debug_print("SPI device closed\n");
 }
 
@@ -214,34 +643,74 @@ void spi_close(void) {
  * This function sets up the specified GPIO pin for detecting rising edge interrupts.
  */
 void gpio_init(void) {
-    gpio_chip = gpiod_chip_open(GPIO_CHIP);
-    if (gpio_chip == NULL) {
-        perror("Failed to open GPIO chip");
+    (void)pthread_once(&default_ctx_once, init_default_ctx);
+    if (open_gpio_line(&default_ctx) < 0) {
         exit(EXIT_FAILURE);
     }
+}
 
-    gpio_line = gpiod_chip_get_line(gpio_chip, GPIO_PIN);
-    if (gpio_line == NULL) {
-        perror("Failed to get GPIO line");
-        gpiod_chip_close(gpio_chip);
-        exit(EXIT_FAILURE);
+/**
+ * @brief Releases the GPIO resources.
+ *
+ * This function releases the GPIO line and closes the GPIO chip.
+ */
+void gpio_close(void) {
+    gpiod_line_release(default_ctx.gpio_line);
+    gpiod_chip_close(default_ctx.gpio_chip);
+}
+
+/**
+ * @brief Opens a SPI slave described by a configuration.
+ *
+ * @param config The device configuration, or NULL for the defaults.
+ * @return The new context, or NULL on failure.
+ */
+spi_ctx_t *spi_open(const spi_config_t *config) {
+    spi_ctx_t *ctx = calloc(1U, sizeof(*ctx));
+    if (ctx == NULL) {
+        perror("Failed to allocate SPI context");
+        return NULL;
     }
+    init_context(ctx, config);
 
-    if (gpiod_line_request_rising_edge_events(gpio_line, CONSUMER) < 0) {
-        perror("Failed to request GPIO line as interrupt");
-        gpiod_chip_close(gpio_chip);
-        exit(EXIT_FAILURE);
+    if ((config != NULL) && (config->backend == SPI_BACKEND_LOOPBACK)) {
+        if (open_loopback(ctx, config->loopback) < 0) {
+            (void)pthread_mutex_destroy(&ctx->bus_lock);
+            free(ctx);
+            return NULL;
+        }
+        return ctx;
+    }
+
+    if (open_spi_device(ctx) < 0) {
+        (void)pthread_mutex_destroy(&ctx->bus_lock);
+        free(ctx);
+        return NULL;
+    }
+    if (open_gpio_line(ctx) < 0) {
+        (void)close(ctx->spi_fd);
+        destroy_buffers(ctx);
+        (void)pthread_mutex_destroy(&ctx->bus_lock);
+        free(ctx);
+        return NULL;
     }
+    return ctx;
 }
 
 /**
- * @brief Releases the GPIO resources.
+ * @brief Closes a SPI slave opened with spi_open() and frees its context.
  *
- * This function releases the GPIO line and closes the GPIO chip.
+ * @param ctx The context to release.
  */
-void gpio_close(void) {
-    gpiod_line_release(gpio_line);
-    gpiod_chip_close(gpio_chip);
+void spi_release(spi_ctx_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    spi_stop_receiving(ctx);
+    ctx->transport->close(ctx->transport_priv);
+    destroy_buffers(ctx);
+    (void)pthread_mutex_destroy(&ctx->bus_lock);
+    free(ctx);
 }
 
 /**
@@ -258,17 +727,113 @@ static void print_received_data(const uint8_t *data, size_t length) {
     debug_print("\n");
 }
 
+/**
+ * @brief Fills a SPI transfer segment with the library defaults.
+ *
+ * @param ctx The device context.
+ * @param spi The transfer segment to initialize.
+ * @param tx Buffer to transmit, or NULL to clock out zeros.
+ * @param rx Buffer to receive into, or NULL to discard received data.
+ * @param len Length of the segment in bytes.
+ */
+static void init_transfer(const spi_ctx_t *ctx, struct spi_ioc_transfer *spi, const void *tx, void *rx, size_t len) {
+    (void)memset(spi, 0, sizeof(*spi));
+    spi->tx_buf = (unsigned long)tx;
+    spi->rx_buf = (unsigned long)rx;
+    spi->len = (uint32_t)len;
+    spi->speed_hz = ctx->speed_hz;
+    spi->bits_per_word = ctx->bits_per_word;
+    spi->delay_usecs = 0;
+}
+
+/**
+ * @brief Issues a SPI message and records its duration.
+ *
+ * Must be called with the bus lock held.
+ *
+ * @param ctx The device context.
+ * @param count Number of transfer segments.
+ * @param segments The transfer segments of the message.
+ * @return The ioctl result: bytes transferred, or -1 with errno set.
+ */
+static int do_transfer(spi_ctx_t *ctx, size_t count, struct spi_ioc_transfer *segments) {
+    uint64_t start = monotonic_ns();
+    int ret = ctx->transport->transfer(ctx->transport_priv, segments, count);
+    spi_hist_record(&ctx->stats.transfer_ns, monotonic_ns() - start);
+    ctx->stats.transfers++;
+    if (ret < 0) {
+        ctx->stats.transfer_errors++;
+    }
+    return ret;
+}
+
+/**
+ * @brief Records the wakeup and service latency of the oldest unserviced GPIO edge.
+ *
+ * Called once the frame announced by the edge has been read. Wakeups over
+ * the threshold are kept in the slow wakeup ring, overwriting the oldest
+ * entry when it is full. Must be called with the bus lock held.
+ *
+ * @param ctx The device context.
+ */
+static void record_edge_latency(spi_ctx_t *ctx) {
+    uint64_t edge = (ctx->edge_next < ctx->edge_count) ? ctx->edges_ns[ctx->edge_next++] : 0U;
+    uint64_t now = monotonic_ns();
+
+    // Kernels before 5.7 stamp line events with CLOCK_REALTIME, which is useless here
+    if ((edge == 0U) || (edge > ctx->last_wakeup_ns) || (ctx->last_wakeup_ns > now)) {
+        return;
+    }
+
+    uint64_t wakeup = ctx->last_wakeup_ns - edge;
+    spi_hist_record(&ctx->stats.wakeup_ns, wakeup);
+    spi_hist_record(&ctx->stats.edge_to_read_ns, now - edge);
+
+    if ((ctx->slow_wakeup_ns != 0U) && (wakeup >= ctx->slow_wakeup_ns)) {
+        size_t index = (ctx->slow_wakeup_head + ctx->slow_wakeup_count) % SPI_WAKEUP_TRACE_SIZE;
+        if (ctx->slow_wakeup_count == SPI_WAKEUP_TRACE_SIZE) {
+            ctx->slow_wakeup_head = (ctx->slow_wakeup_head + 1U) % SPI_WAKEUP_TRACE_SIZE;
+        } else {
+            ctx->slow_wakeup_count++;
+        }
+        spi_wakeup_trace_t *trace = &ctx->slow_wakeups[index];
+        trace->edge_ns = edge;
+        trace->wakeup_ns = wakeup;
+        trace->service_ns = now - edge;
+        trace->cpu = ctx->last_wakeup_cpu;
+        ctx->stats.slow_wakeups++;
+        debug_print("Slow wakeup: %llu ns on CPU %d\n", (unsigned long long)wakeup, trace->cpu);
+    }
+}
+
+/**
+ * @brief Returns the size of the frame header for a protocol version.
+ *
+ * @param protocol The framing protocol.
+ * @return Start identifier, function ID, optional sequence byte and payload size.
+ */
+static size_t header_size(spi_protocol_t protocol) {
+    return (protocol == SPI_PROTOCOL_V2) ? (FRAME_HEADER_SIZE + SIZE_SEQUENCE) : FRAME_HEADER_SIZE;
+}
+
 /**
  * @brief Processes the received response from the SPI slave.
  *
  * This function validates the response format, checks the CRC, and
- * invokes the callback with the parsed data or an error code.
+ * fills the response structure with the parsed data. For version 2 frames
+ * the sequence field receives the sequence byte of the frame as soon as the
+ * header is valid, so that even a frame failing its CRC check can be routed.
  *
+ * @param protocol The framing protocol of the response.
  * @param response The received response array.
  * @param length The length of the response array.
- * @param callback The callback function to handle the response.
+ * @param resp The response structure to fill.
+ * @return SPI_SUCCESS or the error code describing why the response was rejected.
  */
-static void process_response(const uint8_t *response, size_t length, spi_callback_t callback) {
+spi_error_t spi_frame_decode(spi_protocol_t protocol, const uint8_t *response, size_t length, spi_response_t *resp) {
+    const uint8_t *start_identifier = (protocol == SPI_PROTOCOL_V2) ? START_IDENTIFIER_V2 : START_IDENTIFIER;
+    size_t payload_offset = header_size(protocol);
+
     debug_print("Processing response...\n");
     debug_print("Received response length: %zu\n", length);
 
@@ -276,160 +841,322 @@ static void process_response(const uint8_t *response, size_t length, spi_callbac
     print_received_data(response, length);
 
     // Check for basic format validity
-    if (length < START_IDENTIFIER_SIZE + 1 + 2 + 1 + STOP_IDENTIFIER_SIZE) { // minimum length
-        debug_print("Error: Response length too short (%zu < 8)\n", length);
-        callback(SPI_ERROR_INVALID_FORMAT, NULL);
-        return;
+    if (length < payload_offset + SIZE_CRC8 + STOP_IDENTIFIER_SIZE) { // minimum length
+        debug_print("Error: Response length too short (%zu)\n", length);
+        return SPI_ERROR_INVALID_FORMAT;
     }
 
-    if (memcmp(response, START_IDENTIFIER, START_IDENTIFIER_SIZE) != 0) {
+    if (memcmp(response, start_identifier, START_IDENTIFIER_SIZE) != 0) {
         debug_print("Error: Invalid start identifier\n");
-        callback(SPI_ERROR_INVALID_FORMAT, NULL);
-        return;
+        return SPI_ERROR_INVALID_FORMAT;
     }
 
     uint8_t function_id = response[2];
-    uint16_t payload_size = (uint16_t)((response[4] << 8U) | response[3]);
+    uint16_t payload_size = (uint16_t)((response[payload_offset - 1U] << 8U) | response[payload_offset - 2U]);
     debug_print("Function ID: %02X, Payload size: %u\n", function_id, payload_size);
 
-    if (payload_size > MAX_PAYLOAD_SIZE) {
+    if ((payload_size > MAX_PAYLOAD_SIZE) || (payload_offset + payload_size + SIZE_CRC8 + STOP_IDENTIFIER_SIZE > length)) {
         debug_print("Error: Payload size exceeds maximum (%u > %u)\n", payload_size, MAX_PAYLOAD_SIZE);
-        callback(SPI_ERROR_INVALID_FORMAT, NULL);
-        return;
+        return SPI_ERROR_INVALID_FORMAT;
     }
 
-    
-
-    // Check the CRC and Stop Identifier
-    uint8_t received_crc = response[5U + payload_size];
-    uint8_t calculated_crc = get_crc32_lsb_byte(&response[5U], payload_size);
+    resp->function_id = function_id;
+    resp->payload_size = 0U;
+    resp->payload = NULL;
+    resp->sequence = (protocol == SPI_PROTOCOL_V2) ? response[3] : 0U;
+    resp->unsolicited = 0U;
+
+    // Check the CRC and Stop Identifier; version 2 also protects the header
+    uint8_t received_crc = response[payload_offset + payload_size];
+    uint8_t calculated_crc;
+    if (protocol == SPI_PROTOCOL_V2) {
+        calculated_crc = get_crc32_lsb_byte(&response[START_IDENTIFIER_SIZE], payload_offset - START_IDENTIFIER_SIZE + payload_size);
+    } else {
+        calculated_crc = get_crc32_lsb_byte(&response[payload_offset], payload_size);
+    }
     debug_print("Received CRC: %02X, Calculated CRC: %02X\n", received_crc, calculated_crc);
 
     if (received_crc != calculated_crc) {
         debug_print("Error: CRC mismatch\n");
-        callback(SPI_ERROR_CRC_MISMATCH, NULL);
-        return;
+        return SPI_ERROR_CRC_MISMATCH;
     }
 
     // Correct position for stop identifier check
-    size_t stop_identifier_position = 5U + payload_size + 1;
+    size_t stop_identifier_position = payload_offset + payload_size + SIZE_CRC8;
     if (memcmp(response + stop_identifier_position, STOP_IDENTIFIER, STOP_IDENTIFIER_SIZE) != 0) {
         debug_print("Error: Invalid stop identifier\n");
-        callback(SPI_ERROR_INVALID_FORMAT, NULL);
-        return;
+        return SPI_ERROR_INVALID_FORMAT;
     }
 
-    // Valid response; prepare the response structure
-    spi_response_t resp;
-    resp.function_id = function_id;
-    resp.payload_size = payload_size;
-    resp.payload = (uint8_t *)&response[5U];
+    // Valid response; fill the response structure
+    resp->payload_size = payload_size;
+    resp->payload = (uint8_t *)&response[payload_offset];
 
     debug_print("Valid response received. Function ID: %02X, Payload size: %u\n", function_id, payload_size);
 
-    // Call the callback with the successful response
-    callback(SPI_SUCCESS, &resp);
+    return SPI_SUCCESS;
 }
 
 /**
- * @brief Waits for a GPIO interrupt and processes the SPI response.
+ * @brief Waits for rising edges on the GPIO interrupt line.
  *
- * This non-blocking function waits for an interrupt on the specified GPIO line,
- * then performs an SPI read operation and processes the response.
+ * Consumes up to the drain budget of the edges queued by the time poll()
+ * returns, with a single read.
  *
- * @param callback The callback function to handle the response.
+ * @param ctx The device context.
+ * @param timeout_ms Maximum time to wait in milliseconds, -1 to wait indefinitely.
+ * @return Number of rising edges consumed, 0 on timeout or signal, -1 on error.
  */
-static void wait_for_gpio_interrupt(spi_callback_t callback) {
+static int wait_for_gpio_interrupt(spi_ctx_t *ctx, int timeout_ms) {
     struct pollfd pfd;
     int ret;
 
-    pfd.fd = gpiod_line_event_get_fd(gpio_line);
+    pfd.fd = ctx->transport->event_fd(ctx->transport_priv);
     pfd.events = POLLIN;
 
     debug_print("Waiting for GPIO interrupt...\n");
 
-    ret = poll(&pfd, 1, -1);  // Wait indefinitely for the GPIO interrupt
+    ret = poll(&pfd, 1, timeout_ms);
     if (ret > 0) {
+        uint64_t wakeup_ns = monotonic_ns();
         if ((pfd.revents & POLLIN) != 0) {
-            struct gpiod_line_event event;
-            ret = gpiod_line_event_read(gpio_line, &event);
-            if ((ret == 0) && (event.event_type == GPIOD_LINE_EVENT_RISING_EDGE)) {
-                debug_print("GPIO interrupt detected\n");
-
-                // Perform SPI read operation after the interrupt
-                struct spi_ioc_transfer spi;
-                (void)memset(&spi, 0, sizeof(spi));
-
-                uint8_t dummy_tx[MESSAGE_SIZE] = {0xff}; // Dummy buffer for sending data
-                spi.tx_buf = (unsigned long)dummy_tx;
-                spi.rx_buf = (unsigned long)response_buffer;
-                spi.len = MESSAGE_SIZE;
-                spi.speed_hz = SPI_SPEED;
-                spi.bits_per_word = SPI_BITS_PER_WORD;
-                spi.delay_usecs = 0;
-
-                ret = ioctl(spi_fd, SPI_IOC_MESSAGE(1), &spi);
-                if (ret < 0) {
-                    perror("Failed to transfer SPI message");
-                    callback(SPI_ERROR_UNKNOWN, NULL);
-                } else {
-                    // Process the response data
-                    process_response(response_buffer, spi.len, callback);
-                }
+            int count = ctx->transport->read_events(ctx->transport_priv, ctx->edges_ns, ctx->drain_budget);
+            if (count > 0) {
+                // The edges of frames already clocked in by a duplex exchange announce nothing
+                unsigned int early = (ctx->edges_early < (unsigned int)count) ? ctx->edges_early : (unsigned int)count;
+                ctx->edges_early -= early;
+                ctx->edge_count = (unsigned int)count;
+                ctx->edge_next = early;
+                count -= (int)early;
+            }
+            if (count > 0) {
+                debug_print("GPIO interrupt detected (%d edges)\n", count);
+                ctx->last_wakeup_ns = wakeup_ns;
+                ctx->last_wakeup_cpu = sched_getcpu();
+                return count;
             }
         }
     } else {
-        if (ret == -1) {
+        // A signal only cut the wait short; the caller polls again
+        if ((ret == -1) && (errno != EINTR)) {
             perror("Poll error");
-            callback(SPI_ERROR_UNKNOWN, NULL);
+            return -1;
         }
     }
+    return 0;
 }
 
 /**
- * @brief Prints the details of a SPI message.
+ * @brief Reads a response frame from the SPI slave after a GPIO interrupt.
  *
- * This function prints the details of a SPI message, including the start identifier,
- * function ID, payload size, payload data, CRC, and stop identifier.
+ * In SPI_READ_LENGTH_PREFIXED mode the frame header is clocked in first with
+ * chip select held, then exactly the announced payload, CRC and stop
+ * identifier are read. Otherwise a maximum-size frame is read.
  *
- * @param message The SPI message to print.
- * @param total_size The total size of the message.
+ * @param ctx The device context.
+ * @param buffer Destination of the frame, FRAME_BUFFER_SIZE bytes.
+ * @param resp The response structure to fill.
+ * @return SPI_SUCCESS or the error code of the failed transfer or validation.
  */
-void print_message_details(const spi_message_t *message, size_t total_size) {
-    debug_print("Message Details:\n");
-    debug_print("Start Identifier: ");
-    for (size_t i = 0; i < START_IDENTIFIER_SIZE; i++) {
-        debug_print("%02X ", message->start_identifier[i]);
-    }
-    debug_print("\nFunction ID: %02X\n", message->function_id);
-    debug_print("Payload Size: %02X %02X\n", message->payload_size[0], message->payload_size[1]);
-    
-    // Calculate actual payload size from the payload_size field
-    uint16_t actual_payload_size = message->payload_size[0] | (message->payload_size[1] << 8);
-    debug_print("Payload: ");
-    for (size_t i = 0; i < actual_payload_size; i++) {
-        debug_print("%02X ", message->payload[i]);
+static spi_error_t read_frame(spi_ctx_t *ctx, uint8_t *buffer, spi_response_t *resp) {
+    struct spi_ioc_transfer spi;
+    const uint8_t *fill = ctx->frame_pool.tx_fill; // 0xFF clocked out while reading
+    spi_protocol_t protocol = ctx->protocol;
+    size_t header_length = header_size(protocol);
+    size_t length = header_length + MAX_PAYLOAD_SIZE + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+    int ret;
+
+    if (ctx->read_mode == SPI_READ_LENGTH_PREFIXED) {
+        // The body length is only known once the header is in, so it takes two
+        // messages; cs_change on the last transfer keeps chip select asserted
+        init_transfer(ctx, &spi, fill, buffer, header_length);
+        spi.cs_change = 1U;
+        ret = do_transfer(ctx, 1U, &spi);
+        if (ret < 0) {
+            perror("Failed to transfer SPI message");
+            return SPI_ERROR_UNKNOWN;
+        }
+
+        const uint8_t *start_identifier = (protocol == SPI_PROTOCOL_V2) ? START_IDENTIFIER_V2 : START_IDENTIFIER;
+        uint16_t payload_size = (uint16_t)((buffer[header_length - 1U] << 8U) | buffer[header_length - 2U]);
+        if ((memcmp(buffer, start_identifier, START_IDENTIFIER_SIZE) != 0) ||
+            (payload_size > MAX_PAYLOAD_SIZE)) {
+            debug_print("Error: Invalid response header\n");
+            // Release chip select without clocking the rest of the frame
+            init_transfer(ctx, &spi, NULL, NULL, 0U);
+            (void)do_transfer(ctx, 1U, &spi);
+            record_edge_latency(ctx);
+            ctx->stats.bytes_rx += header_length;
+            return SPI_ERROR_INVALID_FORMAT;
+        }
+
+        length = header_length + payload_size + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+        init_transfer(ctx, &spi, fill, &buffer[header_length], length - header_length);
+    } else {
+        init_transfer(ctx, &spi, fill, buffer, length);
     }
-    
-    // CRC and stop identifier are positioned immediately after the payload
-    uint8_t crc8 = *(uint8_t *)((uint8_t *)message + offsetof(spi_message_t, payload) + actual_payload_size);
-    uint8_t *stop_identifier = (uint8_t *)message + offsetof(spi_message_t, payload) + actual_payload_size + 1;
-    
-    debug_print("\nCRC8: %02X\n", crc8);
-    debug_print("Stop Identifier: ");
-    for (size_t i = 0; i < STOP_IDENTIFIER_SIZE; i++) {
-        debug_print("%02X ", stop_identifier[i]);
+
+    ret = do_transfer(ctx, 1U, &spi);
+    if (ret < 0) {
+        perror("Failed to transfer SPI message");
+        return SPI_ERROR_UNKNOWN;
     }
-    debug_print("\nTotal Size: %zu bytes\n", total_size);
+    record_edge_latency(ctx);
+    ctx->stats.bytes_rx += length;
+
+    // Process the response data
+    return spi_frame_decode(protocol, buffer, length, resp);
 }
 
 /**
- * @brief Prints a message in hexadecimal format.
+ * @brief Reads a response frame while holding the bus lock.
  *
- * This function prints a byte array in hexadecimal format, useful for debugging.
- *
- * @param message The byte array to print.
- * @param length The length of the byte array.
+ * @param ctx The device context.
+ * @param buffer Destination of the frame, FRAME_BUFFER_SIZE bytes.
+ * @param resp The response structure to fill.
+ * @return SPI_SUCCESS or the error code of the failed transfer or validation.
+ */
+static spi_error_t read_response(spi_ctx_t *ctx, uint8_t *buffer, spi_response_t *resp) {
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    spi_error_t error = read_frame(ctx, buffer, resp);
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+    return error;
+}
+
+/**
+ * @brief Selects how response frames are read from the SPI slave.
+ *
+ * The receiver thread reads the mode and feeds the stream reassembler
+ * without the bus lock, so the mode cannot change while it runs.
+ *
+ * @param ctx The device context.
+ * @param mode The read mode to use for subsequent responses.
+ * @return 0 on success, -1 with errno set to EBUSY if the receiver thread is running.
+ */
+int spi_set_read_mode(spi_ctx_t *ctx, spi_read_mode_t mode) {
+    if (atomic_load(&ctx->receiver_running) != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    ctx->read_mode = mode;
+    spi_stream_reset(&ctx->stream);
+    return 0;
+}
+
+/**
+ * @brief Sets the number of bytes read per chunk in SPI_READ_STREAM mode.
+ *
+ * @param ctx The device context.
+ * @param chunk_size Bytes per chunk, 1 to SPI_STREAM_CHUNK_MAX.
+ * @return 0 on success, -1 with errno set to EINVAL if the size is out of range.
+ */
+int spi_set_stream_chunk(spi_ctx_t *ctx, size_t chunk_size) {
+    if ((chunk_size == 0U) || (chunk_size > SPI_STREAM_CHUNK_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->stream_chunk = chunk_size;
+    return 0;
+}
+
+/**
+ * @brief Reads the frames the slave streams out after a GPIO interrupt.
+ *
+ * Chunks are read behind the bytes the reassembler carried over and fed to
+ * it. As long as a chunk ends inside a frame the next one is read right
+ * away, without waiting for another edge, up to STREAM_MAX_CHUNKS chunks.
+ * The bus lock is only held for each transfer, and the sink runs without it,
+ * so requests can still be transmitted while a long stream is read.
+ *
+ * @param ctx The device context.
+ * @param sink Called for every frame found in the stream.
+ * @param arg Passed to the sink.
+ * @return Number of frames found, or -1 if a transfer failed.
+ */
+static int read_stream(spi_ctx_t *ctx, spi_stream_sink_t sink, void *arg) {
+    struct spi_ioc_transfer spi;
+    size_t frames = 0U;
+
+    for (unsigned int chunk = 0U; chunk < STREAM_MAX_CHUNKS; chunk++) {
+        size_t space;
+        uint8_t *rx = spi_stream_tail(&ctx->stream, &space);
+        size_t length = (ctx->stream_chunk < space) ? ctx->stream_chunk : space;
+
+        (void)pthread_mutex_lock(&ctx->bus_lock);
+        init_transfer(ctx, &spi, ctx->stream_pool.tx_fill, rx, length);
+        int ret = do_transfer(ctx, 1U, &spi);
+        if (ret >= 0) {
+            if (chunk == 0U) {
+                record_edge_latency(ctx);
+            }
+            ctx->stats.bytes_rx += length;
+        }
+        (void)pthread_mutex_unlock(&ctx->bus_lock);
+        if (ret < 0) {
+            perror("Failed to transfer SPI message");
+            spi_stream_reset(&ctx->stream);
+            return -1;
+        }
+
+        frames += spi_stream_feed(&ctx->stream, ctx->protocol, length, sink, arg);
+        if (ctx->stream.resyncs != 0U) {
+            (void)pthread_mutex_lock(&ctx->bus_lock);
+            ctx->stats.resyncs += ctx->stream.resyncs;
+            (void)pthread_mutex_unlock(&ctx->bus_lock);
+            ctx->stream.resyncs = 0U;
+        }
+        if (!spi_stream_pending(&ctx->stream)) {
+            break;
+        }
+    }
+
+    return (int)frames;
+}
+
+/**
+ * @brief Prints the details of a SPI message.
+ *
+ * This function prints the details of a SPI message, including the start identifier,
+ * function ID, payload size, payload data, CRC, and stop identifier.
+ *
+ * @param message The SPI message to print.
+ * @param total_size The total size of the message.
+ */
+void print_message_details(const spi_message_t *message, size_t total_size) {
+    debug_print("Message Details:\n");
+    debug_print("Start Identifier: ");
+    for (size_t i = 0; i < START_IDENTIFIER_SIZE; i++) {
+        debug_print("%02X ", message->start_identifier[i]);
+    }
+    debug_print("\nFunction ID: %02X\n", message->function_id);
+    debug_print("Payload Size: %02X %02X\n", message->payload_size[0], message->payload_size[1]);
+    
+    // Calculate actual payload size from the payload_size field
+    uint16_t actual_payload_size = message->payload_size[0] | (message->payload_size[1] << 8);
+    debug_print("Payload: ");
+    for (size_t i = 0; i < actual_payload_size; i++) {
+        debug_print("%02X ", message->payload[i]);
+    }
+    
+    // CRC and stop identifier are positioned immediately after the payload
+    uint8_t crc8 = *(uint8_t *)((uint8_t *)message + offsetof(spi_message_t, payload) + actual_payload_size);
+    uint8_t *stop_identifier = (uint8_t *)message + offsetof(spi_message_t, payload) + actual_payload_size + 1;
+    
+    debug_print("\nCRC8: %02X\n", crc8);
+    debug_print("Stop Identifier: ");
+    for (size_t i = 0; i < STOP_IDENTIFIER_SIZE; i++) {
+        debug_print("%02X ", stop_identifier[i]);
+    }
+    debug_print("\nTotal Size: %zu bytes\n", total_size);
+}
+
+/**
+ * @brief Prints a message in hexadecimal format.
+ *
+ * This function prints a byte array in hexadecimal format, useful for debugging.
+ *
+ * @param message The byte array to print.
+ * @param length The length of the byte array.
  */
 void print_message_hex(const uint8_t *message, size_t length) {
     debug_print("Message to send: ");
@@ -440,79 +1167,2201 @@ void print_message_hex(const uint8_t *message, size_t length) {
 }
 
 /**
- * @brief Sends a request to the SPI slave.
- *
- * This function constructs a SPI message with the specified function ID and payload,
- * calculates the CRC, and sends the message via SPI.
+ * @brief Encodes the header of a request frame.
  *
+ * @param protocol The framing protocol.
+ * @param header Destination buffer, at least FRAME_HEADER_SIZE + SIZE_SEQUENCE bytes.
+ * @param sequence The sequence tag of the request.
  * @param function_id The function ID for the request.
- * @param payload The payload data to send.
- * @param actual_payload_size The size of the payload data.
- * @param callback The callback function to handle the response.
+ * @param payload_size The size of the payload data.
+ * @param crc Receives the running CRC over the header bytes it protects.
+ * @return The size of the header.
  */
-void send_request(uint8_t function_id, const uint8_t *payload, uint16_t actual_payload_size, spi_callback_t callback) {
-    // Calculate the total size needed for the message
-    size_t total_size = offsetof(spi_message_t, payload) + actual_payload_size + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
-    uint8_t message_buffer[total_size]; // Dynamic allocation on stack based on total size
-
-    // Cast the buffer to the spi_message_t struct
-    spi_message_t *message = (spi_message_t *)message_buffer;
-
-    // Initialize the message fields
-    memcpy(message->start_identifier, START_IDENTIFIER, START_IDENTIFIER_SIZE);
-    message->function_id = function_id;
+static size_t encode_header(spi_protocol_t protocol, uint8_t *header, uint16_t sequence, uint8_t function_id,
+                            size_t payload_size, uint32_t *crc) {
+    size_t length = START_IDENTIFIER_SIZE;
+
+    if (protocol == SPI_PROTOCOL_V2) {
+        memcpy(header, START_IDENTIFIER_V2, START_IDENTIFIER_SIZE);
+        header[length++] = function_id;
+        header[length++] = (uint8_t)(sequence & 0xFF);
+    } else {
+        memcpy(header, START_IDENTIFIER, START_IDENTIFIER_SIZE);
+        header[length++] = function_id;
+    }
 
     // Set payload size in little-endian format
-    message->payload_size[0] = (uint8_t)(actual_payload_size & 0xFF);
-    message->payload_size[1] = (uint8_t)((actual_payload_size >> 8) & 0xFF);
+    header[length++] = (uint8_t)(payload_size & 0xFF);
+    header[length++] = (uint8_t)((payload_size >> 8) & 0xFF);
+
+    *crc = CRC32_INITIAL_VALUE;
+    if (protocol == SPI_PROTOCOL_V2) {
+        *crc = crc32_update(*crc, &header[START_IDENTIFIER_SIZE], length - START_IDENTIFIER_SIZE);
+    }
+    return length;
+}
 
-    // Copy the actual payload data
-    memcpy(message->payload, payload, actual_payload_size);
+/**
+ * @brief Encodes the trailer of a request frame.
+ *
+ * @param trailer Destination buffer, SIZE_CRC8 + STOP_IDENTIFIER_SIZE bytes.
+ * @param crc The running CRC over the header and payload.
+ * @return The size of the trailer.
+ */
+static size_t encode_trailer(uint8_t *trailer, uint32_t crc) {
+    trailer[0] = (uint8_t)((crc ^ CRC32_FINAL_XOR_VALUE) & 0xFF);
+    memcpy(&trailer[SIZE_CRC8], STOP_IDENTIFIER, STOP_IDENTIFIER_SIZE);
+    return SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+}
 
-    // Calculate CRC for the payload and set it after the payload
-    uint8_t *crc_position = message_buffer + offsetof(spi_message_t, payload) + actual_payload_size;
-    *crc_position = get_crc32_lsb_byte(payload, actual_payload_size);
+/**
+ * @brief Encodes a request frame into a buffer.
+ *
+ * This function constructs a SPI message with the specified function ID and payload,
+ * calculates the CRC and appends the stop identifier.
+ *
+ * @param protocol The framing protocol.
+ * @param message_buffer Destination buffer, at least FRAME_SIZE(actual_payload_size) + SIZE_SEQUENCE bytes.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param actual_payload_size The size of the payload data.
+ * @return The total size of the encoded frame.
+ */
+size_t spi_frame_encode(spi_protocol_t protocol, uint8_t *message_buffer, uint16_t sequence, uint8_t function_id,
+                        const uint8_t *payload, uint16_t actual_payload_size) {
+    uint32_t crc;
+    size_t total_size = encode_header(protocol, message_buffer, sequence, function_id, actual_payload_size, &crc);
 
-    // Set the stop identifier after the CRC
-    memcpy(crc_position + 1, STOP_IDENTIFIER, STOP_IDENTIFIER_SIZE);
+    // Copy the actual payload data and extend the CRC over it
+    memcpy(&message_buffer[total_size], payload, actual_payload_size);
+    crc = crc32_update(crc, payload, actual_payload_size);
+    total_size += actual_payload_size;
 
-    // Recalculate total size
-    total_size = (crc_position + 1 + STOP_IDENTIFIER_SIZE) - message_buffer;
+    // Set the CRC and the stop identifier after the payload
+    total_size += encode_trailer(&message_buffer[total_size], crc);
 
     // Print the detailed message for debugging
-    debug_print("Message Details:\n");
-    print_message_details(message, total_size);
+    if (protocol == SPI_PROTOCOL_V1) {
+        print_message_details((const spi_message_t *)message_buffer, total_size);
+    }
 
     // Print the entire message as it will be sent
     debug_print("Message to send (entire buffer including stop identifier):\n");
     print_message_hex(message_buffer, total_size);
 
-    // Debug print to show individual bytes in the buffer
-    debug_print("Buffer contents before sending:\n");
-    for (size_t i = 0; i < total_size; i++) {
-        debug_print("Byte %zu: %02X\n", i, message_buffer[i]);
+    return total_size;
+}
+
+/**
+ * @brief Transmits a request frame whose payload is scattered over caller buffers.
+ *
+ * The header, every payload buffer and the trailer go out as separate
+ * segments of one SPI message, so chip select stays asserted across them and
+ * the payload is never copied. The CRC is computed in place over the buffers.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param iov Payload buffers, in wire order.
+ * @param iovcnt Number of payload buffers, at most SPI_MAX_IOV.
+ * @return 0 on success, -1 if the SPI transfer failed.
+ */
+static int transmit_iov(spi_ctx_t *ctx, uint16_t sequence, uint8_t function_id, const struct iovec *iov, size_t iovcnt) {
+    struct spi_ioc_transfer segments[SPI_MAX_IOV + 2U];
+    uint8_t header[FRAME_HEADER_SIZE + SIZE_SEQUENCE];
+    uint8_t trailer[SIZE_CRC8 + STOP_IDENTIFIER_SIZE];
+    uint32_t crc;
+    size_t payload_size = 0U;
+    size_t segment_count = 1U;
+
+    for (size_t i = 0U; i < iovcnt; i++) {
+        payload_size += iov[i].iov_len;
     }
+    size_t header_length = encode_header(ctx->protocol, header, sequence, function_id, payload_size, &crc);
+    init_transfer(ctx, &segments[0], header, NULL, header_length);
 
-    // Send the message via SPI
-    struct spi_ioc_transfer spi;
-    memset(&spi, 0, sizeof(spi));
-    spi.tx_buf = (unsigned long)message_buffer;
-    spi.rx_buf = (unsigned long)response_buffer;
-    spi.len = total_size;
-    spi.speed_hz = SPI_SPEED;
-    spi.bits_per_word = SPI_BITS_PER_WORD;
-    spi.delay_usecs = 0;
-
-    debug_print("Starting SPI transfer with total size: %zu\n", total_size);
-    int ret = ioctl(spi_fd, SPI_IOC_MESSAGE(1), &spi);
+    for (size_t i = 0U; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0U) {
+            continue;
+        }
+        crc = crc32_update(crc, iov[i].iov_base, iov[i].iov_len);
+        init_transfer(ctx, &segments[segment_count], iov[i].iov_base, NULL, iov[i].iov_len);
+        segment_count++;
+    }
+
+    init_transfer(ctx, &segments[segment_count], trailer, NULL, encode_trailer(trailer, crc));
+    segment_count++;
+
+    debug_print("Starting SPI transfer: function ID 0x%02X, %zu payload bytes in %zu segments\n",
+                function_id, payload_size, segment_count);
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    int ret = do_transfer(ctx, segment_count, segments);
+    if (ret >= 0) {
+        ctx->stats.bytes_tx += header_length + payload_size + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+    }
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
     if (ret < 0) {
         perror("Failed to transfer SPI message");
-        callback(SPI_ERROR_UNKNOWN, NULL);
+        return -1;
+    }
+    debug_print("SPI transfer completed successfully, bytes transferred: %d\n", ret);
+    return 0;
+}
+
+/**
+ * @brief Transmits a request frame to the SPI slave.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param actual_payload_size The size of the payload data.
+ * @return 0 on success, -1 if the SPI transfer failed.
+ */
+static int transmit_request(spi_ctx_t *ctx, uint16_t sequence, uint8_t function_id, const uint8_t *payload,
+                            uint16_t actual_payload_size) {
+    struct iovec iov;
+    iov.iov_base = (void *)payload;
+    iov.iov_len = actual_payload_size;
+    return transmit_iov(ctx, sequence, function_id, &iov, 1U);
+}
+
+/**
+ * @brief Hands the outcome of a request to its callback.
+ *
+ * Requests submitted without a callback go to the handler registered for
+ * the function ID of the response.
+ *
+ * @param ctx The device context.
+ * @param callback The callback function of the request, or NULL.
+ * @param error The outcome of the request.
+ * @param resp The response.
+ */
+static void notify(spi_ctx_t *ctx, spi_callback_t callback, spi_error_t error, spi_response_t *resp) {
+    if (callback != NULL) {
+        callback(error, resp);
         return;
+    }
+
+    const spi_handler_entry_t *entry = &ctx->handlers[resp->function_id];
+    if (entry->handler != NULL) {
+        entry->handler(error, resp, entry->user);
+    } else {
+        debug_print("No handler for function ID 0x%02X\n", resp->function_id);
+    }
+}
+
+/**
+ * @brief Passes a frame that matches no request to its consumer.
+ *
+ * A valid frame goes to the handler registered for its function ID; other
+ * frames, and valid ones without a handler, go to the spi_start_receiving()
+ * callback, if any.
+ *
+ * @param ctx The device context.
+ * @param error Result of reading and validating the frame.
+ * @param resp The parsed frame.
+ */
+static void deliver_unsolicited(spi_ctx_t *ctx, spi_error_t error, spi_response_t *resp) {
+    resp->unsolicited = 1U;
+    if (error == SPI_SUCCESS) {
+        const spi_handler_entry_t *entry = &ctx->handlers[resp->function_id];
+        if (entry->handler != NULL) {
+            entry->handler(SPI_SUCCESS, resp, entry->user);
+            return;
+        }
+    }
+
+    if (ctx->receive_callback != NULL) {
+        ctx->receive_callback(error, (error == SPI_SUCCESS) ? resp : NULL);
+    } else {
+        debug_print("Unsolicited response dropped\n");
+    }
+}
+
+/**
+ * @brief Invokes a request callback with an error that carries no payload.
+ *
+ * @param ctx The device context.
+ * @param callback The callback function of the failed request, or NULL.
+ * @param error The error code to report.
+ * @param function_id The function ID of the failed request.
+ * @param sequence The sequence tag of the failed request.
+ */
+static void fail_request(spi_ctx_t *ctx, spi_callback_t callback, spi_error_t error, uint8_t function_id,
+                         uint16_t sequence) {
+    spi_response_t resp;
+    resp.function_id = function_id;
+    resp.payload_size = 0U;
+    resp.payload = NULL;
+    resp.sequence = sequence;
+    resp.unsolicited = 0U;
+    notify(ctx, callback, error, &resp);
+}
+
+/**
+ * @brief Reads a little-endian 32-bit field of a fragment header.
+ *
+ * @param field The first byte of the field.
+ * @return The value of the field.
+ */
+static uint32_t get_le32(const uint8_t *field) {
+    return (uint32_t)field[0] | ((uint32_t)field[1] << 8U) | ((uint32_t)field[2] << 16U) | ((uint32_t)field[3] << 24U);
+}
+
+/**
+ * @brief Writes a little-endian 32-bit field of a fragment header.
+ *
+ * @param field The first byte of the field.
+ * @param value The value to write.
+ */
+static void put_le32(uint8_t *field, uint32_t value) {
+    field[0] = (uint8_t)value;
+    field[1] = (uint8_t)(value >> 8U);
+    field[2] = (uint8_t)(value >> 16U);
+    field[3] = (uint8_t)(value >> 24U);
+}
+
+/**
+ * @brief Runs the callback of a bulk transfer.
+ *
+ * @param bulk The transfer.
+ * @param error The outcome of the transfer.
+ */
+static void finish_bulk(spi_bulk_t *bulk, spi_error_t error) {
+    spi_bulk_response_t resp;
+
+    bulk->finished = 1U;
+    resp.function_id = bulk->function_id;
+    resp.data = bulk->response;
+    resp.size = bulk->response_received;
+    bulk->callback(error, &resp);
+}
+
+/**
+ * @brief Copies the data of a response fragment into the response buffer.
+ *
+ * Answers without data acknowledge a request fragment or a poll; only the
+ * answer to the last request fragment announces the response size then.
+ *
+ * @param bulk The transfer.
+ * @param resp The response to the fragment.
+ * @param last_request Non-zero if the fragment was the last request fragment.
+ * @return SPI_SUCCESS, or SPI_ERROR_INVALID_FORMAT for a malformed fragment.
+ */
+static spi_error_t absorb_fragment(spi_bulk_t *bulk, const spi_response_t *resp, int last_request) {
+    if (resp->payload_size < SPI_FRAGMENT_HEADER_SIZE) {
+        return SPI_ERROR_INVALID_FORMAT;
+    }
+
+    uint32_t offset = get_le32(resp->payload);
+    uint32_t total = get_le32(&resp->payload[4]);
+    size_t length = resp->payload_size - SPI_FRAGMENT_HEADER_SIZE;
+    if ((length == 0U) && !last_request) {
+        return SPI_SUCCESS;
+    }
+    if ((total > bulk->response_capacity) || (bulk->response_known && (total != bulk->response_total)) ||
+        (offset > total) || (length > total - offset)) {
+        debug_print("Error: Invalid response fragment (%u + %zu of %u)\n", offset, length, total);
+        return SPI_ERROR_INVALID_FORMAT;
+    }
+
+    bulk->response_known = 1U;
+    bulk->response_total = total;
+    (void)memcpy(&bulk->response[offset], &resp->payload[SPI_FRAGMENT_HEADER_SIZE], length);
+    bulk->response_received += (uint32_t)length;
+    if (length > 0U) {
+        bulk->chunk = (uint32_t)length;
+    }
+    return SPI_SUCCESS;
+}
+
+/**
+ * @brief Accounts for a completed fragment of a bulk transfer.
+ *
+ * The transfer fails with the first fragment that fails and succeeds once
+ * the last request fragment is answered and the whole response is in.
+ * Fragments completing after that are absorbed; the slot is released when
+ * none is left.
+ *
+ * @param bulk The transfer the fragment belongs to.
+ * @param sequence The sequence tag of the fragment.
+ * @param error The outcome of the fragment.
+ * @param resp The response to the fragment, NULL on error.
+ */
+static void complete_fragment(spi_bulk_t *bulk, uint16_t sequence, spi_error_t error, const spi_response_t *resp) {
+    int last_request = bulk->request_done && (sequence == bulk->last_sequence);
+    int poll = bulk->request_done && ((int16_t)(uint16_t)(sequence - bulk->last_sequence) > 0);
+
+    bulk->outstanding--;
+    if (poll) {
+        bulk->polls--;
+    }
+
+    if (!bulk->finished) {
+        if (error == SPI_SUCCESS) {
+            error = absorb_fragment(bulk, resp, last_request);
+        }
+        if ((error == SPI_SUCCESS) && last_request) {
+            bulk->acknowledged = 1U;
+        }
+        if (error != SPI_SUCCESS) {
+            finish_bulk(bulk, error);
+        } else if (bulk->acknowledged && (bulk->response_received >= bulk->response_total)) {
+            finish_bulk(bulk, SPI_SUCCESS);
+        }
+    }
+    if (bulk->finished && (bulk->outstanding == 0U)) {
+        bulk->active = 0U;
+    }
+}
+
+/**
+ * @brief Fails a request that was handed a sequence tag.
+ *
+ * Fragments of a bulk transfer are failed through their transfer.
+ *
+ * @param ctx The device context.
+ * @param callback The callback function of the failed request.
+ * @param bulk The transfer the request is a fragment of, NULL for an ordinary request.
+ * @param error The error code to report.
+ * @param function_id The function ID of the failed request.
+ * @param sequence The sequence tag of the failed request.
+ */
+static void fail_sequence(spi_ctx_t *ctx, spi_callback_t callback, spi_bulk_t *bulk, spi_error_t error,
+                          uint8_t function_id, uint16_t sequence) {
+    if (bulk != NULL) {
+        complete_fragment(bulk, sequence, error, NULL);
     } else {
-        debug_print("SPI transfer completed successfully, bytes transferred: %d\n", ret);
+        fail_request(ctx, callback, error, function_id, sequence);
+    }
+}
+
+/**
+ * @brief Checks that the sequence byte of a request aliases no pending request.
+ *
+ * Requests of different priority classes may be transmitted out of
+ * sequence order, so the pending table entry itself is checked.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the candidate request.
+ * @return Non-zero if the sequence byte is free.
+ */
+static int sequence_available(const spi_ctx_t *ctx, uint16_t sequence) {
+    return ctx->inflight[sequence % PENDING_TABLE_SIZE].active == 0U;
+}
+
+/**
+ * @brief Checks whether a request may be transmitted once some in-flight requests complete.
+ *
+ * Besides the pipeline depth, the sequence byte of the request must not
+ * alias the one of a request that is still pending. Bulk requests leave the
+ * last in-flight slot to the other classes.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the candidate request.
+ * @param priority The priority class of the candidate request.
+ * @param completing In-flight requests known to complete before the candidate is recorded.
+ * @return Non-zero if the request may be transmitted.
+ */
+static int can_transmit_after(const spi_ctx_t *ctx, uint16_t sequence, spi_priority_t priority, size_t completing) {
+    unsigned int depth = ctx->pipeline_depth;
+
+    if ((priority == SPI_PRIORITY_BULK) && (depth > 1U)) {
+        depth--;
+    }
+    if ((ctx->inflight_count + ctx->exchanging - completing) >= depth) {
+        return 0;
+    }
+    return sequence_available(ctx, sequence);
+}
+
+/**
+ * @brief Checks whether a request may be transmitted now.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the candidate request.
+ * @param priority The priority class of the candidate request.
+ * @return Non-zero if the request may be transmitted.
+ */
+static int can_transmit(const spi_ctx_t *ctx, uint16_t sequence, spi_priority_t priority) {
+    return can_transmit_after(ctx, sequence, priority, 0U);
+}
+
+/**
+ * @brief Checks whether transmissions clock in responses.
+ *
+ * @param ctx The device context.
+ * @return Non-zero in duplex mode while the GPIO line is serviced inline and
+ *         responses are not streamed.
+ */
+static int duplex_active(const spi_ctx_t *ctx) {
+    return (ctx->duplex_window > 0U) && (ctx->read_mode != SPI_READ_STREAM) &&
+           (atomic_load(&ctx->receiver_running) == 0);
+}
+
+/**
+ * @brief Checks whether queued requests may overtake each other.
+ *
+ * In version 1 responses are matched in transmission order, which must then
+ * be sequence order while several requests are in flight, or while duplex
+ * transfers move the next request onto the wire before the previous response
+ * has been routed.
+ *
+ * @param ctx The device context.
+ * @return Non-zero if the most urgent class goes first.
+ */
+static int may_reorder(const spi_ctx_t *ctx) {
+    if (ctx->protocol == SPI_PROTOCOL_V2) {
+        return 1;
+    }
+    return (ctx->pipeline_depth == 1U) && !duplex_active(ctx);
+}
+
+/**
+ * @brief Returns the queued request that is to be transmitted next.
+ *
+ * @param ctx The device context.
+ * @return The request, or NULL if the queue is empty.
+ */
+static spi_queued_request_t *peek_queued(spi_ctx_t *ctx) {
+    spi_queued_request_t *next = NULL;
+
+    for (size_t priority = 0U; priority < SPI_PRIORITY_CLASSES; priority++) {
+        if (ctx->class_count[priority] == 0U) {
+            continue;
+        }
+        spi_queued_request_t *head = &ctx->submit_queue[ctx->class_queue[priority][ctx->class_head[priority]]];
+        if (may_reorder(ctx)) {
+            return head;
+        }
+        if ((next == NULL) || ((int16_t)(head->sequence - next->sequence) < 0)) {
+            next = head;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Checks whether a new request has to wait behind queued ones.
+ *
+ * @param ctx The device context.
+ * @param priority The priority class of the new request.
+ * @return Non-zero if a queued request is to be transmitted first.
+ */
+static int queued_ahead(const spi_ctx_t *ctx, spi_priority_t priority) {
+    if (!may_reorder(ctx)) {
+        return ctx->queue_count > 0U;
     }
+    for (size_t i = 0U; i <= (size_t)priority; i++) {
+        if (ctx->class_count[i] > 0U) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    // Wait for interrupt and handle response asynchronously
-    wait_for_gpio_interrupt(callback);
+/**
+ * @brief Records a transmitted request as awaiting its response.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID of the request.
+ * @param callback The callback function to handle the response.
+ * @param bulk The transfer the request is a fragment of, NULL for an ordinary request.
+ * @param deadline_ns CLOCK_MONOTONIC deadline of the request, 0 for none.
+ * @param submit_ns CLOCK_MONOTONIC time the request was submitted.
+ */
+static void push_inflight(spi_ctx_t *ctx, uint16_t sequence, uint8_t function_id, spi_callback_t callback,
+                          spi_bulk_t *bulk, uint64_t deadline_ns, uint64_t submit_ns) {
+    spi_inflight_t *slot = &ctx->inflight[sequence % PENDING_TABLE_SIZE];
+    slot->sequence = sequence;
+    slot->function_id = function_id;
+    slot->callback = callback;
+    slot->bulk = bulk;
+    slot->deadline_ns = deadline_ns;
+    slot->submit_ns = submit_ns;
+    slot->active = 1U;
+    // A request that waited in a lower priority class goes out after younger
+    // ones; tags are handed out at submission, so the oldest request is the
+    // one furthest behind next_sequence
+    if ((ctx->inflight_count == 0U) ||
+        ((uint16_t)(ctx->next_sequence - sequence) > (uint16_t)(ctx->next_sequence - ctx->inflight_oldest))) {
+        ctx->inflight_oldest = sequence;
+    }
+    ctx->inflight_count++;
+    ctx->stats.requests++;
+}
+
+/**
+ * @brief Retires an in-flight request and invokes its callback.
+ *
+ * @param ctx The device context.
+ * @param slot The pending table entry of the request.
+ * @param error Result of the request.
+ * @param resp The parsed response, used only when error is SPI_SUCCESS.
+ */
+static void complete_request(spi_ctx_t *ctx, spi_inflight_t *slot, spi_error_t error, spi_response_t *resp) {
+    // Retire the slot before the callback so that it may submit new requests
+    spi_inflight_t req = *slot;
+    slot->active = 0U;
+    ctx->inflight_count--;
+    while (ctx->inflight_count > 0U) {
+        const spi_inflight_t *oldest = &ctx->inflight[ctx->inflight_oldest % PENDING_TABLE_SIZE];
+        if ((oldest->active != 0U) && (oldest->sequence == ctx->inflight_oldest)) {
+            break;
+        }
+        ctx->inflight_oldest++;
+    }
+
+    uint64_t start = monotonic_ns();
+    spi_hist_record(&ctx->stats.request_ns, start - req.submit_ns);
+    if (error == SPI_SUCCESS) {
+        ctx->stats.responses++;
+        resp->sequence = req.sequence;
+        if (req.bulk != NULL) {
+            complete_fragment(req.bulk, req.sequence, SPI_SUCCESS, resp);
+        } else {
+            notify(ctx, req.callback, SPI_SUCCESS, resp);
+        }
+    } else {
+        if (error == SPI_ERROR_TIMEOUT) {
+            ctx->stats.timeouts++;
+        }
+        fail_sequence(ctx, req.callback, req.bulk, error, req.function_id, req.sequence);
+    }
+    spi_hist_record(&ctx->stats.callback_ns, monotonic_ns() - start);
+}
+
+/**
+ * @brief Completes the in-flight request a received frame belongs to.
+ *
+ * With SPI_PROTOCOL_V2 a valid frame is matched through its sequence byte.
+ * A frame whose header could not be parsed or whose CRC failed fails the
+ * oldest request instead: its sequence byte is covered by the same CRC and
+ * cannot be trusted. With SPI_PROTOCOL_V1 the frame always completes the
+ * oldest request.
+ *
+ * @param ctx The device context.
+ * @param error Result of reading and validating the frame.
+ * @param resp The parsed response.
+ * @return 1 if a request was completed, 0 if the frame matches no request.
+ */
+static int route_frame(spi_ctx_t *ctx, spi_error_t error, spi_response_t *resp) {
+    if (error == SPI_ERROR_CRC_MISMATCH) {
+        ctx->stats.crc_errors++;
+    } else if (error == SPI_ERROR_INVALID_FORMAT) {
+        ctx->stats.format_errors++;
+    }
+
+    if (ctx->inflight_count == 0U) {
+        ctx->stats.unsolicited++;
+        return 0;
+    }
+
+    spi_inflight_t *slot = &ctx->inflight[ctx->inflight_oldest % PENDING_TABLE_SIZE];
+    if ((ctx->protocol == SPI_PROTOCOL_V2) && (error == SPI_SUCCESS)) {
+        slot = &ctx->inflight[resp->sequence % PENDING_TABLE_SIZE];
+        if (slot->active == 0U) {
+            debug_print("Response with sequence %u matches no pending request\n", resp->sequence);
+            ctx->stats.unsolicited++;
+            return 0;
+        }
+    }
+
+    complete_request(ctx, slot, error, resp);
+    return 1;
+}
+
+/**
+ * @brief Fails every in-flight request whose deadline has passed.
+ *
+ * The pending table is scanned once, starting at the oldest request, so the
+ * cost is bounded by its size however far a request without a deadline
+ * lags behind the newest tags.
+ *
+ * @param ctx The device context.
+ * @param completed Incremented for every request completed.
+ */
+static void expire_requests(spi_ctx_t *ctx, int *completed) {
+    uint64_t now = monotonic_ns();
+    size_t start = ctx->inflight_oldest % PENDING_TABLE_SIZE;
+
+    for (size_t i = 0U; (i < PENDING_TABLE_SIZE) && (ctx->inflight_count > 0U); i++) {
+        spi_inflight_t *slot = &ctx->inflight[(start + i) % PENDING_TABLE_SIZE];
+        if ((slot->active != 0U) && (slot->deadline_ns != 0U) && (slot->deadline_ns <= now)) {
+            debug_print("Request %u timed out\n", slot->sequence);
+            complete_request(ctx, slot, SPI_ERROR_TIMEOUT, NULL);
+            (*completed)++;
+        }
+    }
+}
+
+/**
+ * @brief Bounds a wait by the earliest deadline of the in-flight requests.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Requested wait in milliseconds, -1 to wait forever.
+ * @return The wait in milliseconds to pass to poll().
+ */
+static int bound_timeout(const spi_ctx_t *ctx, int timeout_ms) {
+    uint64_t earliest = 0U;
+
+    for (size_t i = 0U; (i < PENDING_TABLE_SIZE) && (ctx->inflight_count > 0U); i++) {
+        const spi_inflight_t *slot = &ctx->inflight[i];
+        if ((slot->active != 0U) && (slot->deadline_ns != 0U) &&
+            ((earliest == 0U) || (slot->deadline_ns < earliest))) {
+            earliest = slot->deadline_ns;
+        }
+    }
+    if (earliest == 0U) {
+        return timeout_ms;
+    }
+
+    uint64_t now = monotonic_ns();
+    // Round up so that the deadline has passed when poll() returns
+    int remaining = (earliest <= now) ? 0 : (int)(((earliest - now) + 999999U) / 1000000U);
+    if ((timeout_ms < 0) || (remaining < timeout_ms)) {
+        return remaining;
+    }
+    return timeout_ms;
+}
+
+/**
+ * @brief Transmits a request while clocking in the response the slave has ready.
+ *
+ * The request frame is padded with 0xFF up to the duplex window and received
+ * into the response buffer. When the window may be too small for the
+ * response, chip select is held and the rest of the response, if any, is
+ * read by a second transfer. The captured response is routed to its own
+ * request before the new request is recorded as in flight, so that it can
+ * never be credited to a request the slave had not seen yet.
+ *
+ * Without an edge waiting to be serviced the slave may still have loaded a
+ * response just before the transfer: if one was clocked in it is routed
+ * and its edge is skipped when it is read, otherwise nothing is routed.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ * @param bulk The transfer the request is a fragment of, NULL for an ordinary request.
+ * @param deadline_ns CLOCK_MONOTONIC deadline of the request, 0 for none.
+ * @param submit_ns CLOCK_MONOTONIC time the request was submitted.
+ * @return Number of requests completed by the captured response.
+ */
+static int exchange_request(spi_ctx_t *ctx, uint16_t sequence, uint8_t function_id, const uint8_t *payload,
+                            uint16_t payload_size, spi_callback_t callback, spi_bulk_t *bulk, uint64_t deadline_ns,
+                            uint64_t submit_ns) {
+    struct spi_ioc_transfer segments[4];
+    uint8_t header[FRAME_HEADER_SIZE + SIZE_SEQUENCE];
+    uint8_t trailer[SIZE_CRC8 + STOP_IDENTIFIER_SIZE];
+    uint8_t *rx = ctx->response_buffer;
+    const uint8_t *fill = ctx->frame_pool.tx_fill;
+    size_t header_length = header_size(ctx->protocol);
+    size_t frame_max = header_length + MAX_PAYLOAD_SIZE + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+    const uint8_t *start_identifier = (ctx->protocol == SPI_PROTOCOL_V2) ? START_IDENTIFIER_V2 : START_IDENTIFIER;
+    int announced = (ctx->edge_next < ctx->edge_count);
+    size_t segment_count = 0U;
+    size_t length;
+    uint32_t crc;
+    spi_response_t resp;
+    spi_error_t error;
+
+    length = encode_header(ctx->protocol, header, sequence, function_id, payload_size, &crc);
+    init_transfer(ctx, &segments[segment_count++], header, rx, length);
+    if (payload_size > 0U) {
+        crc = crc32_update(crc, payload, payload_size);
+        init_transfer(ctx, &segments[segment_count++], payload, &rx[length], payload_size);
+        length += payload_size;
+    }
+    init_transfer(ctx, &segments[segment_count++], trailer, &rx[length], encode_trailer(trailer, crc));
+    length += SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+    size_t frame_length = length;
+
+    size_t window = (ctx->duplex_window < frame_max) ? ctx->duplex_window : frame_max;
+    if (length < window) {
+        init_transfer(ctx, &segments[segment_count++], fill, &rx[length], window - length);
+        length = window;
+    }
+    // Keep chip select asserted while the response may be longer than what was clocked
+    int hold = (length < frame_max);
+    segments[segment_count - 1U].cs_change = (uint8_t)hold;
+
+    debug_print("Starting duplex SPI transfer: %zu segments, %zu bytes\n", segment_count, length);
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    int ret = do_transfer(ctx, segment_count, segments);
+    if ((ret >= 0) && hold) {
+        struct spi_ioc_transfer rest;
+        uint16_t announced_size = (uint16_t)((rx[header_length - 1U] << 8U) | rx[header_length - 2U]);
+        size_t needed = header_length + announced_size + SIZE_CRC8 + STOP_IDENTIFIER_SIZE;
+
+        if ((memcmp(rx, start_identifier, START_IDENTIFIER_SIZE) == 0) && (announced_size <= MAX_PAYLOAD_SIZE) &&
+            (needed > length)) {
+            init_transfer(ctx, &rest, fill, &rx[length], needed - length);
+            length = needed;
+        } else {
+            // Everything is in; only release chip select
+            init_transfer(ctx, &rest, NULL, NULL, 0U);
+        }
+        ret = do_transfer(ctx, 1U, &rest);
+    }
+    if (ret >= 0) {
+        record_edge_latency(ctx);
+        ctx->stats.bytes_tx += frame_length;
+        ctx->stats.bytes_rx += length;
+    }
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+
+    if (ret < 0) {
+        perror("Failed to transfer SPI message");
+        int completed = route_frame(ctx, SPI_ERROR_UNKNOWN, &resp);
+        fail_sequence(ctx, callback, bulk, SPI_ERROR_UNKNOWN, function_id, sequence);
+        return completed;
+    }
+
+    if (!announced) {
+        if (memcmp(rx, start_identifier, START_IDENTIFIER_SIZE) != 0) {
+            push_inflight(ctx, sequence, function_id, callback, bulk, deadline_ns, submit_ns);
+            return 0;
+        }
+        ctx->edges_early++;
+    }
+
+    // The new request keeps its in-flight slot reserved while callbacks run
+    ctx->exchanging = 1U;
+    error = spi_frame_decode(ctx->protocol, rx, length, &resp);
+    int completed = route_frame(ctx, error, &resp);
+    if (completed == 0) {
+        deliver_unsolicited(ctx, error, &resp);
+    }
+    ctx->exchanging = 0U;
+
+    push_inflight(ctx, sequence, function_id, callback, bulk, deadline_ns, submit_ns);
+    return completed;
+}
+
+/**
+ * @brief Transmits a request and records it as in flight.
+ *
+ * A failed transmission completes the request immediately with an error. In
+ * duplex mode a response the slave has ready is clocked in by the same
+ * transfer and routed to its request.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag of the request.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ * @param bulk The transfer the request is a fragment of, NULL for an ordinary request.
+ * @param deadline_ns CLOCK_MONOTONIC deadline of the request, 0 for none.
+ * @param submit_ns CLOCK_MONOTONIC time the request was submitted.
+ * @return Number of requests completed by a piggybacked response.
+ */
+static int dispatch_request(spi_ctx_t *ctx, uint16_t sequence, uint8_t function_id, const uint8_t *payload,
+                            uint16_t payload_size, spi_callback_t callback, spi_bulk_t *bulk, uint64_t deadline_ns,
+                            uint64_t submit_ns) {
+    // A duplex slave shifts a response out during any transfer, also one it
+    // loads after the edges were polled, so every request is exchanged
+    if (duplex_active(ctx)) {
+        if (ctx->edge_next == ctx->edge_count) {
+            (void)wait_for_gpio_interrupt(ctx, 0);
+        }
+        return exchange_request(ctx, sequence, function_id, payload, payload_size, callback, bulk, deadline_ns,
+                                submit_ns);
+    }
+
+    if (transmit_request(ctx, sequence, function_id, payload, payload_size) < 0) {
+        fail_sequence(ctx, callback, bulk, SPI_ERROR_UNKNOWN, function_id, sequence);
+        return 0;
+    }
+
+    push_inflight(ctx, sequence, function_id, callback, bulk, deadline_ns, submit_ns);
+    return 0;
+}
+
+/**
+ * @brief Takes the next request off the submission queue.
+ *
+ * Requests whose deadline passed while they were queued fail without being
+ * transmitted. The time the request spent queued is recorded for its class.
+ *
+ * @param ctx The device context.
+ * @return The request, valid until the next submission, or NULL if none is left.
+ */
+static spi_queued_request_t *pop_queued(spi_ctx_t *ctx) {
+    spi_queued_request_t *req;
+
+    while ((req = peek_queued(ctx)) != NULL) {
+        size_t priority = (size_t)req->priority;
+        ctx->queue_used &= ~(1U << ctx->class_queue[priority][ctx->class_head[priority]]);
+        ctx->class_head[priority] = (ctx->class_head[priority] + 1U) % SUBMIT_QUEUE_SIZE;
+        ctx->class_count[priority]--;
+        ctx->queue_count--;
+
+        uint64_t now = monotonic_ns();
+        if ((req->deadline_ns != 0U) && (req->deadline_ns <= now)) {
+            ctx->stats.timeouts++;
+            fail_sequence(ctx, req->callback, req->bulk, SPI_ERROR_TIMEOUT, req->function_id, req->sequence);
+            continue;
+        }
+        spi_hist_record(&ctx->stats.queue_ns[priority], now - req->submit_ns);
+        return req;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Transmits a request, or queues it until it may be transmitted.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ * @param bulk The transfer the request is a fragment of, NULL for an ordinary request.
+ * @param priority The priority class of the request.
+ * @return The sequence tag of the request, or -1 with errno set.
+ */
+static int submit_request(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size,
+                          spi_callback_t callback, spi_bulk_t *bulk, spi_priority_t priority) {
+    if (payload_size > MAX_PAYLOAD_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((unsigned int)priority >= SPI_PRIORITY_CLASSES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t submit_ns = monotonic_ns();
+    uint64_t deadline_ns = deadline_after(ctx->request_timeout_ms);
+
+    // Keep class order: only bypass the queue when nothing is waiting to go first
+    if (!queued_ahead(ctx, priority) && can_transmit(ctx, ctx->next_sequence, priority)) {
+        uint16_t sequence = ctx->next_sequence++;
+        spi_hist_record(&ctx->stats.queue_ns[priority], 0U);
+        (void)dispatch_request(ctx, sequence, function_id, payload, payload_size, callback, bulk, deadline_ns,
+                               submit_ns);
+        return (int)sequence;
+    }
+
+    if (ctx->queue_count == SUBMIT_QUEUE_SIZE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    uint8_t index = (uint8_t)__builtin_ctz(~ctx->queue_used);
+    spi_queued_request_t *req = &ctx->submit_queue[index];
+    req->sequence = ctx->next_sequence++;
+    req->function_id = function_id;
+    req->payload_size = payload_size;
+    req->priority = priority;
+    req->callback = callback;
+    req->bulk = bulk;
+    req->deadline_ns = deadline_ns;
+    req->submit_ns = submit_ns;
+    (void)memcpy(req->payload, payload, payload_size);
+    ctx->queue_used |= 1U << index;
+    ctx->class_queue[priority][(ctx->class_head[priority] + ctx->class_count[priority]) % SUBMIT_QUEUE_SIZE] = index;
+    ctx->class_count[priority]++;
+    ctx->queue_count++;
+    debug_print("Request %u queued in class %d, %zu waiting\n", req->sequence, (int)priority, ctx->queue_count);
+
+    return (int)req->sequence;
+}
+
+/**
+ * @brief Submits the next fragment of a bulk transfer.
+ *
+ * The fragment carries the next request data or, once all of it has been
+ * submitted, polls the slave for more of the response.
+ *
+ * @param ctx The device context.
+ * @param bulk The transfer.
+ * @return 0 on success, -1 with errno set if the fragment was not accepted.
+ */
+static int submit_fragment(spi_ctx_t *ctx, spi_bulk_t *bulk) {
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    uint32_t offset = bulk->request_sent;
+    size_t length = 0U;
+
+    if (!bulk->request_done) {
+        length = bulk->request_size - offset;
+        length = (length > SPI_FRAGMENT_DATA_MAX) ? SPI_FRAGMENT_DATA_MAX : length;
+        (void)memcpy(&payload[SPI_FRAGMENT_HEADER_SIZE], &bulk->request[offset], length);
+    }
+    put_le32(payload, offset);
+    put_le32(&payload[4], bulk->request_size);
+
+    // Account for the fragment first: a failed transmission completes it at once
+    uint16_t sequence = ctx->next_sequence;
+    int poll = bulk->request_done;
+    bulk->outstanding++;
+    if (poll) {
+        bulk->polls++;
+    } else {
+        bulk->request_sent += (uint32_t)length;
+        if (bulk->request_sent == bulk->request_size) {
+            bulk->request_done = 1U;
+            bulk->last_sequence = sequence;
+        }
+    }
+
+    if (submit_request(ctx, bulk->function_id, payload, (uint16_t)(SPI_FRAGMENT_HEADER_SIZE + length), NULL, bulk,
+                       SPI_PRIORITY_BULK) < 0) {
+        bulk->outstanding--;
+        if (poll) {
+            bulk->polls--;
+        } else {
+            bulk->request_sent = offset;
+            bulk->request_done = 0U;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Keeps up to the pipeline depth of fragments of a bulk transfer outstanding.
+ *
+ * Polls are only sent once the last request fragment has been answered, and
+ * no more of them than the rest of the response is expected to take at the
+ * fragment size the slave last used.
+ *
+ * @param ctx The device context.
+ * @param bulk The transfer.
+ */
+static void pump_bulk(spi_ctx_t *ctx, spi_bulk_t *bulk) {
+    while (bulk->active && !bulk->finished && (bulk->outstanding < ctx->pipeline_depth)) {
+        if (bulk->request_done) {
+            if (!bulk->acknowledged || (bulk->response_received >= bulk->response_total)) {
+                break;
+            }
+            uint32_t chunk = (bulk->chunk != 0U) ? bulk->chunk : SPI_FRAGMENT_DATA_MAX;
+            uint32_t remaining = bulk->response_total - bulk->response_received;
+            if (bulk->polls >= (remaining + chunk - 1U) / chunk) {
+                break;
+            }
+        }
+        if (submit_fragment(ctx, bulk) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Submits the next fragments of every bulk transfer in progress.
+ *
+ * @param ctx The device context.
+ */
+static void pump_bulks(spi_ctx_t *ctx) {
+    for (size_t i = 0U; i < SPI_MAX_BULK; i++) {
+        pump_bulk(ctx, &ctx->bulks[i]);
+    }
+}
+
+/**
+ * @brief Moves queued requests onto the wire while in-flight slots are free.
+ *
+ * @param ctx The device context.
+ * @return Number of requests completed by piggybacked responses.
+ */
+static int pump_submit_queue(spi_ctx_t *ctx) {
+    int completed = 0;
+    spi_queued_request_t *req;
+
+    while (((req = peek_queued(ctx)) != NULL) && can_transmit(ctx, req->sequence, req->priority)) {
+        req = pop_queued(ctx);
+        if (req == NULL) {
+            break;
+        }
+        completed += dispatch_request(ctx, req->sequence, req->function_id, req->payload, req->payload_size,
+                                      req->callback, req->bulk, req->deadline_ns, req->submit_ns);
+    }
+    pump_bulks(ctx);
+    return completed;
+}
+
+/**
+ * @brief Sets the number of requests kept outstanding at the SPI slave.
+ *
+ * @param ctx The device context.
+ * @param depth Number of in-flight requests, clamped to 1..SPI_MAX_INFLIGHT.
+ */
+void spi_pipeline_set_depth(spi_ctx_t *ctx, unsigned int depth) {
+    if (depth < 1U) {
+        depth = 1U;
+    } else if (depth > SPI_MAX_INFLIGHT) {
+        depth = SPI_MAX_INFLIGHT;
+    }
+    ctx->pipeline_depth = depth;
+    (void)pump_submit_queue(ctx);
+}
+
+/**
+ * @brief Selects the framing protocol spoken with the SPI slave.
+ *
+ * @param ctx The device context.
+ * @param protocol The protocol to use for subsequent requests and responses.
+ */
+void spi_set_protocol(spi_ctx_t *ctx, spi_protocol_t protocol) {
+    ctx->protocol = protocol;
+}
+
+/**
+ * @brief Enables clocking in responses while requests are transmitted.
+ *
+ * @param ctx The device context.
+ * @param window Bytes clocked per request transfer, 0 to disable duplex mode.
+ */
+void spi_set_duplex(spi_ctx_t *ctx, size_t window) {
+    ctx->duplex_window = window;
+}
+
+/**
+ * @brief Sets the deadline applied to subsequently submitted requests.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Deadline in milliseconds, 0 or negative for none.
+ */
+void spi_set_request_timeout(spi_ctx_t *ctx, int timeout_ms) {
+    ctx->request_timeout_ms = timeout_ms;
+}
+
+/**
+ * @brief Submits a request to the pipelined request engine.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ * @return The sequence tag of the request, or -1 with errno set.
+ */
+int spi_submit(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size, spi_callback_t callback) {
+    return spi_submit_priority(ctx, function_id, payload, payload_size, callback, SPI_PRIORITY_NORMAL);
+}
+
+/**
+ * @brief Submits a request in a priority class.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ * @param priority The priority class of the request.
+ * @return The sequence tag of the request, or -1 with errno set.
+ */
+int spi_submit_priority(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size,
+                        spi_callback_t callback, spi_priority_t priority) {
+    return submit_request(ctx, function_id, payload, payload_size, callback, NULL, priority);
+}
+
+/**
+ * @brief Submits a request whose payload is transmitted straight from caller buffers.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param iov Payload buffers, in wire order.
+ * @param iovcnt Number of payload buffers.
+ * @param callback The callback function to handle the response.
+ * @return The sequence tag of the request, or -1 with errno set.
+ */
+int spi_submit_iov(spi_ctx_t *ctx, uint8_t function_id, const struct iovec *iov, size_t iovcnt, spi_callback_t callback) {
+    size_t payload_size = 0U;
+
+    if (iovcnt > SPI_MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0U; i < iovcnt; i++) {
+        payload_size += iov[i].iov_len;
+    }
+    if (payload_size > MAX_PAYLOAD_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // A duplex slave would shift a pending response out during this transfer
+    if (duplex_active(ctx)) {
+        (void)spi_dispatch(ctx);
+    }
+
+    // The buffers are only borrowed for this call, so the request cannot be queued
+    if ((ctx->queue_count != 0U) || !can_transmit(ctx, ctx->next_sequence, SPI_PRIORITY_NORMAL)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    uint64_t submit_ns = monotonic_ns();
+    uint16_t sequence = ctx->next_sequence++;
+    if (transmit_iov(ctx, sequence, function_id, iov, iovcnt) < 0) {
+        fail_request(ctx, callback, SPI_ERROR_UNKNOWN, function_id, sequence);
+        return (int)sequence;
+    }
+
+    push_inflight(ctx, sequence, function_id, callback, NULL, deadline_after(ctx->request_timeout_ms), submit_ns);
+
+    return (int)sequence;
+}
+
+/**
+ * @brief Transmits several requests with a single SPI_IOC_MESSAGE ioctl.
+ *
+ * A batch takes no more requests than the pipeline depth leaves room for,
+ * since version 1 responses are matched in order and the slave holds only
+ * that many. Each ioctl is further bounded by the spidev buffer and by the
+ * run of free sequence bytes.
+ *
+ * @param ctx The device context.
+ * @param requests Array of requests to transmit.
+ * @param count Number of requests in the array.
+ * @param first_sequence If not NULL, receives the sequence tag of the first accepted request.
+ * @return Number of requests accepted, or -1 with errno set.
+ */
+int spi_send_batch(spi_ctx_t *ctx, const spi_request_t *requests, size_t count, uint16_t *first_sequence) {
+    uint8_t *batch_buffer = ctx->batch_buffer;
+    struct spi_ioc_transfer segments[SPI_MAX_INFLIGHT];
+    size_t accepted = 0U;
+
+    for (size_t i = 0U; i < count; i++) {
+        if (requests[i].payload_size > MAX_PAYLOAD_SIZE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    // A duplex slave would shift a pending response out during the batch
+    if (duplex_active(ctx)) {
+        (void)spi_dispatch(ctx);
+    }
+
+    if (first_sequence != NULL) {
+        *first_sequence = ctx->next_sequence;
+    }
+    uint64_t submit_ns = monotonic_ns();
+
+    // Queued requests were submitted earlier and must go out first
+    if ((ctx->queue_count != 0U) || !can_transmit(ctx, ctx->next_sequence, SPI_PRIORITY_NORMAL)) {
+        return 0;
+    }
+
+    while (accepted < count) {
+        size_t segment_count = 0U;
+        size_t used = 0U;
+        size_t first = accepted;
+
+        while ((accepted < count) && (ctx->inflight_count + ctx->exchanging + segment_count < ctx->pipeline_depth)) {
+            const spi_request_t *req = &requests[accepted];
+            size_t frame_size = FRAME_SIZE(req->payload_size) + SIZE_SEQUENCE;
+            // Tags are handed out once the batch is on the wire, in request order
+            uint16_t sequence = (uint16_t)(ctx->next_sequence + segment_count);
+            if ((used + frame_size > BATCH_MAX_BYTES) || !sequence_available(ctx, sequence)) {
+                break;
+            }
+
+            frame_size = spi_frame_encode(ctx->protocol, &batch_buffer[used], sequence, req->function_id, req->payload, req->payload_size);
+            init_transfer(ctx, &segments[segment_count], &batch_buffer[used], NULL, frame_size);
+            segments[segment_count].cs_change = req->cs_change;
+            segments[segment_count].delay_usecs = req->delay_usecs;
+            used += frame_size;
+            segment_count++;
+            accepted++;
+        }
+
+        if (segment_count == 0U) {
+            break;
+        }
+        // On the last segment cs_change would keep chip select asserted after the message
+        segments[segment_count - 1U].cs_change = 0U;
+
+        debug_print("Starting batched SPI transfer: %zu segments, %zu bytes\n", segment_count, used);
+        (void)pthread_mutex_lock(&ctx->bus_lock);
+        int ret = do_transfer(ctx, segment_count, segments);
+        if (ret >= 0) {
+            ctx->stats.bytes_tx += used;
+        }
+        (void)pthread_mutex_unlock(&ctx->bus_lock);
+        for (size_t i = first; i < accepted; i++) {
+            uint16_t sequence = ctx->next_sequence++;
+            if (ret < 0) {
+                fail_request(ctx, requests[i].callback, SPI_ERROR_UNKNOWN, requests[i].function_id, sequence);
+                continue;
+            }
+            int timeout_ms = (requests[i].timeout_ms != 0) ? requests[i].timeout_ms : ctx->request_timeout_ms;
+            push_inflight(ctx, sequence, requests[i].function_id, requests[i].callback, NULL,
+                          deadline_after(timeout_ms), submit_ns);
+        }
+        if (ret < 0) {
+            perror("Failed to transfer SPI batch");
+        }
+    }
+
+    return (int)accepted;
+}
+
+/**
+ * @brief Submits a transfer of any size, split into fragments.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID of every fragment.
+ * @param data The request data.
+ * @param size The size of the request data.
+ * @param response The buffer the response is reassembled in.
+ * @param response_capacity The size of the response buffer.
+ * @param callback Called once the transfer has completed or failed.
+ * @return 0 on success, or -1 with errno set.
+ */
+int spi_submit_bulk(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *data, size_t size, uint8_t *response,
+                    size_t response_capacity, spi_bulk_callback_t callback) {
+    spi_bulk_t *bulk = NULL;
+
+    if ((size > UINT32_MAX) || (callback == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0U; (i < SPI_MAX_BULK) && (bulk == NULL); i++) {
+        if (!ctx->bulks[i].active) {
+            bulk = &ctx->bulks[i];
+        }
+    }
+    if (bulk == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    (void)memset(bulk, 0, sizeof(*bulk));
+    bulk->function_id = function_id;
+    bulk->request = data;
+    bulk->request_size = (uint32_t)size;
+    bulk->response = response;
+    bulk->response_capacity = response_capacity;
+    bulk->callback = callback;
+    bulk->active = 1U;
+
+    if (submit_fragment(ctx, bulk) < 0) {
+        bulk->active = 0U;
+        return -1;
+    }
+    pump_bulk(ctx, bulk);
+    return 0;
+}
+
+/**
+ * @brief Where route_stream_frame() delivers to.
+ */
+typedef struct {
+    spi_ctx_t *ctx;
+    int *completed;   // Incremented for every request completed
+} stream_route_t;
+
+/**
+ * @brief Completes the in-flight request a frame found in the stream belongs to.
+ *
+ * @param arg The stream_route_t of the servicing call.
+ * @param frame Start of the frame in the reassembly buffer.
+ * @param length Total size of the frame.
+ * @param resp The parsed frame.
+ */
+static void route_stream_frame(void *arg, const uint8_t *frame, size_t length, spi_response_t *resp) {
+    stream_route_t *route = arg;
+
+    (void)frame;
+    (void)length;
+    if (route_frame(route->ctx, SPI_SUCCESS, resp) != 0) {
+        (*route->completed)++;
+    } else {
+        deliver_unsolicited(route->ctx, SPI_SUCCESS, resp);
+    }
+}
+
+/**
+ * @brief Reads the frame announced by one GPIO edge and completes its request.
+ *
+ * A frame that matches no in-flight request is unsolicited; it is read so
+ * that the slave can release the line and passed to its handler, if any.
+ *
+ * @param ctx The device context.
+ * @param completed Incremented for every request completed.
+ */
+static void service_edge(spi_ctx_t *ctx, int *completed) {
+    spi_queued_request_t *req = NULL;
+    spi_response_t resp;
+
+    // In duplex mode the next queued request clocks the response in. It may
+    // count on the slot of the response only under version 1, where every
+    // frame completes the oldest request; a version 2 frame may match none
+    if (duplex_active(ctx)) {
+        size_t completing = ((ctx->protocol == SPI_PROTOCOL_V1) && (ctx->inflight_count > 0U)) ? 1U : 0U;
+        req = peek_queued(ctx);
+        if ((req != NULL) && can_transmit_after(ctx, req->sequence, req->priority, completing)) {
+            req = pop_queued(ctx);
+        } else {
+            req = NULL;
+        }
+    }
+
+    if (req != NULL) {
+        *completed += exchange_request(ctx, req->sequence, req->function_id, req->payload, req->payload_size,
+                                       req->callback, req->bulk, req->deadline_ns, req->submit_ns);
+    } else {
+        spi_error_t error = read_response(ctx, ctx->response_buffer, &resp);
+        if (route_frame(ctx, error, &resp) != 0) {
+            (*completed)++;
+        } else {
+            deliver_unsolicited(ctx, error, &resp);
+        }
+    }
+}
+
+/**
+ * @brief Services the GPIO interrupts of one wakeup.
+ *
+ * Every edge consumed, up to the drain budget, has its frame read before
+ * deadlines are checked and queued requests are transmitted.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Maximum time to wait for the GPIO interrupt, -1 to wait forever.
+ * @param completed Incremented for every request completed.
+ * @return Number of edges serviced, 0 if none was pending, -1 on error.
+ */
+static int service_interrupt(spi_ctx_t *ctx, int timeout_ms, int *completed) {
+    int ret = wait_for_gpio_interrupt(ctx, bound_timeout(ctx, timeout_ms));
+    if (ret < 0) {
+        if (ctx->inflight_count > 0U) {
+            complete_request(ctx, &ctx->inflight[ctx->inflight_oldest % PENDING_TABLE_SIZE], SPI_ERROR_UNKNOWN, NULL);
+            (*completed)++;
+        }
+    } else if ((ret > 0) && (ctx->read_mode == SPI_READ_STREAM)) {
+        // One stream read takes the frames of every edge consumed
+        stream_route_t route = {ctx, completed};
+        if ((read_stream(ctx, route_stream_frame, &route) < 0) && (ctx->inflight_count > 0U)) {
+            complete_request(ctx, &ctx->inflight[ctx->inflight_oldest % PENDING_TABLE_SIZE], SPI_ERROR_UNKNOWN, NULL);
+            (*completed)++;
+        }
+    } else {
+        for (int edge = 0; edge < ret; edge++) {
+            service_edge(ctx, completed);
+        }
+    }
+
+    expire_requests(ctx, completed);
+    *completed += pump_submit_queue(ctx);
+    return ret;
+}
+
+/**
+ * @brief Hands frames buffered by the receiver thread to their consumers.
+ *
+ * Frames complete the in-flight request they belong to; frames that match
+ * no request are passed to the spi_start_receiving() callback.
+ *
+ * @param ctx The device context.
+ * @param max_frames Maximum number of frames to deliver.
+ * @param completed Incremented for every request completed.
+ * @return Number of frames delivered.
+ */
+static size_t drain_ring(spi_ctx_t *ctx, size_t max_frames, int *completed) {
+    size_t delivered = 0U;
+    size_t tail = atomic_load_explicit(&ctx->rx_tail, memory_order_relaxed);
+
+    while (delivered < max_frames) {
+        size_t head = atomic_load_explicit(&ctx->rx_head, memory_order_acquire);
+        if (tail == head) {
+            break;
+        }
+
+        spi_rx_slot_t *slot = &ctx->rx_ring[tail % RX_RING_SIZE];
+        if (route_frame(ctx, slot->error, &slot->response) != 0) {
+            (*completed)++;
+        } else {
+            deliver_unsolicited(ctx, slot->error, &slot->response);
+        }
+
+        // Hand the slot back to the receiver thread only after the callback returned
+        tail++;
+        atomic_store_explicit(&ctx->rx_tail, tail, memory_order_release);
+        delivered++;
+    }
+
+    expire_requests(ctx, completed);
+    *completed += pump_submit_queue(ctx);
+    return delivered;
+}
+
+/**
+ * @brief Waits for frames from the receiver thread and delivers them.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Maximum time to wait for a frame, -1 to wait forever.
+ * @param completed Incremented for every request completed.
+ * @return Number of frames delivered, 0 if interrupted by a signal, or -1 on error.
+ */
+static int service_ring(spi_ctx_t *ctx, int timeout_ms, int *completed) {
+    struct pollfd pfd;
+    uint64_t count;
+
+    pfd.fd = ctx->receiver_event_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, bound_timeout(ctx, timeout_ms)) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("Poll error");
+        return -1;
+    }
+
+    // Reset the doorbell before draining so that no wakeup is lost
+    (void)read(ctx->receiver_event_fd, &count, sizeof(count));
+    return (int)drain_ring(ctx, SIZE_MAX, completed);
+}
+
+/**
+ * @brief Waits for the next response and completes its in-flight request.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Maximum time to wait for the GPIO interrupt, -1 to wait forever.
+ * @return Number of completed requests, or -1 on error.
+ */
+int spi_process_responses(spi_ctx_t *ctx, int timeout_ms) {
+    int completed = 0;
+    int ret;
+
+    if (ctx->inflight_count == 0U) {
+        return 0;
+    }
+
+    if (atomic_load(&ctx->receiver_running) != 0) {
+        ret = service_ring(ctx, timeout_ms, &completed);
+    } else {
+        ret = service_interrupt(ctx, timeout_ms, &completed);
+    }
+    return (ret < 0) ? -1 : completed;
+}
+
+/**
+ * @brief Returns the file descriptor that becomes readable when work is ready.
+ *
+ * @param ctx The device context.
+ * @return The receiver doorbell while spi_start_receiving() is active, otherwise
+ *         the GPIO line event file descriptor.
+ */
+int spi_get_event_fd(spi_ctx_t *ctx) {
+    if (atomic_load(&ctx->receiver_running) != 0) {
+        return ctx->receiver_event_fd;
+    }
+    return ctx->transport->event_fd(ctx->transport_priv);
+}
+
+/**
+ * @brief Services every GPIO interrupt that is already pending, without blocking.
+ *
+ * @param ctx The device context.
+ * @return Number of completed requests, or -1 on error.
+ */
+int spi_dispatch(spi_ctx_t *ctx) {
+    int completed = 0;
+    int ret;
+
+    if (atomic_load(&ctx->receiver_running) != 0) {
+        ret = service_ring(ctx, 0, &completed);
+        return (ret < 0) ? -1 : completed;
+    }
+
+    do {
+        ret = service_interrupt(ctx, 0, &completed);
+    } while (ret > 0);
+
+    return (ret < 0) ? -1 : completed;
+}
+
+/**
+ * @brief Sets how many frames are serviced per wakeup.
+ *
+ * @param ctx The device context.
+ * @param budget Frames per wakeup, 1 to SPI_DRAIN_BUDGET_MAX.
+ * @return 0 on success, -1 with errno set to EINVAL if the budget is out of range.
+ */
+int spi_set_drain_budget(spi_ctx_t *ctx, unsigned int budget) {
+    if ((budget == 0U) || (budget > SPI_DRAIN_BUDGET_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->drain_budget = budget;
+    return 0;
+}
+
+/**
+ * @brief Registers the handler of a function ID.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID to handle.
+ * @param handler The handler, or NULL to unregister the current one.
+ * @param user Passed to every invocation of the handler.
+ */
+void spi_register_handler(spi_ctx_t *ctx, uint8_t function_id, spi_handler_t handler, void *user) {
+    ctx->handlers[function_id].handler = handler;
+    ctx->handlers[function_id].user = user;
+}
+
+/**
+ * @brief Copies a frame found in the stream into the next free ring slot.
+ *
+ * @param arg The context the receiver thread runs for.
+ * @param frame Start of the frame in the reassembly buffer.
+ * @param length Total size of the frame.
+ * @param resp The parsed frame; its payload points into frame.
+ */
+static void push_stream_frame(void *arg, const uint8_t *frame, size_t length, spi_response_t *resp) {
+    spi_ctx_t *ctx = arg;
+    size_t head = atomic_load_explicit(&ctx->rx_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ctx->rx_tail, memory_order_acquire);
+
+    if (head - tail == RX_RING_SIZE) {
+        (void)atomic_fetch_add_explicit(&ctx->rx_dropped, 1UL, memory_order_relaxed);
+        debug_print("Receive ring full, frame dropped\n");
+        return;
+    }
+
+    spi_rx_slot_t *slot = &ctx->rx_ring[head % RX_RING_SIZE];
+    (void)memcpy(slot->frame, frame, length);
+    slot->error = SPI_SUCCESS;
+    slot->response = *resp;
+    slot->response.payload = &slot->frame[resp->payload - frame];
+    atomic_store_explicit(&ctx->rx_head, head + 1U, memory_order_release);
+}
+
+/**
+ * @brief Reads the frame announced by one GPIO edge into the next free ring slot.
+ *
+ * When the ring is full the frame is still clocked out of the slave, into a
+ * scratch buffer, and counted as dropped.
+ *
+ * @param ctx The context the receiver thread runs for.
+ * @return 1 if the frame was published to the ring, 0 if it was dropped.
+ */
+static int receive_frame(spi_ctx_t *ctx) {
+    size_t head = atomic_load_explicit(&ctx->rx_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ctx->rx_tail, memory_order_acquire);
+
+    if (head - tail == RX_RING_SIZE) {
+        spi_response_t resp;
+        (void)read_response(ctx, ctx->rx_scratch, &resp);
+        (void)atomic_fetch_add_explicit(&ctx->rx_dropped, 1UL, memory_order_relaxed);
+        debug_print("Receive ring full, frame dropped\n");
+        return 0;
+    }
+
+    spi_rx_slot_t *slot = &ctx->rx_ring[head % RX_RING_SIZE];
+    slot->error = read_response(ctx, slot->frame, &slot->response);
+    atomic_store_explicit(&ctx->rx_head, head + 1U, memory_order_release);
+    return 1;
+}
+
+/**
+ * @brief Body of the receiver thread.
+ *
+ * Waits for the GPIO interrupt, reads and validates the frames of the edges
+ * consumed straight into the ring and rings the doorbell once per wakeup.
+ * In SPI_READ_STREAM mode every frame found in the stream is published to
+ * the ring as soon as it is found.
+ *
+ * @param arg The context the thread receives for.
+ * @return Always NULL.
+ */
+static void *receiver_main(void *arg) {
+    spi_ctx_t *ctx = arg;
+    const uint64_t one = 1U;
+
+    while (atomic_load_explicit(&ctx->receiver_running, memory_order_relaxed) != 0) {
+        int edges = wait_for_gpio_interrupt(ctx, RECEIVER_POLL_MS);
+        int published = 0;
+
+        if ((edges > 0) && (ctx->read_mode == SPI_READ_STREAM)) {
+            published = read_stream(ctx, push_stream_frame, ctx);
+        } else {
+            for (int edge = 0; edge < edges; edge++) {
+                published += receive_frame(ctx);
+            }
+        }
+        if (published > 0) {
+            (void)write(ctx->receiver_event_fd, &one, sizeof(one));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Sets the scheduling parameters of the receiver thread.
+ *
+ * @param ctx The device context.
+ * @param priority SCHED_FIFO priority, or 0 for the default scheduling policy.
+ * @param cpu CPU to pin the thread to, or -1 to leave it unpinned.
+ */
+void spi_set_receiver_params(spi_ctx_t *ctx, int priority, int cpu) {
+    ctx->receiver_priority = priority;
+    ctx->receiver_cpu = cpu;
+}
+
+/**
+ * @brief Creates the receiver thread with the configured scheduling parameters.
+ *
+ * @param ctx The device context.
+ * @param realtime Non-zero to request SCHED_FIFO scheduling.
+ * @return 0 on success, or the error number returned by pthread_create().
+ */
+static int create_receiver(spi_ctx_t *ctx, int realtime) {
+    pthread_attr_t attr;
+    int ret;
+
+    (void)pthread_attr_init(&attr);
+    if (realtime != 0) {
+        struct sched_param param;
+        (void)memset(&param, 0, sizeof(param));
+        param.sched_priority = ctx->receiver_priority;
+        (void)pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        (void)pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        (void)pthread_attr_setschedparam(&attr, &param);
+    }
+    if (ctx->receiver_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(ctx->receiver_cpu, &cpus);
+        (void)pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    ret = pthread_create(&ctx->receiver_thread, &attr, receiver_main, ctx);
+    (void)pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/**
+ * @brief Starts receiving data from the SPI slave of a context.
+ *
+ * Spawns the receiver thread, which services the GPIO interrupt line from
+ * now on. Frames are delivered from spi_drain_received(), spi_dispatch() or
+ * spi_process_responses() in the calling application's context.
+ *
+ * @param ctx The device context.
+ * @param callback Callback function to handle frames not matched to a request.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_start_receiving(spi_ctx_t *ctx, spi_callback_t callback) {
+    int ret;
+
+    if (atomic_load(&ctx->receiver_running) != 0) {
+        ctx->receive_callback = callback;
+        return 0;
+    }
+
+    ctx->receiver_event_fd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->receiver_event_fd < 0) {
+        perror("Failed to create receiver event fd");
+        return -1;
+    }
+
+    atomic_store(&ctx->receiver_running, 1);
+
+    ret = create_receiver(ctx, ctx->receiver_priority > 0);
+    if ((ret == EPERM) && (ctx->receiver_priority > 0)) {
+        // No CAP_SYS_NICE or RLIMIT_RTPRIO: run, but without real-time guarantees
+        (void)fprintf(stderr, "Receiver thread: SCHED_FIFO not permitted, using default policy\n");
+        ret = create_receiver(ctx, 0);
+    }
+    if (ret != 0) {
+        // The GPIO line is serviced inline again
+        atomic_store(&ctx->receiver_running, 0);
+        (void)close(ctx->receiver_event_fd);
+        ctx->receiver_event_fd = -1;
+        errno = ret;
+        perror("Failed to create receiver thread");
+        return -1;
+    }
+    ctx->receive_callback = callback;
+    debug_print("Receiver thread started (priority %d, cpu %d)\n", ctx->receiver_priority, ctx->receiver_cpu);
+    return 0;
+}
+
+/**
+ * @brief Stops the receiver thread started by spi_start_receiving().
+ *
+ * Frames the thread has already read are delivered before this returns.
+ *
+ * @param ctx The device context.
+ */
+void spi_stop_receiving(spi_ctx_t *ctx) {
+    if (atomic_exchange(&ctx->receiver_running, 0) == 0) {
+        return;
+    }
+    (void)pthread_join(ctx->receiver_thread, NULL);
+
+    // Deliver what the thread already read; the GPIO line is serviced inline again
+    int completed = 0;
+    (void)drain_ring(ctx, SIZE_MAX, &completed);
+    (void)close(ctx->receiver_event_fd);
+    ctx->receiver_event_fd = -1;
+    debug_print("Receiver thread stopped\n");
+}
+
+/**
+ * @brief Delivers frames buffered by the receiver thread.
+ *
+ * @param ctx The device context.
+ * @param max_frames Maximum number of frames to deliver.
+ * @return Number of frames delivered.
+ */
+size_t spi_drain_received(spi_ctx_t *ctx, size_t max_frames) {
+    int completed = 0;
+    return drain_ring(ctx, max_frames, &completed);
+}
+
+/**
+ * @brief Returns the number of frames dropped because the receive ring was full.
+ *
+ * @param ctx The device context.
+ * @return Number of dropped frames since the context was opened.
+ */
+unsigned long spi_receive_dropped(spi_ctx_t *ctx) {
+    return atomic_load_explicit(&ctx->rx_dropped, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the number of requests that have not completed yet.
+ *
+ * @param ctx The device context.
+ * @return Number of in-flight and queued requests.
+ */
+size_t spi_pending_requests(spi_ctx_t *ctx) {
+    return ctx->inflight_count + ctx->queue_count;
+}
+
+/**
+ * @brief Returns the sequence tag the next accepted request will be given.
+ *
+ * @param ctx The device context.
+ * @return The sequence tag of the next request accepted by any submit function.
+ */
+uint16_t spi_next_sequence(const spi_ctx_t *ctx) {
+    return ctx->next_sequence;
+}
+
+/**
+ * @brief Checks whether a request is still queued or in flight.
+ *
+ * @param ctx The device context.
+ * @param sequence The sequence tag returned by spi_submit().
+ * @return 1 if the request has not completed yet, 0 otherwise.
+ */
+static int request_pending(const spi_ctx_t *ctx, uint16_t sequence) {
+    const spi_inflight_t *slot = &ctx->inflight[sequence % PENDING_TABLE_SIZE];
+    if ((slot->active != 0U) && (slot->sequence == sequence)) {
+        return 1;
+    }
+    for (size_t i = 0U; i < SUBMIT_QUEUE_SIZE; i++) {
+        if (((ctx->queue_used & (1U << i)) != 0U) && (ctx->submit_queue[i].sequence == sequence)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a request to the SPI slave of a context.
+ *
+ * This function submits the request to the request engine and blocks until
+ * its response has been received and handed to the callback.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param actual_payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ */
+void spi_send_request(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t actual_payload_size, spi_callback_t callback) {
+    int sequence;
+
+    while ((sequence = spi_submit(ctx, function_id, payload, actual_payload_size, callback)) < 0) {
+        if (errno != EAGAIN) {
+            fail_request(ctx, callback, SPI_ERROR_INVALID_FORMAT, function_id, 0U);
+            return;
+        }
+        // Make room in the submission queue
+        (void)spi_process_responses(ctx, -1);
+    }
+
+    // Wait for interrupt and handle response
+    while (request_pending(ctx, (uint16_t)sequence) != 0) {
+        (void)spi_process_responses(ctx, -1);
+    }
+}
+
+/**
+ * @brief Fills training parameters with their defaults.
+ *
+ * @param params The parameters to initialize.
+ */
+void spi_train_params_init(spi_train_params_t *params) {
+    (void)memset(params, 0, sizeof(*params));
+    params->function_id = 0U;
+    params->payload_size = 64U;
+    params->probes = 32U;
+    params->timeout_ms = 100;
+    params->min_speed_hz = SPI_TRAIN_MIN_HZ;
+    params->max_speed_hz = SPI_TRAIN_MAX_HZ;
+    params->cache_path = SPI_SPEED_CACHE_PATH;
+    params->use_cache = 1;
+}
+
+/**
+ * @brief Changes the SPI clock frequency of a context.
+ *
+ * @param ctx The device context.
+ * @param speed_hz The new clock frequency in Hz.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_set_speed(spi_ctx_t *ctx, uint32_t speed_hz) {
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    int ret = ctx->transport->set_speed(ctx->transport_priv, speed_hz);
+    if (ret == 0) {
+        ctx->speed_hz = speed_hz;
+    }
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+    if (ret < 0) {
+        perror("Failed to set SPI speed");
+        return -1;
+    }
+    debug_print("SPI speed set to %u Hz\n", speed_hz);
+    return 0;
+}
+
+/**
+ * @brief Returns the SPI clock frequency of a context.
+ *
+ * @param ctx The device context.
+ * @return The clock frequency in Hz.
+ */
+uint32_t spi_get_speed(const spi_ctx_t *ctx) {
+    return ctx->speed_hz;
+}
+
+// Failed probes of the training run in progress in this thread
+static _Thread_local unsigned int train_failures;
+
+/**
+ * @brief Counts failed probe requests during speed training.
+ *
+ * @param error Result of the probe request.
+ * @param response Unused.
+ */
+static void train_callback(spi_error_t error, spi_response_t *response) {
+    (void)response;
+    if (error != SPI_SUCCESS) {
+        train_failures++;
+    }
+}
+
+/**
+ * @brief Runs one round of probe requests at the current speed.
+ *
+ * The probe payload alternates patterns with many transitions and long runs,
+ * the hardest cases for a marginal link.
+ *
+ * @param ctx The device context.
+ * @param params The training parameters.
+ * @return 1 if every probe was answered with a valid frame, 0 otherwise.
+ */
+static int probe_speed(spi_ctx_t *ctx, const spi_train_params_t *params) {
+    static const uint8_t patterns[] = {0x55U, 0xAAU, 0x00U, 0xFFU, 0x0FU, 0xF0U};
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+
+    for (size_t i = 0U; i < params->payload_size; i++) {
+        payload[i] = (uint8_t)(patterns[i % sizeof(patterns)] ^ (uint8_t)(i >> 3));
+    }
+
+    train_failures = 0U;
+    for (unsigned int probe = 0U; (probe < params->probes) && (train_failures == 0U); probe++) {
+        payload[0] = (uint8_t)probe;
+        spi_send_request(ctx, params->function_id, payload, params->payload_size, train_callback);
+    }
+    return (train_failures == 0U);
+}
+
+/**
+ * @brief Looks up the trained speed of a device in the cache file.
+ *
+ * @param path The cache file.
+ * @param device The spidev node the speed was trained for.
+ * @return The cached speed in Hz, 0 if there is none.
+ */
+static uint32_t read_cached_speed(const char *path, const char *device) {
+    char name[DEVICE_PATH_SIZE];
+    unsigned long speed;
+    uint32_t found = 0U;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0U;
+    }
+    while (fscanf(file, "%63s %lu", name, &speed) == 2) {
+        if (strcmp(name, device) == 0) {
+            found = (uint32_t)speed;
+        }
+    }
+    (void)fclose(file);
+    return found;
+}
+
+/**
+ * @brief Stores the trained speed of a device in the cache file.
+ *
+ * The file holds one "device speed" line per device and is replaced
+ * atomically, so a crash never leaves a truncated cache behind.
+ *
+ * @param path The cache file.
+ * @param device The spidev node the speed was trained for.
+ * @param speed_hz The trained speed in Hz.
+ */
+static void write_cached_speed(const char *path, const char *device, uint32_t speed_hz) {
+    char tmp_path[PATH_MAX];
+    char dir[PATH_MAX];
+    char name[DEVICE_PATH_SIZE];
+    unsigned long speed;
+
+    (void)snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if ((slash != NULL) && (slash != dir)) {
+        *slash = '\0';
+        (void)mkdir(dir, 0755);
+    }
+
+    (void)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror("Failed to write SPI speed cache");
+        return;
+    }
+
+    // Keep the entries of the other devices
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (fscanf(in, "%63s %lu", name, &speed) == 2) {
+            if (strcmp(name, device) != 0) {
+                (void)fprintf(out, "%s %lu\n", name, speed);
+            }
+        }
+        (void)fclose(in);
+    }
+    (void)fprintf(out, "%s %u\n", device, speed_hz);
+
+    if ((fclose(out) != 0) || (rename(tmp_path, path) != 0)) {
+        perror("Failed to write SPI speed cache");
+        (void)unlink(tmp_path);
+    }
+}
+
+/**
+ * @brief Finds the highest SPI clock frequency the link carries reliably.
+ *
+ * @param ctx The device context.
+ * @param params The training parameters, or NULL for the defaults.
+ * @param speed_hz If not NULL, receives the selected speed in Hz.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_train_speed(spi_ctx_t *ctx, const spi_train_params_t *params, uint32_t *speed_hz) {
+    spi_train_params_t defaults;
+    uint32_t original = ctx->speed_hz;
+    uint32_t best = 0U;
+
+    if (params == NULL) {
+        spi_train_params_init(&defaults);
+        params = &defaults;
+    }
+    if ((params->payload_size > MAX_PAYLOAD_SIZE) || (params->min_speed_hz == 0U) ||
+        (params->min_speed_hz > params->max_speed_hz)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (spi_pending_requests(ctx) > 0U) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Probes to a speed the slave cannot follow may never be answered
+    int saved_timeout = ctx->request_timeout_ms;
+    ctx->request_timeout_ms = params->timeout_ms;
+
+    // A cached speed that still validates spares the full search
+    if ((params->use_cache != 0) && (params->cache_path != NULL)) {
+        uint32_t cached = read_cached_speed(params->cache_path, ctx->spi_device);
+        if ((cached != 0U) && (spi_set_speed(ctx, cached) == 0) && probe_speed(ctx, params)) {
+            debug_print("Cached SPI speed %u Hz validated\n", cached);
+            best = cached;
+        }
+    }
+
+    if (best == 0U) {
+        // Double the clock until probes fail, ending on max_speed_hz itself;
+        // the last clean step wins
+        uint32_t speed = params->min_speed_hz;
+        while ((spi_set_speed(ctx, speed) == 0) && probe_speed(ctx, params)) {
+            debug_print("SPI link clean at %u Hz\n", speed);
+            best = speed;
+            if (speed >= params->max_speed_hz) {
+                break;
+            }
+            speed = (speed > (params->max_speed_hz / 2U)) ? params->max_speed_hz : (speed * 2U);
+        }
+        if ((best != 0U) && (params->cache_path != NULL)) {
+            write_cached_speed(params->cache_path, ctx->spi_device, best);
+        }
+    }
+
+    ctx->request_timeout_ms = saved_timeout;
+    if (best == 0U) {
+        (void)spi_set_speed(ctx, original);
+        errno = EIO;
+        return -1;
+    }
+
+    (void)spi_set_speed(ctx, best);
+    if (speed_hz != NULL) {
+        *speed_hz = best;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the statistics of a context.
+ *
+ * @param ctx The device context.
+ * @param stats Receives the statistics.
+ */
+void spi_get_stats(spi_ctx_t *ctx, spi_stats_t *stats) {
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    (void)memcpy(stats, &ctx->stats, sizeof(*stats));
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+}
+
+/**
+ * @brief Clears the statistics of a context.
+ *
+ * @param ctx The device context.
+ */
+void spi_reset_stats(spi_ctx_t *ctx) {
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    spi_stats_clear(&ctx->stats);
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+}
+
+/**
+ * @brief Writes the statistics of a context to a text file.
+ *
+ * @param ctx The device context.
+ * @param path The file to write.
+ * @return 0 on success, -1 on error with errno set.
+ */
+int spi_export_stats(spi_ctx_t *ctx, const char *path) {
+    char tmp_path[PATH_MAX];
+    spi_stats_t stats;
+
+    spi_get_stats(ctx, &stats);
+
+    // Scrapers must never see a half-written file
+    (void)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    int ret = spi_stats_write_text(out, &stats, ctx->spi_device);
+    if ((fclose(out) != 0) || (ret < 0) || (rename(tmp_path, path) != 0)) {
+        int saved_errno = (errno != 0) ? errno : EIO;
+        (void)unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the wakeup latency above which interrupts are traced.
+ *
+ * @param ctx The device context.
+ * @param threshold_us Threshold in microseconds, 0 to disable tracing.
+ */
+void spi_set_slow_wakeup_threshold(spi_ctx_t *ctx, uint32_t threshold_us) {
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    ctx->slow_wakeup_ns = (uint64_t)threshold_us * 1000U;
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+}
+
+/**
+ * @brief Takes the traced slow wakeups of a context, oldest first.
+ *
+ * @param ctx The device context.
+ * @param traces Receives the traces.
+ * @param max_traces Capacity of the traces array.
+ * @return Number of traces copied.
+ */
+size_t spi_get_slow_wakeups(spi_ctx_t *ctx, spi_wakeup_trace_t *traces, size_t max_traces) {
+    size_t copied = 0U;
+
+    (void)pthread_mutex_lock(&ctx->bus_lock);
+    while ((copied < max_traces) && (ctx->slow_wakeup_count > 0U)) {
+        traces[copied] = ctx->slow_wakeups[ctx->slow_wakeup_head];
+        ctx->slow_wakeup_head = (ctx->slow_wakeup_head + 1U) % SPI_WAKEUP_TRACE_SIZE;
+        ctx->slow_wakeup_count--;
+        copied++;
+    }
+    (void)pthread_mutex_unlock(&ctx->bus_lock);
+    return copied;
+}
+
+/**
+ * @brief Sends a request to the SPI slave.
+ *
+ * This function submits the request on the context set up by spi_init() and
+ * gpio_init() and blocks until its response has been handed to the callback.
+ *
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param actual_payload_size The size of the payload data.
+ * @param callback The callback function to handle the response.
+ */
+void send_request(uint8_t function_id, const uint8_t *payload, uint16_t actual_payload_size, spi_callback_t callback) {
+    spi_send_request(&default_ctx, function_id, payload, actual_payload_size, callback);
+}
+
+/**
+ * @brief Starts receiving data from the SPI slave device.
+ *
+ * @param callback Callback function to handle frames not matched to a request.
+ */
+void start_receiving(spi_callback_t callback) {
+    if (spi_start_receiving(&default_ctx, callback) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Stops the receiver thread started by start_receiving().
+ */
+void stop_receiving(void) {
+    spi_stop_receiving(&default_ctx);
+}
+
+/**
+ * @brief Returns the context used by the original single-device API.
+ *
+ * @return The context set up by spi_init() and gpio_init().
+ */
+spi_ctx_t *spi_default_ctx(void) {
+    (void)pthread_once(&default_ctx_once, init_default_ctx);
+    return &default_ctx;
 }
@@ -12,6 +12,30 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built with hidden visibility; only what this header declares is exported
+#pragma GCC visibility push(default)
+
+#define SPI_MAX_INFLIGHT 16U  /**< Maximum number of requests outstanding at the slave */
+#define SPI_MAX_IOV 8U        /**< Maximum number of payload buffers for spi_submit_iov() */
+#define SPI_DEFAULT_TIMEOUT_MS 1000  /**< Default deadline of a request, see spi_set_request_timeout() */
+#define SPI_TRAIN_MIN_HZ 1000000U     /**< First clock frequency tried by spi_train_speed() */
+#define SPI_TRAIN_MAX_HZ 50000000U    /**< SPI4 limit on the STM32MP157: kernel clock / 2 */
+#define SPI_SPEED_CACHE_PATH "/var/lib/spilib/speed.cache"  /**< Default trained speed cache */
+#define SPI_HIST_BUCKETS 592U  /**< Log-linear buckets covering 0 ns to 2^40 ns at 1/16 resolution */
+#define SPI_WAKEUP_TRACE_SIZE 64U         /**< Slow wakeups kept for spi_get_slow_wakeups() */
+#define SPI_SLOW_WAKEUP_DEFAULT_US 200U   /**< Default threshold of a slow wakeup */
+#define SPI_STREAM_CHUNK_MAX 4096U  /**< Largest chunk read in SPI_READ_STREAM mode: the spidev bufsiz */
+#define SPI_DRAIN_BUDGET_MAX 16U      /**< Largest drain budget: line events libgpiod reads at once */
+#define SPI_FRAGMENT_HEADER_SIZE 8U   /**< Offset and total size in front of the data of a fragment */
+#define SPI_FRAGMENT_DATA_MAX 1016U   /**< Data bytes per fragment: the maximum payload minus the header */
+#define SPI_MAX_BULK 4U               /**< Bulk transfers in progress per context */
+#define SPI_PRIORITY_CLASSES 3U       /**< Number of spi_priority_t classes */
 
 /**
  * @brief Structure to hold the response data from SPI communication.
@@ -20,6 +44,8 @@ typedef struct {
     uint8_t function_id;    /**< Function ID associated with the response */
     uint16_t payload_size;  /**< Size of the payload data in bytes */
     uint8_t *payload;       /**< Pointer to the payload data */
+    uint16_t sequence;      /**< Sequence tag of the request this response completes */
+    uint8_t unsolicited;    /**< Non-zero for a frame that completes no request; its sequence is meaningless */
 } spi_response_t;
 
 /**
@@ -29,17 +55,209 @@ typedef enum {
     SPI_SUCCESS,              /**< Operation completed successfully */
     SPI_ERROR_INVALID_FORMAT, /**< Error due to invalid message format */
     SPI_ERROR_CRC_MISMATCH,   /**< CRC mismatch error */
-    SPI_ERROR_UNKNOWN         /**< Unknown error */
+    SPI_ERROR_UNKNOWN,        /**< Unknown error */
+    SPI_ERROR_TIMEOUT         /**< No response before the request deadline */
 } spi_error_t;
 
+/**
+ * @brief How response frames are clocked in from the SPI slave.
+ */
+typedef enum {
+    SPI_READ_FIXED,           /**< Always read a maximum-size frame (default) */
+    SPI_READ_LENGTH_PREFIXED, /**< Read the header, then only the announced payload */
+    SPI_READ_STREAM           /**< Read chunks and reassemble the frames streamed in them */
+} spi_read_mode_t;
+
+/**
+ * @brief Framing protocol spoken with the SPI slave.
+ */
+typedef enum {
+    SPI_PROTOCOL_V1,  /**< 0x48 0x5A frames, responses matched in request order (default) */
+    SPI_PROTOCOL_V2   /**< 0x48 0x5B frames with a sequence byte, responses matched by sequence */
+} spi_protocol_t;
+
+/**
+ * @brief Priority class of a request, see spi_submit_priority().
+ */
+typedef enum {
+    SPI_PRIORITY_REALTIME,  /**< Time-critical requests, e.g. control writes */
+    SPI_PRIORITY_NORMAL,    /**< Requests of spi_submit() and the other submit functions */
+    SPI_PRIORITY_BULK       /**< Background traffic and the fragments of bulk transfers */
+} spi_priority_t;
+
+/**
+ * @brief CRC32 implementations available for frame validation.
+ */
+typedef enum {
+    SPI_CRC_ENGINE_AUTO,      /**< Fastest engine available on this CPU (default) */
+    SPI_CRC_ENGINE_BYTEWISE,  /**< Reference byte-at-a-time table lookup */
+    SPI_CRC_ENGINE_SLICE8     /**< Slice-by-8 table lookup */
+} spi_crc_engine_t;
+
+/**
+ * @brief Transport a context talks to its SPI slave through.
+ */
+typedef enum {
+    SPI_BACKEND_SPIDEV,    /**< spidev node and GPIO interrupt line (default) */
+    SPI_BACKEND_LOOPBACK   /**< In-process simulated slave, for tests and benchmarks */
+} spi_backend_t;
+
+/**
+ * @brief Behaviour of the simulated slave of SPI_BACKEND_LOOPBACK.
+ *
+ * The slave answers every valid request frame with a frame of the same
+ * protocol version echoing its function ID, sequence byte and payload, and
+ * announces each answer with a virtual rising edge.
+ */
+typedef struct {
+    unsigned int latency_us;     /**< Delay from a request to the edge announcing its response */
+    unsigned int jitter_us;      /**< Upper bound of a random delay added to latency_us */
+    unsigned int bit_error_ppm;  /**< Probability of flipping each transferred bit, per million */
+    unsigned int edge_drop_ppm;  /**< Probability of losing the edge of a response, per million */
+    int duplex;                  /**< Non-zero to shift a ready response out during request transfers */
+    int model_clock;             /**< Non-zero to make transfers last as long as on the wire */
+    int stream;                  /**< Non-zero to shift responses back to back, for SPI_READ_STREAM */
+    int ignore_function_id;      /**< Function ID of requests the slave never answers, -1 to answer all */
+    uint32_t seed;               /**< Seed of the jitter and error generator */
+} spi_loopback_params_t;
+
 /**
  * @brief Type definition for the callback function used in SPI communication.
  *
+ * On error the response carries only the function ID and sequence tag of the
+ * failed request; its payload is NULL. For frames received without a request
+ * in flight (see start_receiving()) the response is NULL on error.
+ *
  * @param error Error code indicating the result of the operation.
  * @param response Pointer to the response data structure.
  */
 typedef void (*spi_callback_t)(spi_error_t error, spi_response_t *response);
 
+/**
+ * @brief Handler of one function ID, see spi_register_handler().
+ *
+ * Receives the same arguments as a spi_callback_t, plus the user context it
+ * was registered with.
+ *
+ * @param error Error code indicating the result of the operation.
+ * @param response Pointer to the response data structure.
+ * @param user The user context passed to spi_register_handler().
+ */
+typedef void (*spi_handler_t)(spi_error_t error, spi_response_t *response, void *user);
+
+/**
+ * @brief Reassembled response of a bulk transfer.
+ */
+typedef struct {
+    uint8_t function_id;  /**< Function ID of the transfer */
+    uint8_t *data;        /**< The response buffer passed to spi_submit_bulk() */
+    size_t size;          /**< Response bytes received into data */
+} spi_bulk_response_t;
+
+/**
+ * @brief Callback function type for completed bulk transfers.
+ */
+typedef void (*spi_bulk_callback_t)(spi_error_t error, spi_bulk_response_t *response);
+
+/**
+ * @brief Opaque state of one SPI slave: spidev node, interrupt line and buffers.
+ *
+ * A context is not thread-safe; drive each context from one thread at a time.
+ * Different contexts are independent and may be used concurrently.
+ */
+typedef struct spi_ctx spi_ctx_t;
+
+/**
+ * @brief Settings used to open a SPI slave with spi_open().
+ */
+typedef struct {
+    const char *spi_device;   /**< spidev node, e.g. "/dev/spidev0.0" */
+    uint8_t mode;             /**< SPI mode (SPI_MODE_0 .. SPI_MODE_3) */
+    uint8_t bits_per_word;    /**< Bits per word */
+    uint32_t speed_hz;        /**< SPI clock frequency in Hz */
+    const char *gpio_chip;    /**< GPIO chip of the interrupt line, e.g. "/dev/gpiochip3" */
+    unsigned int gpio_pin;    /**< Offset of the interrupt line on the GPIO chip */
+    spi_backend_t backend;    /**< Transport to the slave */
+    const spi_loopback_params_t *loopback;  /**< Simulated slave, NULL for the defaults */
+} spi_config_t;
+
+/**
+ * @brief Structure describing one request of a batch.
+ */
+typedef struct {
+    uint8_t function_id;      /**< Function ID for the request */
+    const uint8_t *payload;   /**< Pointer to the payload data to be sent */
+    uint16_t payload_size;    /**< Size of the payload data in bytes */
+    spi_callback_t callback;  /**< Callback function to handle the response */
+    uint16_t delay_usecs;     /**< Delay after this frame before the next one is clocked */
+    uint8_t cs_change;        /**< Non-zero to deassert chip select after this frame */
+    int timeout_ms;           /**< Deadline of this request, 0 for the context default */
+} spi_request_t;
+
+/**
+ * @brief Parameters of the SPI clock training run by spi_train_speed().
+ */
+typedef struct {
+    uint8_t function_id;      /**< Function ID of a request the slave answers without side effects */
+    uint16_t payload_size;    /**< Size of the probe payload in bytes */
+    unsigned int probes;      /**< Probe requests per speed step */
+    int timeout_ms;           /**< Deadline of each probe request */
+    uint32_t min_speed_hz;    /**< First clock frequency tried */
+    uint32_t max_speed_hz;    /**< Upper bound of the search */
+    const char *cache_path;   /**< File persisting trained speeds, NULL to disable */
+    int use_cache;            /**< Non-zero to reuse a cached speed that still validates */
+} spi_train_params_t;
+
+/**
+ * @brief Latency histogram with 16 linear sub-buckets per power of two.
+ *
+ * Query it with spi_histogram_percentile(); values are in nanoseconds.
+ */
+typedef struct {
+    uint64_t count;                       /**< Number of recorded values */
+    uint64_t sum_ns;                      /**< Sum of the recorded values */
+    uint64_t min_ns;                      /**< Smallest recorded value */
+    uint64_t max_ns;                      /**< Largest recorded value */
+    uint32_t buckets[SPI_HIST_BUCKETS];   /**< Value counts per bucket */
+} spi_histogram_t;
+
+/**
+ * @brief Counters and latency histograms of one device context.
+ */
+typedef struct {
+    uint64_t requests;                /**< Requests transmitted */
+    uint64_t responses;               /**< Requests completed successfully */
+    uint64_t crc_errors;              /**< Frames failing the CRC check */
+    uint64_t format_errors;           /**< Malformed frames */
+    uint64_t timeouts;                /**< Requests failed at their deadline */
+    uint64_t unsolicited;             /**< Frames matching no request in flight */
+    uint64_t transfers;               /**< SPI_IOC_MESSAGE ioctls issued */
+    uint64_t transfer_errors;         /**< SPI_IOC_MESSAGE ioctls that failed */
+    uint64_t bytes_tx;                /**< Request frame bytes sent */
+    uint64_t bytes_rx;                /**< Response frame bytes received */
+    uint64_t resyncs;                 /**< Candidate frames rejected while reassembling a stream */
+    spi_histogram_t transfer_ns;      /**< Duration of each SPI_IOC_MESSAGE ioctl */
+    uint64_t slow_wakeups;            /**< Wakeups over the slow wakeup threshold */
+    spi_histogram_t edge_to_read_ns;  /**< Service latency: GPIO edge to response frame read */
+    spi_histogram_t wakeup_ns;        /**< Wakeup latency: GPIO edge to the servicing thread running */
+    spi_histogram_t request_ns;       /**< Submission to completion of each request */
+    spi_histogram_t callback_ns;      /**< Time spent in each request callback */
+    spi_histogram_t queue_ns[SPI_PRIORITY_CLASSES];  /**< Submission to transmission, per priority class */
+} spi_stats_t;
+
+/**
+ * @brief One GPIO interrupt whose servicing thread woke up late.
+ *
+ * All times come from CLOCK_MONOTONIC; the edge timestamp is taken by the
+ * kernel in the GPIO interrupt handler.
+ */
+typedef struct {
+    uint64_t edge_ns;     /**< Kernel timestamp of the GPIO edge */
+    uint64_t wakeup_ns;   /**< Edge to the servicing thread returning from poll() */
+    uint64_t service_ns;  /**< Edge to the end of the response frame read */
+    int cpu;              /**< CPU the servicing thread woke up on */
+} spi_wakeup_trace_t;
+
 /**
  * @brief Binds the spidev driver to the specified SPI device.
  *
@@ -103,8 +321,624 @@ void send_request(uint8_t function_id, const uint8_t *payload, uint16_t payload_
  * device. It is useful for scenarios where the SPI slave initiates communication
  * without a preceding request from the master.
  *
+ * See spi_start_receiving() for details. Exits the process if the receiver
+ * thread cannot be started.
+ *
  * @param callback Callback function to handle the incoming data.
  */
 void start_receiving(spi_callback_t callback);
 
+/**
+ * @brief Stops the receiver thread started by start_receiving().
+ */
+void stop_receiving(void);
+
+/**
+ * @brief Fills a configuration with the defaults of the single-device API.
+ *
+ * The defaults are /dev/spidev0.0 in SPI mode 0 with 8 bits per word at
+ * 500 kHz, and line 15 of /dev/gpiochip3 as interrupt line.
+ *
+ * @param config The configuration to initialize.
+ */
+void spi_config_init(spi_config_t *config);
+
+/**
+ * @brief Fills loopback parameters with an ideal slave.
+ *
+ * The defaults answer after 50 us, never corrupt or lose anything and
+ * complete transfers instantly.
+ *
+ * @param params The parameters to initialize.
+ */
+void spi_loopback_params_init(spi_loopback_params_t *params);
+
+/**
+ * @brief Opens a SPI slave and its interrupt line.
+ *
+ * Each context owns its spidev file descriptor, GPIO line, buffers and
+ * request queues, so several slaves on different chip selects can be driven
+ * concurrently from different threads. The transfer buffers, about 50 KB
+ * per context, are locked in memory when RLIMIT_MEMLOCK allows it.
+ *
+ * With SPI_BACKEND_LOOPBACK no device is opened: the context talks to a
+ * simulated slave and the event file descriptor is a timerfd.
+ *
+ * @param config The device configuration, or NULL for the defaults.
+ * @return The new context, or NULL on failure.
+ */
+spi_ctx_t *spi_open(const spi_config_t *config);
+
+/**
+ * @brief Closes a SPI slave opened with spi_open() and frees its context.
+ *
+ * Requests still pending are discarded without invoking their callbacks.
+ *
+ * @param ctx The context to release.
+ */
+void spi_release(spi_ctx_t *ctx);
+
+/**
+ * @brief Returns the context used by the single-device API.
+ *
+ * The context is backed by spi_init() and gpio_init(), which must have been
+ * called before it is used.
+ *
+ * @return The default context.
+ */
+spi_ctx_t *spi_default_ctx(void);
+
+/**
+ * @brief Sends a request to the SPI slave of a context and waits for its response.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload Pointer to the payload data to be sent.
+ * @param payload_size Size of the payload data in bytes.
+ * @param callback Callback function to handle the response.
+ */
+void spi_send_request(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size, spi_callback_t callback);
+
+/**
+ * @brief Sets the scheduling parameters of the receiver thread.
+ *
+ * Must be called before spi_start_receiving(). If the process is not allowed to
+ * use SCHED_FIFO, the thread falls back to the default policy.
+ *
+ * @param ctx The device context.
+ * @param priority SCHED_FIFO priority (1-99), or 0 for the default policy.
+ *                 The default is 80.
+ * @param cpu CPU to pin the thread to, or -1 to leave it unpinned (default).
+ */
+void spi_set_receiver_params(spi_ctx_t *ctx, int priority, int cpu);
+
+/**
+ * @brief Starts receiving data from the SPI slave of a context.
+ *
+ * A dedicated receiver thread takes over the GPIO interrupt line: it reads
+ * and validates each frame and pushes it into a lock-free ring. The
+ * application drains the ring at its own pace with spi_drain_received(),
+ * spi_dispatch() or spi_process_responses(); frames complete their in-flight
+ * request (see spi_set_protocol()) and the remaining ones are passed to the
+ * handler registered for their function ID, or else to the callback. All
+ * callbacks run in the draining thread, never in the receiver thread.
+ *
+ * If the receiver thread cannot be started the context is left as it was,
+ * servicing the GPIO interrupt line inline.
+ *
+ * @param ctx The device context.
+ * @param callback Callback function to handle the incoming data, or NULL.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_start_receiving(spi_ctx_t *ctx, spi_callback_t callback);
+
+/**
+ * @brief Stops the receiver thread started by spi_start_receiving().
+ *
+ * Frames the thread has already read are delivered before this returns.
+ *
+ * @param ctx The device context.
+ */
+void spi_stop_receiving(spi_ctx_t *ctx);
+
+/**
+ * @brief Delivers frames buffered by the receiver thread.
+ *
+ * @param ctx The device context.
+ * @param max_frames Maximum number of frames to deliver.
+ * @return Number of frames delivered.
+ */
+size_t spi_drain_received(spi_ctx_t *ctx, size_t max_frames);
+
+/**
+ * @brief Returns the number of frames dropped because the receive ring was full.
+ *
+ * @param ctx The device context.
+ * @return Number of dropped frames.
+ */
+unsigned long spi_receive_dropped(spi_ctx_t *ctx);
+
+/**
+ * @brief Selects how response frames are read from the SPI slave.
+ *
+ * SPI_READ_LENGTH_PREFIXED first clocks in the 5-byte frame header while
+ * holding chip select, then reads exactly the announced payload, CRC and
+ * stop identifier. For small responses this is much shorter on the bus than
+ * the default fixed-size read of a maximum-size frame.
+ *
+ * SPI_READ_STREAM is meant for slaves pushing a continuous stream of frames,
+ * e.g. sensor samples, without raising one GPIO edge per frame. On every
+ * edge a chunk of spi_set_stream_chunk() bytes is read and searched for
+ * frames: any number of frames per chunk is delivered, bytes between frames
+ * are skipped, and a frame cut off by the end of a chunk is completed by the
+ * next chunk, which is read right away. The slave must therefore keep its
+ * transmit position across chip select releases. Frames that fail
+ * validation are skipped and counted in spi_stats_t::resyncs; they cannot
+ * fail a request. Duplex transmission is not used in this mode.
+ *
+ * The mode can only be changed while no receiver thread started by
+ * spi_start_receiving() is running.
+ *
+ * @param ctx The device context.
+ * @param mode The read mode to use for subsequent responses.
+ * @return 0 on success, -1 with errno set to EBUSY if the receiver thread is running.
+ */
+int spi_set_read_mode(spi_ctx_t *ctx, spi_read_mode_t mode);
+
+/**
+ * @brief Sets the number of bytes read per chunk in SPI_READ_STREAM mode.
+ *
+ * Larger chunks take more frames per transfer; smaller ones cost less bus
+ * time when the slave has little to send.
+ *
+ * @param ctx The device context.
+ * @param chunk_size Bytes per chunk, 1 to SPI_STREAM_CHUNK_MAX (default 1024).
+ * @return 0 on success, -1 with errno set to EINVAL if the size is out of range.
+ */
+int spi_set_stream_chunk(spi_ctx_t *ctx, size_t chunk_size);
+
+/**
+ * @brief Selects the framing protocol spoken with the SPI slave.
+ *
+ * Version 1 frames carry no request identity, so a response is always
+ * credited to the oldest request in flight; a lost or unsolicited frame
+ * shifts every following response onto the wrong request. Version 2 frames
+ * (start identifier 0x48 0x5B) carry the low byte of the sequence tag after
+ * the function ID, and the slave echoes it in its response:
+ *
+ *     48 5B | function ID | sequence | size (LE16) | payload | CRC | 0D 0A
+ *
+ * The CRC of a version 2 frame covers function ID, sequence, size and
+ * payload. Responses are then routed to their request through a pending
+ * table, whatever order they arrive in, and late responses to requests that
+ * already timed out are discarded. A frame that fails its CRC fails the
+ * oldest request, since its sequence byte cannot be trusted. Change the
+ * protocol only while no request is pending.
+ *
+ * @param ctx The device context.
+ * @param protocol The protocol to use for subsequent requests and responses.
+ */
+void spi_set_protocol(spi_ctx_t *ctx, spi_protocol_t protocol);
+
+/**
+ * @brief Enables clocking in responses while requests are transmitted.
+ *
+ * For SPI slaves that shift out their pending response in whatever
+ * transfer the master starts next. When the interrupt line signals a ready
+ * response and a request is waiting in the submission queue, that request
+ * is transmitted and the response clocked in by the same transfer: a steady
+ * stream of queued requests costs one transfer per request instead of two.
+ * A request submitted while a response is ready captures it the same way.
+ *
+ * Each request transfer is padded with 0xFF up to window bytes. A response
+ * longer than the window is completed by a second transfer with chip select
+ * held; choose a window that covers the usual response (frame overhead
+ * included) to stay at one transfer. Windows of at least a maximum-size
+ * frame never need the second transfer. Duplex mode applies while the
+ * interrupt line is serviced inline, not while spi_start_receiving() is
+ * active.
+ *
+ * @param ctx The device context.
+ * @param window Bytes clocked per request transfer, 0 to disable (default).
+ */
+void spi_set_duplex(spi_ctx_t *ctx, size_t window);
+
+/**
+ * @brief Sets the deadline applied to subsequently submitted requests.
+ *
+ * A request that has not been answered within timeout_ms of its submission
+ * completes with SPI_ERROR_TIMEOUT, and spi_process_responses() never blocks
+ * past the earliest deadline. The default is SPI_DEFAULT_TIMEOUT_MS.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Deadline in milliseconds, 0 or negative for none.
+ */
+void spi_set_request_timeout(spi_ctx_t *ctx, int timeout_ms);
+
+/**
+ * @brief Changes the SPI clock frequency of a context.
+ *
+ * Takes effect for the next transfer. The spi-max-frequency of the device
+ * tree only sets the initial rate; the controller limit still applies.
+ *
+ * @param ctx The device context.
+ * @param speed_hz The new clock frequency in Hz.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_set_speed(spi_ctx_t *ctx, uint32_t speed_hz);
+
+/**
+ * @brief Returns the SPI clock frequency of a context.
+ *
+ * @param ctx The device context.
+ * @return The clock frequency in Hz.
+ */
+uint32_t spi_get_speed(const spi_ctx_t *ctx);
+
+/**
+ * @brief Fills training parameters with their defaults.
+ *
+ * Defaults: function ID 0, 32 probes of 64 bytes per step, 100 ms probe
+ * deadline, SPI_TRAIN_MIN_HZ to SPI_TRAIN_MAX_HZ, cached in
+ * SPI_SPEED_CACHE_PATH. Set function_id to a request the slave answers
+ * without side effects.
+ *
+ * @param params The parameters to initialize.
+ */
+void spi_train_params_init(spi_train_params_t *params);
+
+/**
+ * @brief Finds the highest SPI clock frequency the link carries reliably.
+ *
+ * Starting at min_speed_hz, the clock is doubled (1, 2, 4, ... MHz) up to
+ * max_speed_hz. At each step a round of probe requests is sent; a CRC
+ * mismatch, malformed frame or missed deadline ends the search and the last
+ * clean step is kept. The result is stored per spidev node in the cache
+ * file, and later calls first validate the cached speed with one round of
+ * probes instead of searching again. Blocks for the whole run and requires
+ * that no request is pending.
+ *
+ * @param ctx The device context.
+ * @param params The training parameters, or NULL for the defaults.
+ * @param speed_hz If not NULL, receives the selected speed in Hz.
+ * @return 0 on success with the context left at the selected speed, or -1
+ *         with errno set to EBUSY if requests are pending, EINVAL for bad
+ *         parameters, or EIO if not even min_speed_hz works (the original
+ *         speed is restored).
+ */
+int spi_train_speed(spi_ctx_t *ctx, const spi_train_params_t *params, uint32_t *speed_hz);
+
+/**
+ * @brief Sets the number of requests kept outstanding at the SPI slave.
+ *
+ * With a depth greater than one, submitted requests are transmitted
+ * back-to-back without waiting for the previous response. With
+ * SPI_PROTOCOL_V1 the slave must answer requests in the order it received
+ * them. The default depth is 1.
+ *
+ * @param ctx The device context.
+ * @param depth Number of in-flight requests, clamped to 1..SPI_MAX_INFLIGHT.
+ */
+void spi_pipeline_set_depth(spi_ctx_t *ctx, unsigned int depth);
+
+/**
+ * @brief Submits a request to the pipelined request engine.
+ *
+ * The request is transmitted immediately if an in-flight slot is free,
+ * otherwise the payload is copied into the submission queue and sent as
+ * soon as a slot becomes available. The callback is invoked from
+ * spi_process_responses() once the matching response has been received.
+ * Without a callback the handler registered for the function ID is invoked
+ * instead, see spi_register_handler().
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload Pointer to the payload data to be sent.
+ * @param payload_size Size of the payload data in bytes.
+ * @param callback Callback function to handle the response, or NULL.
+ * @return The sequence tag of the request, or -1 with errno set to EAGAIN
+ *         when the submission queue is full or EMSGSIZE when the payload is
+ *         larger than the 1024-byte maximum payload.
+ */
+int spi_submit(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size, spi_callback_t callback);
+
+/**
+ * @brief Submits a request in a priority class.
+ *
+ * Works like spi_submit(), which submits in SPI_PRIORITY_NORMAL. Each class
+ * is queued in submission order, and a free in-flight slot goes to the
+ * oldest request of the most urgent class, so a real-time request overtakes
+ * queued normal and bulk requests. Bulk requests, including the fragments
+ * of spi_submit_bulk(), never take the last in-flight slot when the
+ * pipeline is deeper than one, which keeps it free for the other classes.
+ * Lower classes wait as long as higher ones have requests queued; request
+ * deadlines bound how long.
+ *
+ * Requests overtake each other only when responses are matched by sequence
+ * (SPI_PROTOCOL_V2) or when a single request is in flight at a time. In
+ * version 1 with a deeper pipeline or in duplex mode, queued requests go out
+ * in submission order whatever their class.
+ *
+ * The time every request spends queued is recorded per class in
+ * spi_stats_t::queue_ns.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param payload Pointer to the payload data to be sent.
+ * @param payload_size Size of the payload data in bytes.
+ * @param callback Callback function to handle the response, or NULL.
+ * @param priority The priority class of the request.
+ * @return The sequence tag of the request, or -1 with errno set to EAGAIN
+ *         when the submission queue is full, EMSGSIZE when the payload is
+ *         larger than the 1024-byte maximum payload, or EINVAL when the
+ *         priority class is invalid.
+ */
+int spi_submit_priority(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *payload, uint16_t payload_size,
+                        spi_callback_t callback, spi_priority_t priority);
+
+/**
+ * @brief Submits a request whose payload is transmitted straight from caller buffers.
+ *
+ * The frame header, each payload buffer and the frame trailer are sent as
+ * separate segments of one SPI message with chip select held, and the CRC is
+ * computed over the buffers in place: the payload is neither copied nor
+ * staged on the stack. Because the buffers are only borrowed for the duration
+ * of the call, the request is never queued; it fails with EAGAIN when no
+ * in-flight slot is free or when earlier requests are still queued. The
+ * response is delivered through spi_process_responses() like for spi_submit().
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID for the request.
+ * @param iov Payload buffers, concatenated in array order on the wire.
+ * @param iovcnt Number of payload buffers, at most SPI_MAX_IOV.
+ * @param callback The callback function to handle the response.
+ * @return The sequence tag of the request, or -1 with errno set to EAGAIN,
+ *         EMSGSIZE when the payloads exceed 1024 bytes in total, or EINVAL
+ *         when iovcnt is larger than SPI_MAX_IOV.
+ */
+int spi_submit_iov(spi_ctx_t *ctx, uint8_t function_id, const struct iovec *iov, size_t iovcnt, spi_callback_t callback);
+
+/**
+ * @brief Transmits several requests with a single SPI_IOC_MESSAGE ioctl.
+ *
+ * Each request becomes one segment of the SPI message, with its own
+ * cs_change and delay_usecs settings. Requests are accepted while the
+ * submission queue is empty and in-flight slots are free, so a batch never
+ * holds more requests than spi_pipeline_set_depth() allows; raise the depth
+ * to the number of requests the slave can hold to batch more of them. One
+ * ioctl carries as many frames as fit in the 4 KiB spidev buffer; larger
+ * batches are split into several ioctls. Acceptance also stops at the first
+ * request whose sequence byte still belongs to a pending request. Responses
+ * are delivered through spi_process_responses() like for spi_submit().
+ *
+ * @param ctx The device context.
+ * @param requests Array of requests to transmit.
+ * @param count Number of requests in the array.
+ * @param first_sequence If not NULL, receives the sequence tag of the first
+ *                       accepted request; the following ones are consecutive.
+ * @return Number of requests accepted, or -1 with errno set to EMSGSIZE when
+ *         a payload is larger than the 1024-byte maximum payload.
+ */
+int spi_send_batch(spi_ctx_t *ctx, const spi_request_t *requests, size_t count, uint16_t *first_sequence);
+
+/**
+ * @brief Submits a transfer of any size, split into fragments.
+ *
+ * The request data is sent as a run of requests with the same function ID,
+ * each carrying a fragment header in front of up to SPI_FRAGMENT_DATA_MAX
+ * data bytes:
+ *
+ *     offset (LE32) | total size (LE32) | data
+ *
+ * A transfer without request data still sends one, empty, fragment. The
+ * slave acknowledges every fragment; its answer to the last one starts the
+ * response, which is fragmented the same way, offset and total referring to
+ * the response. Until the whole response is in, the library keeps polling
+ * the slave with fragments holding no data and offset equal to the request
+ * size. Fragments are pipelined, up to the pipeline depth of the context in
+ * flight at a time, and their responses are reassembled into the response
+ * buffer in any order. Fragments are submitted in SPI_PRIORITY_BULK, so
+ * more urgent requests are interleaved between them, see
+ * spi_submit_priority().
+ *
+ * The callback runs once, when the response is complete or as soon as a
+ * fragment fails; with SPI_ERROR_INVALID_FORMAT when a response fragment is
+ * malformed or the response does not fit in the buffer. Fragments are
+ * completed by spi_process_responses() and spi_dispatch() like any request.
+ * The request data and the response buffer must stay valid until then.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID of every fragment.
+ * @param data The request data.
+ * @param size The size of the request data, less than 4 GiB.
+ * @param response The buffer the response is reassembled in.
+ * @param response_capacity The size of the response buffer.
+ * @param callback Called once the transfer has completed or failed.
+ * @return 0 on success, or -1 with errno set to EBUSY when SPI_MAX_BULK
+ *         transfers are already in progress, EINVAL when size is too large,
+ *         or EAGAIN when the first fragment could not be submitted.
+ */
+int spi_submit_bulk(spi_ctx_t *ctx, uint8_t function_id, const uint8_t *data, size_t size, uint8_t *response,
+                    size_t response_capacity, spi_bulk_callback_t callback);
+
+/**
+ * @brief Waits for the next response and completes its in-flight request.
+ *
+ * The wait ends early at the earliest request deadline; requests whose
+ * deadline has passed are completed with SPI_ERROR_TIMEOUT.
+ *
+ * @param ctx The device context.
+ * @param timeout_ms Maximum time to wait for the GPIO interrupt, -1 to wait
+ *                   until a response arrives or a deadline expires.
+ * @return Number of completed requests, or -1 on error.
+ */
+int spi_process_responses(spi_ctx_t *ctx, int timeout_ms);
+
+/**
+ * @brief Returns the number of requests that have not completed yet.
+ *
+ * @param ctx The device context.
+ * @return Number of in-flight and queued requests.
+ */
+size_t spi_pending_requests(spi_ctx_t *ctx);
+
+/**
+ * @brief Returns the sequence tag the next accepted request will be given.
+ *
+ * The callback of a request may run before spi_submit() returns, e.g. when
+ * its transfer fails; this lets a caller set up per-request state first.
+ *
+ * @param ctx The device context.
+ * @return The sequence tag of the next request accepted by any submit function.
+ */
+uint16_t spi_next_sequence(const spi_ctx_t *ctx);
+
+/**
+ * @brief Returns a file descriptor for integration into an event loop.
+ *
+ * The descriptor is the GPIO interrupt line event fd; it becomes readable
+ * (POLLIN) when the SPI slave signals that a response is ready. While
+ * spi_start_receiving() is active it is the receiver thread's doorbell instead,
+ * so fetch it again after starting or stopping the receiver. Register it
+ * with epoll, libuv or sd-event and call spi_dispatch() when it fires. The
+ * descriptor is owned by the library and must not be read or closed.
+ *
+ * @param ctx The device context.
+ * @return The event file descriptor.
+ */
+int spi_get_event_fd(spi_ctx_t *ctx);
+
+/**
+ * @brief Processes all work that is ready without blocking.
+ *
+ * Services every pending GPIO interrupt, invokes the callbacks of the
+ * completed requests and transmits queued requests into the freed in-flight
+ * slots. Requests are submitted with spi_submit() or spi_send_batch().
+ *
+ * @param ctx The device context.
+ * @return Number of completed requests, or -1 on error.
+ */
+int spi_dispatch(spi_ctx_t *ctx);
+
+/**
+ * @brief Registers the handler of a function ID.
+ *
+ * Each context keeps one handler per function ID in a table indexed by it,
+ * so delivering a frame to its handler is a single lookup. The handler
+ * receives the responses to requests submitted without a callback, their
+ * errors included, and the valid frames with this function ID that match
+ * no request in flight, which would otherwise go to the spi_start_receiving()
+ * callback or be dropped. The latter have spi_response_t::unsolicited set,
+ * so that a handler never mistakes them for the response to one of its
+ * requests. This lets every module own its function IDs
+ * without a central switch. Handlers run in the thread that completes
+ * requests, like callbacks.
+ *
+ * @param ctx The device context.
+ * @param function_id The function ID to handle.
+ * @param handler The handler, or NULL to unregister the current one.
+ * @param user Passed to every invocation of the handler.
+ */
+void spi_register_handler(spi_ctx_t *ctx, uint8_t function_id, spi_handler_t handler, void *user);
+
+/**
+ * @brief Sets how many frames are serviced per wakeup.
+ *
+ * With a budget of 1 (default) every wakeup reads one GPIO line event and
+ * one frame. A larger budget enables drain mode: the edges queued by the
+ * kernel, up to the budget, are read with one
+ * gpiod_line_event_read_multiple() and their frames are read back to back
+ * before deadlines are checked, queued requests are transmitted or the
+ * receiver doorbell is rung, like the NAPI budget of a network driver.
+ * Under burst load this saves a poll() and a read() per frame. Edges beyond
+ * the budget keep the line readable and are serviced on the next wakeup.
+ *
+ * @param ctx The device context.
+ * @param budget Frames per wakeup, 1 to SPI_DRAIN_BUDGET_MAX.
+ * @return 0 on success, -1 with errno set to EINVAL if the budget is out of range.
+ */
+int spi_set_drain_budget(spi_ctx_t *ctx, unsigned int budget);
+
+/**
+ * @brief Selects the CRC32 engine used to protect frames.
+ *
+ * All engines produce bit-identical results; the choice only affects speed.
+ * The selection applies to every context of the process.
+ *
+ * @param engine The engine to use, SPI_CRC_ENGINE_AUTO for the fastest one.
+ * @return 0 on success, -1 if the engine is not available.
+ */
+int spi_crc_select(spi_crc_engine_t engine);
+
+/**
+ * @brief Copies the statistics of a context.
+ *
+ * Statistics are collected at all times; the cost is a clock read per
+ * transfer and per completion. Counters run from spi_open() or the last
+ * spi_reset_stats().
+ *
+ * @param ctx The device context.
+ * @param stats Receives the statistics.
+ */
+void spi_get_stats(spi_ctx_t *ctx, spi_stats_t *stats);
+
+/**
+ * @brief Clears the statistics of a context.
+ *
+ * @param ctx The device context.
+ */
+void spi_reset_stats(spi_ctx_t *ctx);
+
+/**
+ * @brief Writes the statistics of a context to a text file.
+ *
+ * The file uses the Prometheus text exposition format, so it can be served
+ * by the node_exporter textfile collector. It is replaced atomically.
+ *
+ * @param ctx The device context.
+ * @param path The file to write.
+ * @return 0 on success, -1 on error with errno set.
+ */
+int spi_export_stats(spi_ctx_t *ctx, const char *path);
+
+/**
+ * @brief Returns a percentile of a latency histogram.
+ *
+ * The result is the upper bound of the bucket holding the percentile, so it
+ * overestimates by at most 1/16 and never exceeds the largest value.
+ *
+ * @param hist The histogram to query.
+ * @param percentile The percentile, from 0.0 to 100.0.
+ * @return The value in nanoseconds, 0 for an empty histogram.
+ */
+uint64_t spi_histogram_percentile(const spi_histogram_t *hist, double percentile);
+
+/**
+ * @brief Sets the wakeup latency above which interrupts are traced.
+ *
+ * Interrupts whose servicing thread wakes up at least this long after the
+ * kernel timestamped the edge are recorded in a ring of the last
+ * SPI_WAKEUP_TRACE_SIZE entries, read with spi_get_slow_wakeups().
+ *
+ * @param ctx The device context.
+ * @param threshold_us Threshold in microseconds, 0 to disable tracing.
+ */
+void spi_set_slow_wakeup_threshold(spi_ctx_t *ctx, uint32_t threshold_us);
+
+/**
+ * @brief Takes the traced slow wakeups of a context, oldest first.
+ *
+ * @param ctx The device context.
+ * @param traces Receives the traces.
+ * @param max_traces Capacity of the traces array.
+ * @return Number of traces copied; they are removed from the ring.
+ */
+size_t spi_get_slow_wakeups(spi_ctx_t *ctx, spi_wakeup_trace_t *traces, size_t max_traces);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // SPI_LIB_H
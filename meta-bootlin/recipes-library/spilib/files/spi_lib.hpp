@@ -0,0 +1,435 @@
+/**
+ * @file spi_lib.hpp
+ * @brief Header-only C++20 interface to the SPI communication library.
+ *
+ * Wraps a spi_ctx_t in a move-only handle, takes payloads as std::span and
+ * accepts lambdas as callbacks. Lambdas are stored inline in per-sequence
+ * slots and reached through the handler registry of the C library, so
+ * submitting a request never allocates. Typed messages describe their
+ * payload as a list of fields whose wire offsets, like the frame layout
+ * around them, are computed at compile time.
+ */
+
+#ifndef SPI_LIB_HPP
+#define SPI_LIB_HPP
+
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "spi_lib.h"
+
+namespace spi {
+
+/** @brief Largest payload of a single frame. */
+inline constexpr std::size_t max_payload_size = SPI_FRAGMENT_HEADER_SIZE + SPI_FRAGMENT_DATA_MAX;
+
+/** @brief Largest lambda, captures included, accepted as a callback. */
+inline constexpr std::size_t callback_capacity = 48U;
+
+/**
+ * @brief Response passed to callbacks; only valid while the callback runs.
+ */
+struct response {
+    std::uint8_t function_id;             /**< Function ID of the response */
+    std::uint16_t sequence;               /**< Sequence tag of the request it completes */
+    std::span<const std::uint8_t> payload; /**< Payload, empty on error */
+};
+
+/**
+ * @brief A callable accepted as callback.
+ */
+template <typename F>
+concept callback = std::invocable<F &, spi_error_t, const response &> && std::move_constructible<std::decay_t<F>>;
+
+/**
+ * @brief Byte offsets of a frame with a fixed payload size.
+ *
+ * @tparam Protocol The framing protocol.
+ * @tparam PayloadSize Size of the payload in bytes.
+ */
+template <spi_protocol_t Protocol, std::size_t PayloadSize>
+struct frame_layout {
+    static_assert(PayloadSize <= max_payload_size, "payload does not fit into a frame");
+
+    static constexpr bool has_sequence = (Protocol == SPI_PROTOCOL_V2);       /**< Version 2 carries a sequence byte */
+    static constexpr std::size_t function_id_offset = 2U;                     /**< Behind the start identifier */
+    static constexpr std::size_t sequence_offset = 3U;                        /**< Only present if has_sequence */
+    static constexpr std::size_t length_offset = has_sequence ? 4U : 3U;      /**< Little-endian payload size */
+    static constexpr std::size_t payload_offset = length_offset + 2U;         /**< First payload byte */
+    static constexpr std::size_t crc_offset = payload_offset + PayloadSize;   /**< Low byte of the CRC32 */
+    static constexpr std::size_t stop_offset = crc_offset + 1U;               /**< 0x0D 0x0A */
+    static constexpr std::size_t size = stop_offset + 2U;                     /**< Total size of the frame */
+    static constexpr std::size_t crc_begin = has_sequence ? function_id_offset : payload_offset; /**< First byte covered by the CRC */
+};
+
+namespace detail {
+
+/**
+ * @brief Little-endian wire encoding of a message field.
+ */
+template <typename T>
+struct wire;
+
+template <std::integral T>
+struct wire<T> {
+    static constexpr std::size_t size = sizeof(T);
+
+    static void encode(std::uint8_t *out, T value) {
+        auto bits = static_cast<std::make_unsigned_t<T>>(value);
+        for (std::size_t i = 0U; i < size; i++) {
+            out[i] = static_cast<std::uint8_t>(bits >> (CHAR_BIT * i));
+        }
+    }
+
+    static T decode(const std::uint8_t *in) {
+        std::make_unsigned_t<T> bits = 0U;
+        for (std::size_t i = 0U; i < size; i++) {
+            bits = static_cast<std::make_unsigned_t<T>>(bits | (static_cast<std::make_unsigned_t<T>>(in[i]) << (CHAR_BIT * i)));
+        }
+        return static_cast<T>(bits);
+    }
+};
+
+template <std::size_t N>
+struct wire<std::array<std::uint8_t, N>> {
+    static constexpr std::size_t size = N;
+
+    static void encode(std::uint8_t *out, const std::array<std::uint8_t, N> &value) {
+        (void)std::memcpy(out, value.data(), N);
+    }
+
+    static std::array<std::uint8_t, N> decode(const std::uint8_t *in) {
+        std::array<std::uint8_t, N> value;
+        (void)std::memcpy(value.data(), in, N);
+        return value;
+    }
+};
+
+/**
+ * @brief Callback stored inline, without heap allocation.
+ */
+class inline_callback {
+public:
+    inline_callback() = default;
+    inline_callback(const inline_callback &) = delete;
+    inline_callback &operator=(const inline_callback &) = delete;
+    ~inline_callback() { reset(); }
+
+    /**
+     * @brief Stores a callback, which must fit into callback_capacity bytes.
+     *
+     * @param f The callback.
+     */
+    template <callback F>
+    void emplace(F &&f) {
+        using T = std::decay_t<F>;
+        static_assert(sizeof(T) <= callback_capacity, "callback captures too much, capture a pointer instead");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "callback is over-aligned");
+
+        reset();
+        ::new (static_cast<void *>(storage_)) T(std::forward<F>(f));
+        invoke_ = [](void *self, spi_error_t error, const response &resp) {
+            (*std::launder(static_cast<T *>(self)))(error, resp);
+        };
+        destroy_ = [](void *self) noexcept { std::launder(static_cast<T *>(self))->~T(); };
+    }
+
+    /** @brief Destroys the stored callback, if any. */
+    void reset() noexcept {
+        if (destroy_ != nullptr) {
+            destroy_(storage_);
+            invoke_ = nullptr;
+            destroy_ = nullptr;
+        }
+    }
+
+    /** @brief Checks whether no callback is stored. */
+    bool empty() const noexcept { return invoke_ == nullptr; }
+
+    /**
+     * @brief Invokes the stored callback.
+     *
+     * @param error Result of the operation.
+     * @param resp The response.
+     */
+    void operator()(spi_error_t error, const response &resp) { invoke_(storage_, error, resp); }
+
+private:
+    alignas(std::max_align_t) std::byte storage_[callback_capacity];
+    void (*invoke_)(void *, spi_error_t, const response &) = nullptr;
+    void (*destroy_)(void *) noexcept = nullptr;
+};
+
+/**
+ * @brief Callbacks of one device, at a stable address for the C handlers.
+ */
+struct device_state {
+    std::array<inline_callback, 256> pending;    // Indexed by the sequence byte of the request
+    std::array<inline_callback, 256> listeners;  // Indexed by function ID
+};
+
+} // namespace detail
+
+/**
+ * @brief A field type of a message: an integer or a byte array.
+ */
+template <typename T>
+concept field = requires { detail::wire<T>::size; };
+
+/**
+ * @brief Message whose payload is a fixed sequence of little-endian fields.
+ *
+ * For example message<0x10, std::uint8_t, std::uint16_t> is a 3-byte payload
+ * with the second field at payload offset 1, and
+ * message<...>::layout<SPI_PROTOCOL_V2>::crc_offset is the offset of its CRC
+ * in a version 2 frame.
+ *
+ * @tparam FunctionId Function ID of the message.
+ * @tparam Fields Field types, in wire order.
+ */
+template <std::uint8_t FunctionId, field... Fields>
+struct message {
+    static constexpr std::uint8_t function_id = FunctionId;
+    static constexpr std::array<std::size_t, sizeof...(Fields)> field_sizes{detail::wire<Fields>::size...};
+    static constexpr std::size_t payload_size = (std::size_t{0} + ... + detail::wire<Fields>::size);
+    static_assert(payload_size <= max_payload_size, "message does not fit into a frame");
+
+    /** @brief Offset of field I in the payload. */
+    template <std::size_t I>
+    static constexpr std::size_t offset = [] {
+        std::size_t sum = 0U;
+        for (std::size_t i = 0U; i < I; i++) {
+            sum += field_sizes[i];
+        }
+        return sum;
+    }();
+
+    /** @brief Layout of the frame carrying the message. */
+    template <spi_protocol_t Protocol>
+    using layout = frame_layout<Protocol, payload_size>;
+
+    std::tuple<Fields...> fields;  /**< Field values */
+
+    /**
+     * @brief Encodes the fields into a payload buffer.
+     *
+     * @param out The payload buffer.
+     */
+    void encode(std::span<std::uint8_t, payload_size> out) const {
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            (detail::wire<Fields>::encode(&out[offset<I>], std::get<I>(fields)), ...);
+        }(std::index_sequence_for<Fields...>{});
+    }
+
+    /**
+     * @brief Decodes a payload.
+     *
+     * @param payload The received payload.
+     * @return The message, or nothing if the payload size does not match.
+     */
+    static std::optional<message> decode(std::span<const std::uint8_t> payload) {
+        if (payload.size() != payload_size) {
+            return std::nullopt;
+        }
+        return [&]<std::size_t... I>(std::index_sequence<I...>) {
+            return message{{detail::wire<Fields>::decode(&payload[offset<I>])...}};
+        }(std::index_sequence_for<Fields...>{});
+    }
+};
+
+/**
+ * @brief Move-only handle owning a device context.
+ *
+ * Callbacks passed to this class are reached through the handler registry:
+ * the handle registers itself for every function ID it submits to or listens
+ * on, so those IDs must not be registered with spi_register_handler()
+ * directly. Responses are expected to carry the function ID of their request.
+ * Like the context, a handle is driven from one thread at a time.
+ */
+class device {
+public:
+    /**
+     * @brief Opens a SPI slave.
+     *
+     * @param config The settings of the slave.
+     * @return The device, or nothing with errno set.
+     */
+    static std::optional<device> open(const spi_config_t &config) {
+        spi_ctx_t *ctx = spi_open(&config);
+        if (ctx == nullptr) {
+            return std::nullopt;
+        }
+        return device(ctx);
+    }
+
+    /**
+     * @brief Takes ownership of an open context.
+     *
+     * @param ctx The context, released by the destructor.
+     */
+    explicit device(spi_ctx_t *ctx) : ctx_(ctx), state_(std::make_unique<detail::device_state>()) {}
+
+    device(device &&other) noexcept
+        : ctx_(std::exchange(other.ctx_, nullptr)), state_(std::move(other.state_)) {}
+
+    device &operator=(device &&other) noexcept {
+        if (this != &other) {
+            close();
+            ctx_ = std::exchange(other.ctx_, nullptr);
+            state_ = std::move(other.state_);
+        }
+        return *this;
+    }
+
+    device(const device &) = delete;
+    device &operator=(const device &) = delete;
+
+    ~device() { close(); }
+
+    /** @brief Returns the context, for the settings not wrapped here. */
+    spi_ctx_t *native_handle() const noexcept { return ctx_; }
+
+    /**
+     * @brief Submits a request, see spi_submit().
+     *
+     * @param function_id The function ID for the request.
+     * @param payload The payload, copied before the call returns.
+     * @param done Invoked once with the outcome of the request.
+     * @return The sequence tag of the request, or -1 with errno set; EAGAIN
+     *         also when the callback slot of the next sequence byte is taken.
+     */
+    template <callback F>
+    int submit(std::uint8_t function_id, std::span<const std::uint8_t> payload, F &&done) {
+        if (payload.size() > max_payload_size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        // Stage the callback first: a failing transfer completes it within spi_submit()
+        detail::inline_callback &slot = state_->pending[spi_next_sequence(ctx_) & 0xFFU];
+        if (!slot.empty()) {
+            errno = EAGAIN;
+            return -1;
+        }
+        slot.emplace(std::forward<F>(done));
+        bind(function_id);
+
+        int sequence = spi_submit(ctx_, function_id, payload.data(), static_cast<std::uint16_t>(payload.size()), nullptr);
+        if (sequence < 0) {
+            slot.reset();
+        }
+        return sequence;
+    }
+
+    /**
+     * @brief Submits a typed message.
+     *
+     * @param msg The message.
+     * @param done Invoked once with the outcome of the request.
+     * @return The sequence tag of the request, or -1 with errno set.
+     */
+    template <typename Message, callback F>
+    int submit(const Message &msg, F &&done) {
+        std::array<std::uint8_t, Message::payload_size> payload;
+        msg.encode(std::span<std::uint8_t, Message::payload_size>(payload));
+        return submit(Message::function_id, payload, std::forward<F>(done));
+    }
+
+    /**
+     * @brief Sets the callback of the frames of a function ID that complete no request.
+     *
+     * These are the frames spi_register_handler() passes to a handler.
+     *
+     * @param function_id The function ID to listen on.
+     * @param listener Invoked for every such frame until off() is called.
+     */
+    template <callback F>
+    void on(std::uint8_t function_id, F &&listener) {
+        state_->listeners[function_id].emplace(std::forward<F>(listener));
+        bind(function_id);
+    }
+
+    /**
+     * @brief Removes the listener of a function ID.
+     *
+     * @param function_id The function ID.
+     */
+    void off(std::uint8_t function_id) { state_->listeners[function_id].reset(); }
+
+    /** @brief See spi_process_responses(). */
+    int process_responses(int timeout_ms) { return spi_process_responses(ctx_, timeout_ms); }
+
+    /** @brief See spi_dispatch(). */
+    int dispatch() { return spi_dispatch(ctx_); }
+
+    /** @brief See spi_get_event_fd(). */
+    int event_fd() { return spi_get_event_fd(ctx_); }
+
+    /** @brief See spi_pending_requests(). */
+    std::size_t pending_requests() { return spi_pending_requests(ctx_); }
+
+private:
+    /**
+     * @brief Routes the frames of a function ID to this handle.
+     *
+     * @param function_id The function ID.
+     */
+    void bind(std::uint8_t function_id) { spi_register_handler(ctx_, function_id, &trampoline, state_.get()); }
+
+    /**
+     * @brief Releases the context; its pending callbacks are never invoked.
+     */
+    void close() noexcept {
+        if (ctx_ != nullptr) {
+            spi_release(ctx_);
+            ctx_ = nullptr;
+        }
+    }
+
+    /**
+     * @brief Handler registered for every function ID in use.
+     *
+     * @param error Result of the operation.
+     * @param resp The response.
+     * @param user The device_state of the handle.
+     */
+    static void trampoline(spi_error_t error, spi_response_t *resp, void *user) {
+        auto *state = static_cast<detail::device_state *>(user);
+        response view{resp->function_id, resp->sequence,
+                      std::span<const std::uint8_t>(resp->payload, (resp->payload != nullptr) ? resp->payload_size : 0U)};
+
+        // The sequence of a frame matching no request may equal the one of
+        // a request still waiting for its response, so it is never looked up
+        if (resp->unsolicited == 0U) {
+            detail::inline_callback &slot = state->pending[resp->sequence & 0xFFU];
+            if (!slot.empty()) {
+                slot(error, view);
+                slot.reset();
+                return;
+            }
+        }
+
+        detail::inline_callback &listener = state->listeners[resp->function_id];
+        if (!listener.empty()) {
+            listener(error, view);
+        }
+    }
+
+    spi_ctx_t *ctx_;
+    std::unique_ptr<detail::device_state> state_;
+};
+
+} // namespace spi
+
+#endif // SPI_LIB_HPP
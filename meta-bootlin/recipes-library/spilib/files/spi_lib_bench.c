@@ -0,0 +1,431 @@
+/**
+ * @file spi_lib_bench.c
+ * @brief Benchmarks of the spilib hot paths.
+ *
+ * Times the CRC engines, the frame codec and complete requests over the
+ * loopback transport, and prints one record per benchmark as CSV or JSON so
+ * that results can be compared between releases.
+ */
+
+#include "spi_lib.h"
+#include "spi_crc.h"
+#include "spi_frame.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_TIME_MS 200U
+#define BENCH_PAYLOAD_MAX 1024U
+#define BENCH_FUNCTION_ID 0x01U
+
+/**
+ * @brief Output format of the results.
+ */
+typedef enum {
+    FORMAT_CSV,
+    FORMAT_JSON
+} bench_format_t;
+
+/**
+ * @brief Settings of a benchmark run, from the command line.
+ */
+typedef struct {
+    bench_format_t format;
+    uint64_t min_time_ns;       // Each benchmark runs at least this long
+    unsigned int latency_us;    // Response latency of the loopback slave
+    const char *filter;         // Only run benchmarks whose name starts with this
+    int records;                // Records printed so far
+} bench_options_t;
+
+/**
+ * @brief One line of output.
+ */
+typedef struct {
+    const char *name;
+    const char *variant;
+    size_t payload_size;
+    uint64_t operations;
+    double ns_per_op;
+    double mb_per_s;
+    uint64_t p50_ns;            // Request latency percentiles, 0 for micro benchmarks
+    uint64_t p99_ns;
+} bench_result_t;
+
+/**
+ * @brief Operation timed by a micro benchmark.
+ *
+ * @param state Benchmark specific state.
+ * @param iterations Number of times to repeat the operation.
+ */
+typedef void (*bench_fn_t)(void *state, uint64_t iterations);
+
+/**
+ * @brief State of the CRC and codec benchmarks.
+ */
+typedef struct {
+    spi_protocol_t protocol;
+    uint16_t payload_size;
+    uint8_t payload[BENCH_PAYLOAD_MAX];
+    uint8_t frame[SPI_FRAME_MAX_SIZE];
+    size_t frame_size;
+} codec_state_t;
+
+static const uint16_t payload_sizes[] = {0U, 1U, 16U, 64U, 256U, 1024U};
+static volatile uint32_t sink;  // Keeps the compiler from discarding results
+
+/**
+ * @brief Returns the current CLOCK_MONOTONIC time.
+ *
+ * @return Time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Checks whether a benchmark is selected by the filter.
+ *
+ * @param options The run settings.
+ * @param name The benchmark name.
+ * @return Non-zero if the benchmark should run.
+ */
+static int selected(const bench_options_t *options, const char *name) {
+    return (options->filter == NULL) || (strncmp(name, options->filter, strlen(options->filter)) == 0);
+}
+
+/**
+ * @brief Prints one result in the selected format.
+ *
+ * @param options The run settings.
+ * @param result The result to print.
+ */
+static void print_result(bench_options_t *options, const bench_result_t *result) {
+    if (options->format == FORMAT_JSON) {
+        (void)printf("%s\n    {\"benchmark\": \"%s\", \"variant\": \"%s\", \"payload_bytes\": %zu, "
+                     "\"operations\": %llu, \"ns_per_op\": %.2f, \"mb_per_s\": %.2f, "
+                     "\"p50_ns\": %llu, \"p99_ns\": %llu}",
+                     (options->records == 0) ? "" : ",", result->name, result->variant, result->payload_size,
+                     (unsigned long long)result->operations, result->ns_per_op, result->mb_per_s,
+                     (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+    } else {
+        (void)printf("%s,%s,%zu,%llu,%.2f,%.2f,%llu,%llu\n", result->name, result->variant, result->payload_size,
+                     (unsigned long long)result->operations, result->ns_per_op, result->mb_per_s,
+                     (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+    }
+    (void)fflush(stdout);
+    options->records++;
+}
+
+/**
+ * @brief Times an operation, doubling the iteration count until the run is long enough.
+ *
+ * @param options The run settings.
+ * @param name The benchmark name.
+ * @param variant The benchmark variant.
+ * @param fn The operation to time.
+ * @param state State passed to the operation.
+ * @param bytes Bytes processed per operation, for the throughput column.
+ */
+static void run_micro(bench_options_t *options, const char *name, const char *variant, bench_fn_t fn, void *state,
+                      size_t bytes) {
+    uint64_t iterations = 1U;
+    uint64_t elapsed;
+
+    fn(state, 1U);  // Warm the caches
+    for (;;) {
+        uint64_t start = now_ns();
+        fn(state, iterations);
+        elapsed = now_ns() - start;
+        if ((elapsed >= options->min_time_ns) || (iterations >= (1ULL << 40U))) {
+            break;
+        }
+        iterations *= 2U;
+    }
+
+    bench_result_t result;
+    (void)memset(&result, 0, sizeof(result));
+    result.name = name;
+    result.variant = variant;
+    result.payload_size = bytes;
+    result.operations = iterations;
+    result.ns_per_op = (double)elapsed / (double)iterations;
+    result.mb_per_s = (elapsed == 0U) ? 0.0 : ((double)bytes * (double)iterations * 1000.0) / (double)elapsed;
+    print_result(options, &result);
+}
+
+/**
+ * @brief Computes the CRC of the payload with the byte-at-a-time engine.
+ *
+ * @param state The codec state.
+ * @param iterations Number of CRCs to compute.
+ */
+static void bench_crc_bytewise(void *state, uint64_t iterations) {
+    const codec_state_t *codec = state;
+    for (uint64_t i = 0U; i < iterations; i++) {
+        sink += crc32_update_bytewise(CRC32_INITIAL_VALUE, codec->payload, codec->payload_size);
+    }
+}
+
+/**
+ * @brief Computes the CRC of the payload with the slice-by-8 engine.
+ *
+ * @param state The codec state.
+ * @param iterations Number of CRCs to compute.
+ */
+static void bench_crc_slice8(void *state, uint64_t iterations) {
+    const codec_state_t *codec = state;
+    for (uint64_t i = 0U; i < iterations; i++) {
+        sink += crc32_update_slice8(CRC32_INITIAL_VALUE, codec->payload, codec->payload_size);
+    }
+}
+
+/**
+ * @brief Encodes request frames.
+ *
+ * @param state The codec state.
+ * @param iterations Number of frames to encode.
+ */
+static void bench_encode(void *state, uint64_t iterations) {
+    codec_state_t *codec = state;
+    for (uint64_t i = 0U; i < iterations; i++) {
+        sink += (uint32_t)spi_frame_encode(codec->protocol, codec->frame, (uint16_t)i, BENCH_FUNCTION_ID,
+                                           codec->payload, codec->payload_size);
+    }
+}
+
+/**
+ * @brief Validates and parses the encoded frame.
+ *
+ * @param state The codec state.
+ * @param iterations Number of frames to decode.
+ */
+static void bench_decode(void *state, uint64_t iterations) {
+    const codec_state_t *codec = state;
+    spi_response_t response;
+    for (uint64_t i = 0U; i < iterations; i++) {
+        sink += (uint32_t)spi_frame_decode(codec->protocol, codec->frame, codec->frame_size, &response);
+    }
+}
+
+/**
+ * @brief Runs the CRC engine and frame codec benchmarks over every payload size.
+ *
+ * @param options The run settings.
+ */
+static void run_codec_benchmarks(bench_options_t *options) {
+    static codec_state_t codec;
+
+    for (size_t i = 0U; i < BENCH_PAYLOAD_MAX; i++) {
+        codec.payload[i] = (uint8_t)(i * 7U);
+    }
+
+    for (size_t s = 0U; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+        codec.payload_size = payload_sizes[s];
+        if (selected(options, "crc")) {
+            run_micro(options, "crc", "bytewise", bench_crc_bytewise, &codec, codec.payload_size);
+            run_micro(options, "crc", "slice8", bench_crc_slice8, &codec, codec.payload_size);
+        }
+
+        for (int v = 0; v < 2; v++) {
+            codec.protocol = (v == 0) ? SPI_PROTOCOL_V1 : SPI_PROTOCOL_V2;
+            const char *variant = (v == 0) ? "v1" : "v2";
+            if (selected(options, "encode")) {
+                run_micro(options, "encode", variant, bench_encode, &codec, codec.payload_size);
+            }
+            if (selected(options, "decode")) {
+                codec.frame_size = spi_frame_encode(codec.protocol, codec.frame, 0U, BENCH_FUNCTION_ID,
+                                                    codec.payload, codec.payload_size);
+                run_micro(options, "decode", variant, bench_decode, &codec, codec.payload_size);
+                // A frame failing its CRC check must not be slower to reject
+                codec.frame[codec.frame_size - 3U] ^= 0x01U;
+                run_micro(options, "decode_bad_crc", variant, bench_decode, &codec, codec.payload_size);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Configuration of one end-to-end benchmark.
+ */
+typedef struct {
+    const char *variant;
+    spi_protocol_t protocol;
+    spi_read_mode_t read_mode;
+    unsigned int depth;
+    size_t duplex_window;
+} request_variant_t;
+
+static const request_variant_t request_variants[] = {
+    {"v1_fixed_depth1", SPI_PROTOCOL_V1, SPI_READ_FIXED, 1U, 0U},
+    {"v2_prefixed_depth1", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 1U, 0U},
+    {"v2_prefixed_depth8", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 8U, 0U},
+    {"v2_duplex_depth8", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 8U, 64U},
+};
+
+static uint64_t request_errors;
+
+/**
+ * @brief Counts failed requests of the end-to-end benchmark.
+ *
+ * @param error Result of the request.
+ * @param response Unused.
+ */
+static void count_response(spi_error_t error, spi_response_t *response) {
+    (void)response;
+    if (error != SPI_SUCCESS) {
+        request_errors++;
+    }
+}
+
+/**
+ * @brief Submits requests to a loopback slave for the minimum run time.
+ *
+ * A run where requests failed is still printed, but its result must not be
+ * trusted.
+ *
+ * @param options The run settings.
+ * @param variant The pipeline configuration.
+ * @param payload_size The payload size of every request.
+ * @return 0 on success, 1 if requests failed, -1 if the context could not be opened.
+ */
+static int run_requests(bench_options_t *options, const request_variant_t *variant, uint16_t payload_size) {
+    static uint8_t payload[BENCH_PAYLOAD_MAX];
+    spi_loopback_params_t loopback;
+    spi_config_t config;
+    spi_stats_t stats;
+    uint64_t operations = 0U;
+
+    spi_loopback_params_init(&loopback);
+    loopback.latency_us = options->latency_us;
+    loopback.duplex = (variant->duplex_window > 0U);
+    spi_config_init(&config);
+    config.backend = SPI_BACKEND_LOOPBACK;
+    config.loopback = &loopback;
+
+    spi_ctx_t *ctx = spi_open(&config);
+    if (ctx == NULL) {
+        return -1;
+    }
+    spi_set_protocol(ctx, variant->protocol);
+    (void)spi_set_read_mode(ctx, variant->read_mode);
+    spi_pipeline_set_depth(ctx, variant->depth);
+    spi_set_duplex(ctx, variant->duplex_window);
+    request_errors = 0U;
+
+    uint64_t start = now_ns();
+    uint64_t elapsed;
+    do {
+        // Submit in bursts so that the clock is not read per request
+        for (int i = 0; i < 64; i++) {
+            while (spi_submit(ctx, BENCH_FUNCTION_ID, payload, payload_size, count_response) < 0) {
+                (void)spi_process_responses(ctx, -1);
+            }
+            operations++;
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < options->min_time_ns);
+    while (spi_pending_requests(ctx) > 0U) {
+        (void)spi_process_responses(ctx, -1);
+    }
+    elapsed = now_ns() - start;
+
+    spi_get_stats(ctx, &stats);
+    spi_release(ctx);
+    if (request_errors != 0U) {
+        (void)fprintf(stderr, "%s: %llu requests failed\n", variant->variant, (unsigned long long)request_errors);
+    }
+
+    bench_result_t result;
+    result.name = "request";
+    result.variant = variant->variant;
+    result.payload_size = payload_size;
+    result.operations = operations;
+    result.ns_per_op = (double)elapsed / (double)operations;
+    result.mb_per_s = ((double)payload_size * (double)operations * 1000.0) / (double)elapsed;
+    result.p50_ns = spi_histogram_percentile(&stats.request_ns, 50.0);
+    result.p99_ns = spi_histogram_percentile(&stats.request_ns, 99.0);
+    print_result(options, &result);
+    return (request_errors != 0U) ? 1 : 0;
+}
+
+/**
+ * @brief Prints the command line help.
+ *
+ * @param program The program name.
+ */
+static void usage(const char *program) {
+    (void)fprintf(stderr,
+                  "Usage: %s [-f csv|json] [-t min_ms] [-l latency_us] [-b benchmark]\n"
+                  "  -f  Output format (default csv)\n"
+                  "  -t  Minimum run time of each benchmark in ms (default %u)\n"
+                  "  -l  Response latency of the loopback slave in us (default 0)\n"
+                  "  -b  Only run benchmarks starting with this name: crc, encode, decode, request\n",
+                  program, BENCH_DEFAULT_TIME_MS);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options_t options;
+    int opt;
+
+    (void)memset(&options, 0, sizeof(options));
+    options.min_time_ns = (uint64_t)BENCH_DEFAULT_TIME_MS * 1000000U;
+
+    while ((opt = getopt(argc, argv, "f:t:l:b:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                options.format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                options.format = FORMAT_CSV;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            options.min_time_ns = strtoull(optarg, NULL, 10) * 1000000U;
+            break;
+        case 'l':
+            options.latency_us = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (options.format == FORMAT_JSON) {
+        (void)printf("{\n  \"loopback_latency_us\": %u,\n  \"results\": [", options.latency_us);
+    } else {
+        (void)printf("benchmark,variant,payload_bytes,operations,ns_per_op,mb_per_s,p50_ns,p99_ns\n");
+    }
+
+    run_codec_benchmarks(&options);
+
+    int status = EXIT_SUCCESS;
+    if (selected(&options, "request")) {
+        for (size_t v = 0U; v < sizeof(request_variants) / sizeof(request_variants[0]); v++) {
+            for (size_t s = 0U; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+                int ret = run_requests(&options, &request_variants[v], payload_sizes[s]);
+                if (ret < 0) {
+                    perror("Failed to open loopback SPI context");
+                }
+                if (ret != 0) {
+                    status = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    if (options.format == FORMAT_JSON) {
+        (void)printf("\n  ]\n}\n");
+    }
+    return status;
+}
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include "spi_transport.h"
+#include "spi_crc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define LOOPBACK_MAX_PAYLOAD 1024U
+#define LOOPBACK_FRAME_SIZE (2U + 1U + 1U + 2U + LOOPBACK_MAX_PAYLOAD + 1U + 2U)  // Largest version 2 frame
+#define LOOPBACK_QUEUE_SIZE 64U   // Responses the slave holds before it overruns
+#define LOOPBACK_MOSI_SIZE 8192U  // Bytes collected while chip select is asserted
+#define LOOPBACK_START 0x48U
+#define LOOPBACK_V1 0x5AU
+#define LOOPBACK_V2 0x5BU
+#define LOOPBACK_DEFAULT_LATENCY_US 50U
+
+/**
+ * @brief A response frame held by the simulated slave.
+ */
+typedef struct {
+    uint8_t data[LOOPBACK_FRAME_SIZE];
+    size_t length;
+    uint64_t ready_ns;  // CLOCK_MONOTONIC time the slave has the frame ready
+} loopback_frame_t;
+
+/**
+ * @brief State of the simulated slave.
+ *
+ * Responses are shifted out in order, one per chip select assertion, like a
+ * slave that loads its TX FIFO with the oldest frame. In stream mode they are
+ * shifted out back to back instead, like a slave feeding its TX FIFO from a
+ * DMA ring, and the position is kept across chip select releases. Edges are
+ * kept apart from the frames because a lost edge leaves its frame in the slave.
+ */
+typedef struct {
+    pthread_mutex_t lock;     // Transfers and edge reads come from different threads
+    spi_loopback_params_t params;
+    uint32_t speed_hz;
+    uint32_t random;          // xorshift32 state
+
+    loopback_frame_t frames[LOOPBACK_QUEUE_SIZE];
+    size_t frame_head;
+    size_t frame_count;
+
+    uint64_t edges[LOOPBACK_QUEUE_SIZE];  // Times the pending edges are raised
+    size_t edge_head;
+    size_t edge_count;
+    int timer_fd;                         // Readable once the oldest edge is raised
+
+    int selected;             // Chip select asserted
+    int shifting;             // The oldest frame is being shifted out
+    size_t shift_offset;
+    uint8_t mosi[LOOPBACK_MOSI_SIZE];
+    size_t mosi_length;
+} spi_loopback_t;
+
+/**
+ * @brief Fills loopback parameters with an ideal slave.
+ *
+ * @param params The parameters to initialize.
+ */
+void spi_loopback_params_init(spi_loopback_params_t *params) {
+    (void)memset(params, 0, sizeof(*params));
+    params->latency_us = LOOPBACK_DEFAULT_LATENCY_US;
+    params->ignore_function_id = -1;
+    params->seed = 1U;
+}
+
+/**
+ * @brief Returns the current CLOCK_MONOTONIC time.
+ *
+ * @return Time in nanoseconds.
+ */
+static uint64_t loopback_now(void) {
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Draws the next pseudo-random number.
+ *
+ * @param lb The simulated slave.
+ * @return A uniformly distributed 32-bit value.
+ */
+static uint32_t loopback_random(spi_loopback_t *lb) {
+    uint32_t x = lb->random;
+    x ^= x << 13U;
+    x ^= x >> 17U;
+    x ^= x << 5U;
+    lb->random = x;
+    return x;
+}
+
+/**
+ * @brief Decides whether an event of a given probability happens.
+ *
+ * @param lb The simulated slave.
+ * @param ppm Probability in parts per million.
+ * @return Non-zero if the event happens.
+ */
+static int loopback_chance(spi_loopback_t *lb, uint32_t ppm) {
+    return (ppm != 0U) && ((loopback_random(lb) % 1000000U) < ppm);
+}
+
+/**
+ * @brief Flips a random bit of a byte at the configured bit error rate.
+ *
+ * @param lb The simulated slave.
+ * @param byte The byte as sent.
+ * @return The byte as received.
+ */
+static uint8_t loopback_corrupt(spi_loopback_t *lb, uint8_t byte) {
+    if (loopback_chance(lb, lb->params.bit_error_ppm * 8U)) {
+        byte ^= (uint8_t)(1U << (loopback_random(lb) % 8U));
+    }
+    return byte;
+}
+
+/**
+ * @brief Arms the edge timer for the oldest pending edge.
+ *
+ * @param lb The simulated slave.
+ */
+static void arm_edge_timer(spi_loopback_t *lb) {
+    struct itimerspec timer;
+
+    (void)memset(&timer, 0, sizeof(timer));
+    if (lb->edge_count > 0U) {
+        // A zero expiry would disarm the timer; any time in the past fires at once
+        uint64_t at = lb->edges[lb->edge_head];
+        at = (at == 0U) ? 1U : at;
+        timer.it_value.tv_sec = (time_t)(at / 1000000000ULL);
+        timer.it_value.tv_nsec = (long)(at % 1000000000ULL);
+    }
+    (void)timerfd_settime(lb->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/**
+ * @brief Queues the echo of a request and schedules the edge announcing it.
+ *
+ * @param lb The simulated slave.
+ * @param header The request header, from the start identifier to the length.
+ * @param header_length Length of the header, 5 or 6 bytes.
+ * @param payload The request payload.
+ * @param payload_size Size of the payload.
+ */
+static void queue_response(spi_loopback_t *lb, const uint8_t *header, size_t header_length, const uint8_t *payload,
+                           size_t payload_size) {
+    if (lb->frame_count == LOOPBACK_QUEUE_SIZE) {
+        return;  // Overrun: the slave has nowhere to put the response
+    }
+
+    loopback_frame_t *frame = &lb->frames[(lb->frame_head + lb->frame_count) % LOOPBACK_QUEUE_SIZE];
+    (void)memcpy(frame->data, header, header_length);
+    (void)memcpy(&frame->data[header_length], payload, payload_size);
+    size_t length = header_length + payload_size;
+    if (header[1] == LOOPBACK_V2) {
+        frame->data[length] = get_crc32_lsb_byte(&frame->data[2], length - 2U);
+    } else {
+        frame->data[length] = get_crc32_lsb_byte(payload, payload_size);
+    }
+    frame->data[length + 1U] = 0x0DU;
+    frame->data[length + 2U] = 0x0AU;
+    frame->length = length + 3U;
+
+    uint64_t delay_us = lb->params.latency_us;
+    if (lb->params.jitter_us != 0U) {
+        delay_us += loopback_random(lb) % (lb->params.jitter_us + 1U);
+    }
+    frame->ready_ns = loopback_now() + (delay_us * 1000U);
+    lb->frame_count++;
+
+    if (loopback_chance(lb, lb->params.edge_drop_ppm)) {
+        return;
+    }
+    lb->edges[(lb->edge_head + lb->edge_count) % LOOPBACK_QUEUE_SIZE] = frame->ready_ns;
+    lb->edge_count++;
+    if (lb->edge_count == 1U) {
+        arm_edge_timer(lb);
+    }
+}
+
+/**
+ * @brief Answers every valid request frame received while chip select was asserted.
+ *
+ * Bytes outside frames, such as the 0xFF clocked out on reads, are skipped.
+ * Frames with a bad CRC are ignored like the real slave does, and so are
+ * requests with the function ID the slave was told never to answer.
+ *
+ * @param lb The simulated slave.
+ */
+static void parse_requests(spi_loopback_t *lb) {
+    const uint8_t *mosi = lb->mosi;
+    size_t position = 0U;
+
+    while (position + 2U <= lb->mosi_length) {
+        const uint8_t *frame = &mosi[position];
+        if ((frame[0] != LOOPBACK_START) || ((frame[1] != LOOPBACK_V1) && (frame[1] != LOOPBACK_V2))) {
+            position++;
+            continue;
+        }
+
+        size_t header_length = (frame[1] == LOOPBACK_V2) ? 6U : 5U;
+        size_t available = lb->mosi_length - position;
+        if (available < header_length + 3U) {
+            break;
+        }
+        size_t payload_size = (size_t)frame[header_length - 2U] | ((size_t)frame[header_length - 1U] << 8U);
+        size_t frame_length = header_length + payload_size + 3U;
+        if ((payload_size > LOOPBACK_MAX_PAYLOAD) || (frame_length > available)) {
+            position++;
+            continue;
+        }
+
+        const uint8_t *payload = &frame[header_length];
+        uint8_t crc = (frame[1] == LOOPBACK_V2) ? get_crc32_lsb_byte(&frame[2], header_length - 2U + payload_size)
+                                                 : get_crc32_lsb_byte(payload, payload_size);
+        if ((crc != payload[payload_size]) || (payload[payload_size + 1U] != 0x0DU) ||
+            (payload[payload_size + 2U] != 0x0AU)) {
+            position++;
+            continue;
+        }
+
+        if ((int)frame[2] != lb->params.ignore_function_id) {
+            queue_response(lb, frame, header_length, payload, payload_size);
+        }
+        position += frame_length;
+    }
+}
+
+/**
+ * @brief Ends a chip select assertion.
+ *
+ * A frame whose shifting started is gone once chip select is released,
+ * whether or not the master clocked all of it. In stream mode the rest of
+ * the frame is shifted out on the next assertion.
+ *
+ * @param lb The simulated slave.
+ */
+static void deselect(spi_loopback_t *lb) {
+    if (lb->shifting && (lb->shift_offset > 0U) && !lb->params.stream) {
+        lb->frame_head = (lb->frame_head + 1U) % LOOPBACK_QUEUE_SIZE;
+        lb->frame_count--;
+    }
+    parse_requests(lb);
+    lb->selected = 0;
+    lb->shifting = 0;
+}
+
+/**
+ * @brief Exchanges one byte with the master.
+ *
+ * @param lb The simulated slave.
+ * @param mosi The byte sent by the master.
+ * @return The byte received by the master.
+ */
+static uint8_t exchange_byte(spi_loopback_t *lb, uint8_t mosi) {
+    uint8_t miso = 0xFFU;
+
+    if (!lb->selected) {
+        // The slave loads its oldest ready frame for reads; in duplex mode
+        // also for transfers that start with a request
+        lb->selected = 1;
+        lb->shift_offset = lb->params.stream ? lb->shift_offset : 0U;
+        lb->mosi_length = 0U;
+        lb->shifting = (lb->frame_count > 0U) && (lb->frames[lb->frame_head].ready_ns <= loopback_now()) &&
+                       (lb->params.duplex || (mosi != LOOPBACK_START));
+    }
+
+    if (lb->shifting) {
+        const loopback_frame_t *frame = &lb->frames[lb->frame_head];
+        if (lb->shift_offset < frame->length) {
+            miso = loopback_corrupt(lb, frame->data[lb->shift_offset]);
+        }
+        lb->shift_offset++;
+
+        if (lb->params.stream && (lb->shift_offset == frame->length)) {
+            // Continue with the next frame if the slave has it ready
+            lb->frame_head = (lb->frame_head + 1U) % LOOPBACK_QUEUE_SIZE;
+            lb->frame_count--;
+            lb->shift_offset = 0U;
+            lb->shifting = (lb->frame_count > 0U) && (lb->frames[lb->frame_head].ready_ns <= loopback_now());
+        }
+    }
+    if (lb->mosi_length < LOOPBACK_MOSI_SIZE) {
+        lb->mosi[lb->mosi_length++] = loopback_corrupt(lb, mosi);
+    }
+    return miso;
+}
+
+/**
+ * @brief Issues one SPI message to the simulated slave.
+ *
+ * @param priv The simulated slave.
+ * @param segments The transfer segments of the message.
+ * @param count Number of transfer segments.
+ * @return The bytes transferred.
+ */
+static int loopback_transfer(void *priv, struct spi_ioc_transfer *segments, size_t count) {
+    spi_loopback_t *lb = priv;
+    uint64_t bits = 0U;
+    int total = 0;
+
+    (void)pthread_mutex_lock(&lb->lock);
+    for (size_t i = 0U; i < count; i++) {
+        const uint8_t *tx = (const uint8_t *)(uintptr_t)segments[i].tx_buf;
+        uint8_t *rx = (uint8_t *)(uintptr_t)segments[i].rx_buf;
+
+        for (size_t k = 0U; k < segments[i].len; k++) {
+            uint8_t miso = exchange_byte(lb, (tx != NULL) ? tx[k] : 0U);
+            if (rx != NULL) {
+                rx[k] = miso;
+            }
+        }
+        bits += (uint64_t)segments[i].len * 8U;
+        total += (int)segments[i].len;
+
+        // cs_change releases chip select between segments, or keeps it after the last one
+        int last = (i + 1U == count);
+        if ((last && (segments[i].cs_change == 0U)) || (!last && (segments[i].cs_change != 0U))) {
+            deselect(lb);
+        }
+    }
+    uint32_t speed_hz = ((count > 0U) && (segments[0].speed_hz != 0U)) ? segments[0].speed_hz : lb->speed_hz;
+    int model_clock = lb->params.model_clock;
+    (void)pthread_mutex_unlock(&lb->lock);
+
+    if (model_clock && (speed_hz != 0U)) {
+        uint64_t ns = (bits * 1000000000ULL) / speed_hz;
+        struct timespec duration = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+        (void)clock_nanosleep(CLOCK_MONOTONIC, 0, &duration, NULL);
+    }
+    return total;
+}
+
+/**
+ * @brief Changes the default clock frequency of the simulated bus.
+ *
+ * @param priv The simulated slave.
+ * @param speed_hz The clock frequency in Hz.
+ * @return Always 0.
+ */
+static int loopback_set_speed(void *priv, uint32_t speed_hz) {
+    spi_loopback_t *lb = priv;
+    (void)pthread_mutex_lock(&lb->lock);
+    lb->speed_hz = speed_hz;
+    (void)pthread_mutex_unlock(&lb->lock);
+    return 0;
+}
+
+/**
+ * @brief Returns the file descriptor signalling virtual edges.
+ *
+ * @param priv The simulated slave.
+ * @return The edge timerfd.
+ */
+static int loopback_event_fd(void *priv) {
+    const spi_loopback_t *lb = priv;
+    return lb->timer_fd;
+}
+
+/**
+ * @brief Consumes the oldest virtual edges that have been raised.
+ *
+ * In stream mode every edge raised so far is consumed and reported as one,
+ * as the interrupt line stays high while the slave has data.
+ *
+ * @param priv The simulated slave.
+ * @param timestamps_ns Receives the times the edges were raised.
+ * @param max Maximum number of edges to consume.
+ * @return Number of edges consumed, 0 if none is raised yet.
+ */
+static int loopback_read_events(void *priv, uint64_t *timestamps_ns, unsigned int max) {
+    spi_loopback_t *lb = priv;
+    uint64_t expirations;
+    int ret = 0;
+
+    (void)pthread_mutex_lock(&lb->lock);
+    (void)read(lb->timer_fd, &expirations, sizeof(expirations));
+    uint64_t now = loopback_now();
+    while ((lb->edge_count > 0U) && (lb->edges[lb->edge_head] <= now) &&
+           (((unsigned int)ret < max) || lb->params.stream)) {
+        if (!lb->params.stream || (ret == 0)) {
+            timestamps_ns[ret++] = lb->edges[lb->edge_head];
+        }
+        lb->edge_head = (lb->edge_head + 1U) % LOOPBACK_QUEUE_SIZE;
+        lb->edge_count--;
+    }
+    arm_edge_timer(lb);
+    (void)pthread_mutex_unlock(&lb->lock);
+    return ret;
+}
+
+/**
+ * @brief Destroys a simulated slave.
+ *
+ * @param priv The simulated slave.
+ */
+static void loopback_close(void *priv) {
+    spi_loopback_t *lb = priv;
+    (void)close(lb->timer_fd);
+    (void)pthread_mutex_destroy(&lb->lock);
+    free(lb);
+}
+
+const spi_transport_ops_t spi_loopback_transport = {
+    .name = "loopback",
+    .transfer = loopback_transfer,
+    .set_speed = loopback_set_speed,
+    .event_fd = loopback_event_fd,
+    .read_events = loopback_read_events,
+    .close = loopback_close,
+};
+
+/**
+ * @brief Creates a simulated slave.
+ *
+ * @param params Behaviour of the slave, or NULL for the defaults.
+ * @param speed_hz Initial clock frequency, used when clock modelling is on.
+ * @return The transport state, or NULL on failure.
+ */
+void *spi_loopback_open(const spi_loopback_params_t *params, uint32_t speed_hz) {
+    spi_loopback_t *lb = calloc(1U, sizeof(*lb));
+    if (lb == NULL) {
+        return NULL;
+    }
+
+    if (params != NULL) {
+        lb->params = *params;
+    } else {
+        spi_loopback_params_init(&lb->params);
+    }
+    lb->speed_hz = speed_hz;
+    lb->random = (lb->params.seed != 0U) ? lb->params.seed : 1U;
+
+    lb->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (lb->timer_fd < 0) {
+        free(lb);
+        return NULL;
+    }
+    (void)pthread_mutex_init(&lb->lock, NULL);
+    return lb;
+}
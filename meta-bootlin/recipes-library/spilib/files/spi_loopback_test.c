@@ -0,0 +1,494 @@
+/**
+ * @file spi_loopback_test.c
+ * @brief Regression tests of the request engine over the loopback transport.
+ *
+ * The simulated slave echoes every request, so each response must carry the
+ * function ID, sequence and payload of the request it completes. Requests
+ * are run through every framing, read mode, pipeline depth, duplex mode and
+ * priority class; the priority scheduler, batches larger than the pipeline
+ * and bulk transfers are checked on top of that, including a transfer whose
+ * fragments reuse the sequence byte of a request the slave never answers.
+ */
+
+#include "spi_lib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_REQUESTS 600U
+#define TEST_PAYLOAD_MAX 64U
+#define TEST_BULK_SIZE 5000U
+#define TEST_BATCH_SIZE 10U
+#define TEST_BATCH_DEPTH 4U
+#define TEST_TIMEOUT_MS 1000
+#define TEST_SILENT_FUNCTION 0x7F  // Function ID the slave of test_bulk_aliasing() never answers
+#define TEST_SILENT_TIMEOUT_MS 500
+
+/**
+ * @brief What the response of an outstanding request must look like.
+ */
+typedef struct {
+    int pending;
+    uint16_t sequence;
+    uint8_t function_id;
+    uint16_t payload_size;
+    uint8_t payload[TEST_PAYLOAD_MAX];
+} expected_t;
+
+/**
+ * @brief Pipeline configuration of one run of test_requests().
+ */
+typedef struct {
+    const char *name;
+    spi_protocol_t protocol;
+    spi_read_mode_t read_mode;
+    unsigned int depth;
+    size_t duplex_window;
+} variant_t;
+
+static const variant_t variants[] = {
+    {"v1_fixed_depth1", SPI_PROTOCOL_V1, SPI_READ_FIXED, 1U, 0U},
+    {"v1_prefixed_depth4", SPI_PROTOCOL_V1, SPI_READ_LENGTH_PREFIXED, 4U, 0U},
+    {"v1_duplex_depth1", SPI_PROTOCOL_V1, SPI_READ_LENGTH_PREFIXED, 1U, 1100U},
+    {"v1_duplex_depth4", SPI_PROTOCOL_V1, SPI_READ_LENGTH_PREFIXED, 4U, 64U},
+    {"v2_prefixed_depth1", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 1U, 0U},
+    {"v2_prefixed_depth8", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 8U, 0U},
+    {"v2_duplex_depth1", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 1U, 1100U},
+    {"v2_duplex_depth8", SPI_PROTOCOL_V2, SPI_READ_LENGTH_PREFIXED, 8U, 64U},
+    {"v2_stream_depth8", SPI_PROTOCOL_V2, SPI_READ_STREAM, 8U, 0U},
+};
+
+static int failures;
+static expected_t expected[256];  // Indexed by the low byte of the sequence
+static unsigned int completed;
+static char order[64];            // Classes of the completed requests, in completion order
+static size_t order_length;
+static int bulk_done;
+static size_t bulk_size;
+static spi_error_t bulk_error;
+static int urgent_before_bulk;
+static int silent_calls;
+static spi_error_t silent_error;
+static uint16_t silent_sequence;
+static unsigned int echoes;
+
+/**
+ * @brief Records a failed check.
+ *
+ * @param condition The checked condition.
+ * @param what Description of the check, printed when it fails.
+ */
+static void check(int condition, const char *what) {
+    if (!condition) {
+        (void)fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * @brief Opens a context on an ideal loopback slave.
+ *
+ * @param stream Non-zero to let the slave stream responses back to back.
+ * @param duplex Non-zero to let the slave shift responses out during requests.
+ * @param ignore_function_id Function ID the slave never answers, -1 for none.
+ * @return The context, or NULL on error.
+ */
+static spi_ctx_t *open_loopback(int stream, int duplex, int ignore_function_id) {
+    spi_loopback_params_t loopback;
+    spi_config_t config;
+
+    spi_loopback_params_init(&loopback);
+    loopback.stream = stream;
+    loopback.duplex = duplex;
+    loopback.ignore_function_id = ignore_function_id;
+    spi_config_init(&config);
+    config.backend = SPI_BACKEND_LOOPBACK;
+    config.loopback = &loopback;
+    return spi_open(&config);
+}
+
+/**
+ * @brief Checks that a response is the echo of the request it completes.
+ *
+ * @param error Result of the request.
+ * @param response The response.
+ */
+static void check_echo(spi_error_t error, spi_response_t *response) {
+    expected_t *req = &expected[response->sequence & 0xFFU];
+
+    completed++;
+    if ((error != SPI_SUCCESS) || !req->pending || (response->sequence != req->sequence) ||
+        (response->unsolicited != 0U)) {
+        (void)fprintf(stderr, "sequence %u: error %d\n", response->sequence, (int)error);
+        check(0, "request completes with its own sequence");
+        return;
+    }
+    req->pending = 0;
+    if ((response->function_id != req->function_id) || (response->payload_size != req->payload_size) ||
+        ((req->payload_size > 0U) && (memcmp(response->payload, req->payload, req->payload_size) != 0))) {
+        (void)fprintf(stderr, "sequence %u: function ID 0x%02X, %u bytes\n", response->sequence,
+                      response->function_id, response->payload_size);
+        check(0, "response echoes the function ID and payload of its request");
+    }
+}
+
+/**
+ * @brief Waits until every request of a context has completed.
+ *
+ * @param ctx The device context.
+ */
+static void drain(spi_ctx_t *ctx) {
+    while (spi_pending_requests(ctx) > 0U) {
+        if (spi_process_responses(ctx, TEST_TIMEOUT_MS) < 0) {
+            check(0, "spi_process_responses() succeeds");
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Submits requests in every priority class and checks every response.
+ *
+ * Two normal requests are followed by a real-time one, so that the
+ * scheduler moves the latter ahead wherever responses are matched by
+ * sequence, and every third request after that is bulk.
+ *
+ * @param variant The pipeline configuration.
+ */
+static void test_requests(const variant_t *variant) {
+    static const spi_priority_t classes[] = {SPI_PRIORITY_NORMAL, SPI_PRIORITY_NORMAL, SPI_PRIORITY_REALTIME,
+                                             SPI_PRIORITY_BULK};
+    spi_ctx_t *ctx = open_loopback(variant->read_mode == SPI_READ_STREAM, variant->duplex_window > 0U, -1);
+    int failed = failures;
+
+    if (ctx == NULL) {
+        check(0, "loopback context opens");
+        return;
+    }
+    spi_set_protocol(ctx, variant->protocol);
+    (void)spi_set_read_mode(ctx, variant->read_mode);
+    spi_pipeline_set_depth(ctx, variant->depth);
+    spi_set_duplex(ctx, variant->duplex_window);
+    (void)memset(expected, 0, sizeof(expected));
+    completed = 0U;
+
+    for (unsigned int i = 0U; i < TEST_REQUESTS; i++) {
+        // The callback may run inside spi_submit(), so the request is staged first
+        uint16_t sequence = spi_next_sequence(ctx);
+        expected_t *req = &expected[sequence & 0xFFU];
+        req->sequence = sequence;
+        req->function_id = (uint8_t)(1U + (i % 200U));
+        req->payload_size = (uint16_t)(i % TEST_PAYLOAD_MAX);
+        for (uint16_t k = 0U; k < req->payload_size; k++) {
+            req->payload[k] = (uint8_t)(i + k);
+        }
+        req->pending = 1;
+
+        int ret;
+        while ((ret = spi_submit_priority(ctx, req->function_id, req->payload, req->payload_size, check_echo,
+                                          classes[i % 4U])) < 0) {
+            (void)spi_process_responses(ctx, TEST_TIMEOUT_MS);
+        }
+        check(ret == (int)sequence, "spi_submit_priority() returns the staged sequence");
+    }
+    drain(ctx);
+    spi_release(ctx);
+
+    check(completed == TEST_REQUESTS, "every request completes once");
+    (void)printf("%s: %s\n", variant->name, (failures == failed) ? "ok" : "FAILED");
+}
+
+/**
+ * @brief Sends a batch larger than the pipeline depth and checks every response.
+ *
+ * Each call may only take as many requests as in-flight slots are free; the
+ * rest is sent again once responses came in.
+ *
+ * @param protocol The framing protocol.
+ */
+static void test_batch(spi_protocol_t protocol) {
+    spi_request_t requests[TEST_BATCH_SIZE];
+    spi_ctx_t *ctx = open_loopback(0, 0, -1);
+    size_t sent = 0U;
+    int failed = failures;
+
+    if (ctx == NULL) {
+        check(0, "loopback context opens");
+        return;
+    }
+    spi_set_protocol(ctx, protocol);
+    (void)spi_set_read_mode(ctx, SPI_READ_LENGTH_PREFIXED);
+    spi_pipeline_set_depth(ctx, TEST_BATCH_DEPTH);
+    (void)memset(expected, 0, sizeof(expected));
+    (void)memset(requests, 0, sizeof(requests));
+    completed = 0U;
+
+    uint16_t first = spi_next_sequence(ctx);
+    for (size_t i = 0U; i < TEST_BATCH_SIZE; i++) {
+        expected_t *req = &expected[(uint16_t)(first + i) & 0xFFU];
+        req->sequence = (uint16_t)(first + i);
+        req->function_id = (uint8_t)(0x30U + i);
+        req->payload_size = (uint16_t)(1U + i);
+        for (uint16_t k = 0U; k < req->payload_size; k++) {
+            req->payload[k] = (uint8_t)((i << 4U) + k);
+        }
+        req->pending = 1;
+        requests[i].function_id = req->function_id;
+        requests[i].payload = req->payload;
+        requests[i].payload_size = req->payload_size;
+        requests[i].callback = check_echo;
+        requests[i].cs_change = 1U;
+    }
+
+    while (sent < TEST_BATCH_SIZE) {
+        uint16_t sequence;
+        int accepted = spi_send_batch(ctx, &requests[sent], TEST_BATCH_SIZE - sent, &sequence);
+        if (accepted < 0) {
+            check(0, "spi_send_batch() succeeds");
+            break;
+        }
+        check(accepted <= (int)TEST_BATCH_DEPTH, "a batch holds no more requests than the pipeline depth");
+        check((accepted == 0) || (sequence == (uint16_t)(first + sent)), "batch requests get consecutive tags");
+        sent += (size_t)accepted;
+        (void)spi_process_responses(ctx, TEST_TIMEOUT_MS);
+    }
+    drain(ctx);
+    spi_release(ctx);
+
+    check(completed == TEST_BATCH_SIZE, "every batched request completes once");
+    (void)printf("batch_%s: %s\n", (protocol == SPI_PROTOCOL_V2) ? "v2" : "v1", (failures == failed) ? "ok" : "FAILED");
+}
+
+/**
+ * @brief Records the class of a completed request of test_priorities().
+ *
+ * @param error Result of the request.
+ * @param response The response.
+ */
+static void record_class(spi_error_t error, spi_response_t *response) {
+    if ((error == SPI_SUCCESS) && (order_length < sizeof(order) - 1U)) {
+        order[order_length++] = (char)response->function_id;
+    }
+}
+
+/**
+ * @brief Checks that queued requests leave in class order and that queueing delay is recorded.
+ *
+ * With a pipeline depth of two, the first bulk request takes the one slot
+ * bulk requests may use and the first normal request the other; the rest
+ * wait in the queue and must go out real-time first, then normal, then bulk.
+ */
+static void test_priorities(void) {
+    static const uint8_t payload[4] = {1, 2, 3, 4};
+    spi_ctx_t *ctx = open_loopback(0, 0, -1);
+    spi_stats_t stats;
+
+    if (ctx == NULL) {
+        check(0, "loopback context opens");
+        return;
+    }
+    spi_set_protocol(ctx, SPI_PROTOCOL_V2);
+    (void)spi_set_read_mode(ctx, SPI_READ_LENGTH_PREFIXED);
+    spi_pipeline_set_depth(ctx, 2U);
+    order_length = 0U;
+
+    for (int i = 0; i < 10; i++) {
+        (void)spi_submit_priority(ctx, 'B', payload, sizeof(payload), record_class, SPI_PRIORITY_BULK);
+    }
+    for (int i = 0; i < 5; i++) {
+        (void)spi_submit(ctx, 'N', payload, sizeof(payload), record_class);
+    }
+    for (int i = 0; i < 3; i++) {
+        (void)spi_submit_priority(ctx, 'R', payload, sizeof(payload), record_class, SPI_PRIORITY_REALTIME);
+    }
+    check(spi_submit_priority(ctx, 'R', payload, sizeof(payload), record_class, (spi_priority_t)SPI_PRIORITY_CLASSES) < 0,
+          "spi_submit_priority() rejects an unknown class");
+    drain(ctx);
+    spi_get_stats(ctx, &stats);
+    spi_release(ctx);
+
+    order[order_length] = '\0';
+    if (strcmp(order, "BNRRRNNNNBBBBBBBBB") != 0) {
+        (void)fprintf(stderr, "completion order %s\n", order);
+        check(0, "queued requests leave real-time first, then normal, then bulk");
+    }
+    check((stats.queue_ns[SPI_PRIORITY_REALTIME].count == 3U) && (stats.queue_ns[SPI_PRIORITY_NORMAL].count == 5U) &&
+          (stats.queue_ns[SPI_PRIORITY_BULK].count == 10U), "queueing delay is recorded per class");
+    (void)printf("priorities: %s\n", order);
+}
+
+/**
+ * @brief Records the outcome of the transfer of test_bulk().
+ *
+ * @param error Result of the transfer.
+ * @param response The reassembled response.
+ */
+static void record_bulk(spi_error_t error, spi_bulk_response_t *response) {
+    bulk_done++;
+    bulk_error = error;
+    bulk_size = response->size;
+}
+
+/**
+ * @brief Counts the real-time requests of test_bulk() completed before the transfer.
+ *
+ * @param error Result of the request.
+ * @param response The response.
+ */
+static void record_urgent(spi_error_t error, spi_response_t *response) {
+    (void)response;
+    if ((error == SPI_SUCCESS) && (bulk_done == 0)) {
+        urgent_before_bulk++;
+    }
+}
+
+/**
+ * @brief Runs a bulk transfer with real-time requests interleaved between its fragments.
+ *
+ * The echoing slave answers every fragment with its own data, so the
+ * reassembled response equals the request data.
+ */
+static void test_bulk(void) {
+    static uint8_t data[TEST_BULK_SIZE];
+    static uint8_t response[TEST_BULK_SIZE];
+    static const uint8_t payload[2] = {0xA5, 0x5A};
+    spi_ctx_t *ctx = open_loopback(0, 0, -1);
+    int failed = failures;
+
+    if (ctx == NULL) {
+        check(0, "loopback context opens");
+        return;
+    }
+    spi_set_protocol(ctx, SPI_PROTOCOL_V2);
+    (void)spi_set_read_mode(ctx, SPI_READ_LENGTH_PREFIXED);
+    spi_pipeline_set_depth(ctx, 4U);
+    for (size_t i = 0U; i < sizeof(data); i++) {
+        data[i] = (uint8_t)((i * 7U) + (i >> 8U));
+    }
+    bulk_done = 0;
+    urgent_before_bulk = 0;
+
+    check(spi_submit_bulk(ctx, 0x42, data, sizeof(data), response, sizeof(response), record_bulk) == 0,
+          "spi_submit_bulk() accepts the transfer");
+    for (int i = 0; (i < 3) && (spi_pending_requests(ctx) > 0U); i++) {
+        check(spi_submit_priority(ctx, 0x21, payload, sizeof(payload), record_urgent, SPI_PRIORITY_REALTIME) >= 0,
+              "real-time request is accepted during the transfer");
+        (void)spi_process_responses(ctx, TEST_TIMEOUT_MS);
+    }
+    drain(ctx);
+    spi_release(ctx);
+
+    check((bulk_done == 1) && (bulk_error == SPI_SUCCESS), "bulk transfer completes once");
+    check((bulk_size == sizeof(data)) && (memcmp(response, data, sizeof(data)) == 0),
+          "bulk response is reassembled in order");
+    check(urgent_before_bulk == 3, "real-time requests complete between fragments");
+    (void)printf("bulk: %s\n", (failures == failed) ? "ok" : "FAILED");
+}
+
+/**
+ * @brief Records the outcome of the unanswered request of test_bulk_aliasing().
+ *
+ * @param error Result of the request.
+ * @param response The response.
+ */
+static void record_silent(spi_error_t error, spi_response_t *response) {
+    silent_calls++;
+    silent_error = error;
+    silent_sequence = response->sequence;
+}
+
+/**
+ * @brief Counts the ordinary requests of test_bulk_aliasing() that were answered.
+ *
+ * @param error Result of the request.
+ * @param response The response.
+ */
+static void count_echo(spi_error_t error, spi_response_t *response) {
+    (void)response;
+    if (error == SPI_SUCCESS) {
+        echoes++;
+    }
+}
+
+/**
+ * @brief Runs a bulk transfer while a request stays outstanding across 256 sequence tags.
+ *
+ * The slave never answers the first request. Ordinary requests then move
+ * the next tag 254 past it, so that a fragment of the transfer is handed
+ * the unanswered request's tag plus 256. That fragment must wait until the
+ * request times out, the request must fail through its own callback and the
+ * transfer must still complete with the right data.
+ */
+static void test_bulk_aliasing(void) {
+    static uint8_t data[TEST_BULK_SIZE];
+    static uint8_t response[TEST_BULK_SIZE];
+    static const uint8_t payload[2] = {0xA5, 0x5A};
+    spi_ctx_t *ctx = open_loopback(0, 0, TEST_SILENT_FUNCTION);
+    unsigned int ordinary = 0U;
+    int failed = failures;
+
+    if (ctx == NULL) {
+        check(0, "loopback context opens");
+        return;
+    }
+    spi_set_protocol(ctx, SPI_PROTOCOL_V2);
+    (void)spi_set_read_mode(ctx, SPI_READ_LENGTH_PREFIXED);
+    spi_pipeline_set_depth(ctx, 4U);
+    spi_set_request_timeout(ctx, TEST_SILENT_TIMEOUT_MS);
+    for (size_t i = 0U; i < sizeof(data); i++) {
+        data[i] = (uint8_t)((i * 13U) + (i >> 8U));
+    }
+    bulk_done = 0;
+    silent_calls = 0;
+    echoes = 0U;
+
+    int silent = spi_submit(ctx, TEST_SILENT_FUNCTION, payload, sizeof(payload), record_silent);
+    check(silent >= 0, "unanswered request is accepted");
+    while ((silent >= 0) && ((uint16_t)(spi_next_sequence(ctx) - (uint16_t)silent) < 254U)) {
+        if (spi_submit(ctx, 0x21, payload, sizeof(payload), count_echo) >= 0) {
+            ordinary++;
+        } else {
+            (void)spi_process_responses(ctx, TEST_TIMEOUT_MS);
+        }
+    }
+    // Leave only the unanswered request pending, so that the transfer is not refused for a full queue
+    while (spi_pending_requests(ctx) > 1U) {
+        (void)spi_process_responses(ctx, TEST_TIMEOUT_MS);
+    }
+    // The fragment behind the unanswered request waits out its deadline
+    spi_set_request_timeout(ctx, 0);
+    check(spi_submit_bulk(ctx, 0x42, data, sizeof(data), response, sizeof(response), record_bulk) == 0,
+          "spi_submit_bulk() accepts the transfer");
+    drain(ctx);
+    spi_release(ctx);
+
+    check((silent_calls == 1) && (silent_error == SPI_ERROR_TIMEOUT) && (silent_sequence == (uint16_t)silent),
+          "unanswered request times out through its own callback");
+    check(echoes == ordinary, "every ordinary request is answered");
+    check((bulk_done == 1) && (bulk_error == SPI_SUCCESS), "bulk transfer completes once");
+    check((bulk_size == sizeof(data)) && (memcmp(response, data, sizeof(data)) == 0),
+          "bulk response is reassembled in order");
+    (void)printf("bulk_aliasing: %s\n", (failures == failed) ? "ok" : "FAILED");
+}
+
+/**
+ * @brief Runs every test.
+ *
+ * @return 0 if all checks passed, 1 otherwise.
+ */
+int main(void) {
+    for (size_t v = 0U; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        test_requests(&variants[v]);
+    }
+    test_priorities();
+    test_batch(SPI_PROTOCOL_V1);
+    test_batch(SPI_PROTOCOL_V2);
+    test_bulk();
+    test_bulk_aliasing();
+
+    if (failures != 0) {
+        (void)fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    (void)printf("All loopback checks passed\n");
+    return 0;
+}
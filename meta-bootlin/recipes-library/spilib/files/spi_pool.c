@@ -0,0 +1,88 @@
+#include "spi_pool.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define ALIGN_UP(value, align) (((value) + (align) - 1U) & ~((size_t)(align) - 1U))
+
+/**
+ * @brief Maps and locks the buffers of a pool.
+ *
+ * The mapping holds the transmit filler and the buffers, in that order. It
+ * is page aligned and the filler is padded to whole pages, so the filler can
+ * be write-protected on its own and every buffer starts on a cache line.
+ *
+ * @param pool The pool to create.
+ * @param count Number of buffers.
+ * @param buffer_size Size of each buffer, rounded up to SPI_POOL_ALIGN.
+ * @param fill_size Size of the 0xFF transmit filler.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_pool_create(spi_pool_t *pool, size_t count, size_t buffer_size, size_t fill_size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t fill_stride = ALIGN_UP(fill_size, page_size);
+    size_t buffer_stride = ALIGN_UP(buffer_size, SPI_POOL_ALIGN);
+
+    (void)memset(pool, 0, sizeof(*pool));
+    pool->region_size = fill_stride + (count * buffer_stride);
+    pool->region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pool->region == MAP_FAILED) {
+        pool->region = NULL;
+        return -1;
+    }
+
+    // MAP_POPULATE already faulted every page in; mlock() keeps them resident
+    pool->locked = (mlock(pool->region, pool->region_size) == 0);
+
+    uint8_t *base = pool->region;
+    pool->tx_fill = base;
+    pool->fill_size = fill_size;
+    (void)memset(pool->tx_fill, 0xFF, fill_size);
+    // spidev only reads the transmit buffers; a stray write must fault, not
+    // silently clock garbage out on the next read
+    if ((fill_stride > 0U) && (mprotect(pool->tx_fill, fill_stride, PROT_READ) < 0)) {
+        int saved_errno = errno;
+        spi_pool_destroy(pool);
+        errno = saved_errno;
+        return -1;
+    }
+
+    pool->buffer_size = buffer_stride;
+    pool->next = &base[fill_stride];
+    pool->remaining = count;
+    return 0;
+}
+
+/**
+ * @brief Unmaps the buffers of a pool.
+ *
+ * @param pool The pool to destroy.
+ */
+void spi_pool_destroy(spi_pool_t *pool) {
+    if (pool->region == NULL) {
+        return;
+    }
+    if (pool->locked) {
+        (void)munlock(pool->region, pool->region_size);
+    }
+    (void)munmap(pool->region, pool->region_size);
+    (void)memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Takes the next buffer from the pool.
+ *
+ * @param pool The pool to take the buffer from.
+ * @return The buffer, or NULL with errno set when the pool is exhausted.
+ */
+uint8_t *spi_pool_get(spi_pool_t *pool) {
+    if (pool->remaining == 0U) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint8_t *buffer = pool->next;
+    pool->next += pool->buffer_size;
+    pool->remaining--;
+    return buffer;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file spi_pool.h
+ * @brief Internal interface of the frame buffer pool owned by a device context.
+ *
+ * All buffers of a context come from one anonymous mapping that is locked in
+ * RAM, so the real-time paths never take a page fault and the spidev driver
+ * always gets cache-line aligned buffers to map for DMA. The buffers are
+ * carved out once when the context is set up and stay with their owner (a
+ * ring slot, the response buffer, ...), which reuses them for every frame;
+ * nothing is allocated or returned while transfers run.
+ */
+
+#ifndef SPI_POOL_H
+#define SPI_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPI_POOL_ALIGN 64U  // Cache line size of the Cortex-A7
+
+/**
+ * @brief A set of equally sized, aligned and page-locked buffers.
+ */
+typedef struct {
+    void *region;           // Backing mapping of every buffer
+    size_t region_size;
+    uint8_t *tx_fill;       // Stream of 0xFF clocked out while reading, on write-protected pages
+    size_t fill_size;
+    uint8_t *next;          // First buffer not handed out yet
+    size_t remaining;       // Number of buffers not handed out yet
+    size_t buffer_size;     // Usable size of each buffer
+    int locked;             // Non-zero if mlock() succeeded
+} spi_pool_t;
+
+/**
+ * @brief Maps and locks the buffers of a pool.
+ *
+ * Failing to lock the mapping is not fatal: the pool still works, only
+ * without the page fault guarantee. The transmit filler occupies whole pages
+ * of its own that are made read-only once filled.
+ *
+ * @param pool The pool to create.
+ * @param count Number of buffers.
+ * @param buffer_size Size of each buffer, rounded up to SPI_POOL_ALIGN.
+ * @param fill_size Size of the 0xFF transmit filler.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int spi_pool_create(spi_pool_t *pool, size_t count, size_t buffer_size, size_t fill_size);
+
+/**
+ * @brief Unmaps the buffers of a pool.
+ *
+ * @param pool The pool to destroy.
+ */
+void spi_pool_destroy(spi_pool_t *pool);
+
+/**
+ * @brief Takes the next buffer from the pool.
+ *
+ * Buffers are handed out once, while the context is being set up, and go
+ * back to the system with the whole pool in spi_pool_destroy().
+ *
+ * @param pool The pool to take the buffer from.
+ * @return The buffer, or NULL with errno set when the pool is exhausted.
+ */
+uint8_t *spi_pool_get(spi_pool_t *pool);
+
+#endif // SPI_POOL_H
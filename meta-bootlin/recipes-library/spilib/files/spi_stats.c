@@ -0,0 +1,198 @@
+#include "spi_stats.h"
+#include <string.h>
+
+#define HIST_SUB_BITS 4U
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+#define LABELS_SIZE 256U  // Labels of one summary sample
+
+/**
+ * @brief Maps a value to its histogram bucket.
+ *
+ * Values below 16 have a bucket each; above, the bucket is given by the
+ * position of the leading one bit and the four bits that follow it.
+ *
+ * @param value The value to map.
+ * @return The bucket index, values past the range land in the last bucket.
+ */
+static size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return (size_t)value;
+    }
+    unsigned int exponent = 63U - (unsigned int)__builtin_clzll(value);
+    size_t index = ((size_t)(exponent - HIST_SUB_BITS + 1U) * HIST_SUB_COUNT) +
+                   (size_t)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1U));
+    return (index < SPI_HIST_BUCKETS) ? index : (SPI_HIST_BUCKETS - 1U);
+}
+
+/**
+ * @brief Returns the highest value that maps to a bucket.
+ *
+ * @param index The bucket index.
+ * @return The upper bound of the bucket.
+ */
+static uint64_t hist_upper_bound(size_t index) {
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    unsigned int shift = (unsigned int)(index / HIST_SUB_COUNT) - 1U;
+    uint64_t lower = (uint64_t)(HIST_SUB_COUNT + (index % HIST_SUB_COUNT)) << shift;
+    return lower + (1ULL << shift) - 1U;
+}
+
+/**
+ * @brief Adds one value to a histogram.
+ *
+ * @param hist The histogram to update.
+ * @param value_ns The value in nanoseconds.
+ */
+void spi_hist_record(spi_histogram_t *hist, uint64_t value_ns) {
+    if ((hist->count == 0U) || (value_ns < hist->min_ns)) {
+        hist->min_ns = value_ns;
+    }
+    if (value_ns > hist->max_ns) {
+        hist->max_ns = value_ns;
+    }
+    hist->count++;
+    hist->sum_ns += value_ns;
+    hist->buckets[hist_index(value_ns)]++;
+}
+
+/**
+ * @brief Returns a percentile of a histogram.
+ *
+ * @param hist The histogram to query.
+ * @param percentile The percentile, from 0.0 to 100.0.
+ * @return The value in nanoseconds, 0 for an empty histogram.
+ */
+uint64_t spi_histogram_percentile(const spi_histogram_t *hist, double percentile) {
+    if (hist->count == 0U) {
+        return 0U;
+    }
+    if (percentile >= 100.0) {
+        return hist->max_ns;
+    }
+
+    uint64_t rank = (uint64_t)((percentile / 100.0) * (double)hist->count);
+    if (rank < 1U) {
+        rank = 1U;
+    }
+
+    uint64_t seen = 0U;
+    for (size_t i = 0U; i < SPI_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = hist_upper_bound(i);
+            return (value < hist->max_ns) ? value : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+/**
+ * @brief Clears every counter and histogram.
+ *
+ * @param stats The statistics to clear.
+ */
+void spi_stats_clear(spi_stats_t *stats) {
+    (void)memset(stats, 0, sizeof(*stats));
+}
+
+/**
+ * @brief Writes the samples of one histogram of a Prometheus summary.
+ *
+ * @param out The stream to write to.
+ * @param name The metric name.
+ * @param labels The labels of the samples, without braces.
+ * @param hist The histogram to write.
+ */
+static void write_summary_samples(FILE *out, const char *name, const char *labels, const spi_histogram_t *hist) {
+    static const double quantiles[] = {50.0, 90.0, 99.0, 99.9, 100.0};
+
+    for (size_t i = 0U; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        (void)fprintf(out, "%s{%s,quantile=\"%g\"} %llu\n", name, labels, quantiles[i] / 100.0,
+                      (unsigned long long)spi_histogram_percentile(hist, quantiles[i]));
+    }
+    (void)fprintf(out, "%s_sum{%s} %llu\n", name, labels, (unsigned long long)hist->sum_ns);
+    (void)fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)hist->count);
+}
+
+/**
+ * @brief Writes one histogram as a Prometheus summary.
+ *
+ * @param out The stream to write to.
+ * @param name The metric name.
+ * @param help The metric description.
+ * @param hist The histogram to write.
+ * @param device The device label.
+ */
+static void write_summary(FILE *out, const char *name, const char *help, const spi_histogram_t *hist,
+                          const char *device) {
+    char labels[LABELS_SIZE];
+
+    (void)snprintf(labels, sizeof(labels), "device=\"%s\"", device);
+    (void)fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    write_summary_samples(out, name, labels, hist);
+}
+
+/**
+ * @brief Writes the queueing delay of every priority class as one Prometheus summary.
+ *
+ * @param out The stream to write to.
+ * @param stats The statistics to write.
+ * @param device The device label.
+ */
+static void write_queue_summary(FILE *out, const spi_stats_t *stats, const char *device) {
+    static const char *const classes[SPI_PRIORITY_CLASSES] = {"realtime", "normal", "bulk"};
+    const char *name = "spilib_queue_ns";
+    char labels[LABELS_SIZE];
+
+    (void)fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, "Submission to transmission of a request", name);
+    for (size_t i = 0U; i < SPI_PRIORITY_CLASSES; i++) {
+        (void)snprintf(labels, sizeof(labels), "device=\"%s\",class=\"%s\"", device, classes[i]);
+        write_summary_samples(out, name, labels, &stats->queue_ns[i]);
+    }
+}
+
+/**
+ * @brief Writes one counter.
+ *
+ * @param out The stream to write to.
+ * @param name The metric name.
+ * @param help The metric description.
+ * @param value The counter value.
+ * @param device The device label.
+ */
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value, const char *device) {
+    (void)fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    (void)fprintf(out, "%s{device=\"%s\"} %llu\n", name, device, (unsigned long long)value);
+}
+
+/**
+ * @brief Writes statistics in the Prometheus text exposition format.
+ *
+ * @param out The stream to write to.
+ * @param stats The statistics to write.
+ * @param device The spidev node, used as the device label.
+ * @return 0 on success, -1 on write error.
+ */
+int spi_stats_write_text(FILE *out, const spi_stats_t *stats, const char *device) {
+    write_counter(out, "spilib_requests_total", "Requests transmitted", stats->requests, device);
+    write_counter(out, "spilib_responses_total", "Requests completed successfully", stats->responses, device);
+    write_counter(out, "spilib_crc_errors_total", "Frames failing the CRC check", stats->crc_errors, device);
+    write_counter(out, "spilib_format_errors_total", "Malformed frames", stats->format_errors, device);
+    write_counter(out, "spilib_timeouts_total", "Requests past their deadline", stats->timeouts, device);
+    write_counter(out, "spilib_unsolicited_total", "Frames matching no request", stats->unsolicited, device);
+    write_counter(out, "spilib_transfers_total", "SPI_IOC_MESSAGE ioctls", stats->transfers, device);
+    write_counter(out, "spilib_transfer_errors_total", "Failed SPI_IOC_MESSAGE ioctls", stats->transfer_errors, device);
+    write_counter(out, "spilib_tx_bytes_total", "Request frame bytes sent", stats->bytes_tx, device);
+    write_counter(out, "spilib_rx_bytes_total", "Response frame bytes received", stats->bytes_rx, device);
+    write_counter(out, "spilib_stream_resyncs_total", "Stream candidate frames rejected", stats->resyncs, device);
+    write_counter(out, "spilib_slow_wakeups_total", "Wakeups over the slow wakeup threshold", stats->slow_wakeups, device);
+    write_summary(out, "spilib_transfer_ns", "Duration of SPI_IOC_MESSAGE ioctls", &stats->transfer_ns, device);
+    write_summary(out, "spilib_edge_to_read_ns", "GPIO edge to response frame read", &stats->edge_to_read_ns, device);
+    write_summary(out, "spilib_wakeup_ns", "GPIO edge to the servicing thread running", &stats->wakeup_ns, device);
+    write_summary(out, "spilib_request_ns", "Submission to completion of a request", &stats->request_ns, device);
+    write_summary(out, "spilib_callback_ns", "Time spent in request callbacks", &stats->callback_ns, device);
+    write_queue_summary(out, stats, device);
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file spi_stats.h
+ * @brief Internal interface of the statistics kept per device context.
+ *
+ * Histograms are log-linear in the style of HdrHistogram: every power of two
+ * is split into 16 linear sub-buckets, so any recorded value is known to
+ * within 1/16 (6.25 %) over the whole range from 1 ns to about 18 minutes.
+ */
+
+#ifndef SPI_STATS_H
+#define SPI_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "spi_lib.h"
+
+/**
+ * @brief Adds one value to a histogram.
+ *
+ * @param hist The histogram to update.
+ * @param value_ns The value in nanoseconds.
+ */
+void spi_hist_record(spi_histogram_t *hist, uint64_t value_ns);
+
+/**
+ * @brief Clears every counter and histogram.
+ *
+ * @param stats The statistics to clear.
+ */
+void spi_stats_clear(spi_stats_t *stats);
+
+/**
+ * @brief Writes statistics in the Prometheus text exposition format.
+ *
+ * @param out The stream to write to.
+ * @param stats The statistics to write.
+ * @param device The spidev node, used as the device label.
+ * @return 0 on success, -1 on write error.
+ */
+int spi_stats_write_text(FILE *out, const spi_stats_t *stats, const char *device);
+
+#endif // SPI_STATS_H
@@ -0,0 +1,120 @@
+#include "spi_stream.h"
+#include "spi_frame.h"
+#include <string.h>
+
+#define STREAM_START_BYTE 0x48U  // First byte of both start identifiers
+#define STREAM_TRAILER_SIZE 3U   // CRC and stop identifier
+
+/**
+ * @brief Initializes a reassembler on a buffer.
+ *
+ * @param stream The reassembler to initialize.
+ * @param buffer The reassembly buffer.
+ * @param size Size of the buffer, SPI_STREAM_CARRY_MAX plus the largest chunk.
+ */
+void spi_stream_init(spi_stream_t *stream, uint8_t *buffer, size_t size) {
+    stream->buffer = buffer;
+    stream->size = size;
+    stream->length = 0U;
+    stream->resyncs = 0U;
+}
+
+/**
+ * @brief Discards the bytes carried over, e.g. after a failed transfer.
+ *
+ * @param stream The reassembler to reset.
+ */
+void spi_stream_reset(spi_stream_t *stream) {
+    stream->length = 0U;
+}
+
+/**
+ * @brief Returns where the next chunk has to be read to.
+ *
+ * @param stream The reassembler.
+ * @param space Set to the number of bytes available behind the carried ones.
+ * @return The position right behind the carried bytes.
+ */
+uint8_t *spi_stream_tail(spi_stream_t *stream, size_t *space) {
+    *space = stream->size - stream->length;
+    return &stream->buffer[stream->length];
+}
+
+/**
+ * @brief Scans a chunk read to spi_stream_tail() for frames.
+ *
+ * @param stream The reassembler.
+ * @param protocol The framing protocol of the stream.
+ * @param received Number of bytes read to spi_stream_tail().
+ * @param sink Called for every valid frame, in stream order.
+ * @param arg Passed to the sink.
+ * @return Number of frames passed to the sink.
+ */
+size_t spi_stream_feed(spi_stream_t *stream, spi_protocol_t protocol, size_t received, spi_stream_sink_t sink,
+                       void *arg) {
+    uint8_t *data = stream->buffer;
+    size_t length = stream->length + received;
+    uint8_t second = (protocol == SPI_PROTOCOL_V2) ? 0x5BU : 0x5AU;
+    size_t header_length = (protocol == SPI_PROTOCOL_V2) ? 6U : 5U;
+    size_t position = 0U;
+    size_t frames = 0U;
+
+    while (position < length) {
+        const uint8_t *start = memchr(&data[position], STREAM_START_BYTE, length - position);
+        if (start == NULL) {
+            // Idle filler or garbage only; nothing worth carrying over
+            position = length;
+            break;
+        }
+        position = (size_t)(start - data);
+
+        // Keep an incomplete header, it may be completed by the next chunk
+        size_t available = length - position;
+        if ((available < 2U) || ((data[position + 1U] == second) && (available < header_length))) {
+            break;
+        }
+        if (data[position + 1U] != second) {
+            position++;
+            continue;
+        }
+
+        size_t payload_size = (size_t)data[position + header_length - 2U] |
+                              ((size_t)data[position + header_length - 1U] << 8U);
+        size_t frame_length = header_length + payload_size + STREAM_TRAILER_SIZE;
+        if (frame_length > SPI_FRAME_MAX_SIZE) {
+            stream->resyncs++;
+            position++;
+            continue;
+        }
+        if (available < frame_length) {
+            break;
+        }
+
+        spi_response_t response;
+        if (spi_frame_decode(protocol, &data[position], frame_length, &response) != SPI_SUCCESS) {
+            stream->resyncs++;
+            position++;
+            continue;
+        }
+        sink(arg, &data[position], frame_length, &response);
+        frames++;
+        position += frame_length;
+    }
+
+    // What is left starts with a start identifier and is shorter than a frame
+    stream->length = length - position;
+    if ((stream->length > 0U) && (position > 0U)) {
+        (void)memmove(data, &data[position], stream->length);
+    }
+    return frames;
+}
+
+/**
+ * @brief Checks whether a frame was cut off by the end of the last chunk.
+ *
+ * @param stream The reassembler.
+ * @return Non-zero if the carried bytes start with a complete start identifier.
+ */
+int spi_stream_pending(const spi_stream_t *stream) {
+    return stream->length >= 2U;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file spi_stream.h
+ * @brief Internal interface of the frame reassembler used in SPI_READ_STREAM mode.
+ *
+ * In stream mode the slave shifts out frames back to back and the master
+ * clocks them in in chunks that need not line up with frame boundaries. The
+ * reassembler keeps the chunks in one buffer: every chunk is read right
+ * behind the bytes carried over from the previous one, so a frame spanning
+ * two reads is validated in place without being copied together.
+ */
+
+#ifndef SPI_STREAM_H
+#define SPI_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spi_lib.h"
+
+#define SPI_STREAM_CARRY_MAX 1032U  // Longest partial frame: a v2 frame short of its last byte
+
+/**
+ * @brief Called for every frame the reassembler finds in the stream.
+ *
+ * @param arg The argument passed to spi_stream_feed().
+ * @param frame Start of the frame; only valid until the callback returns.
+ * @param length Total size of the frame.
+ * @param response The parsed frame; its payload points into frame.
+ */
+typedef void (*spi_stream_sink_t)(void *arg, const uint8_t *frame, size_t length, spi_response_t *response);
+
+/**
+ * @brief Reassembly state of one stream.
+ */
+typedef struct {
+    uint8_t *buffer;    // Carried bytes followed by the chunk being read
+    size_t size;        // SPI_STREAM_CARRY_MAX plus the largest chunk
+    size_t length;      // Bytes carried over from the previous chunk
+    uint64_t resyncs;   // Candidate frames rejected, each costing a rescan
+} spi_stream_t;
+
+/**
+ * @brief Initializes a reassembler on a buffer.
+ *
+ * @param stream The reassembler to initialize.
+ * @param buffer The reassembly buffer.
+ * @param size Size of the buffer, SPI_STREAM_CARRY_MAX plus the largest chunk.
+ */
+void spi_stream_init(spi_stream_t *stream, uint8_t *buffer, size_t size);
+
+/**
+ * @brief Discards the bytes carried over, e.g. after a failed transfer.
+ *
+ * @param stream The reassembler to reset.
+ */
+void spi_stream_reset(spi_stream_t *stream);
+
+/**
+ * @brief Returns where the next chunk has to be read to.
+ *
+ * @param stream The reassembler.
+ * @param space Set to the number of bytes available behind the carried ones.
+ * @return The position right behind the carried bytes.
+ */
+uint8_t *spi_stream_tail(spi_stream_t *stream, size_t *space);
+
+/**
+ * @brief Scans a chunk read to spi_stream_tail() for frames.
+ *
+ * The reassembler looks for the start identifier of the protocol and
+ * validates every candidate. Bytes between frames, such as the idle filler
+ * the slave shifts out when it has nothing to send, are skipped. A candidate
+ * that fails validation is counted as a resync and scanning resumes one byte
+ * after its start identifier, so a corrupted frame or a start identifier
+ * occurring in garbage costs no more than the bytes it spans. A frame cut
+ * off by the end of the chunk is carried over to the next one.
+ *
+ * @param stream The reassembler.
+ * @param protocol The framing protocol of the stream.
+ * @param received Number of bytes read to spi_stream_tail().
+ * @param sink Called for every valid frame, in stream order.
+ * @param arg Passed to the sink.
+ * @return Number of frames passed to the sink.
+ */
+size_t spi_stream_feed(spi_stream_t *stream, spi_protocol_t protocol, size_t received, spi_stream_sink_t sink,
+                       void *arg);
+
+/**
+ * @brief Checks whether a frame was cut off by the end of the last chunk.
+ *
+ * @param stream The reassembler.
+ * @return Non-zero if the carried bytes start with a complete start identifier.
+ */
+int spi_stream_pending(const spi_stream_t *stream);
+
+#endif // SPI_STREAM_H
@@ -0,0 +1,47 @@
+/**
+ * @file spi_transport.h
+ * @brief Internal interface between a device context and its SPI slave.
+ *
+ * A transport moves SPI messages and delivers the rising edges of the
+ * interrupt line. The spidev transport lives in spi_lib.c; the loopback
+ * transport simulates a slave in-process.
+ */
+
+#ifndef SPI_TRANSPORT_H
+#define SPI_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/spi/spidev.h>
+#include "spi_lib.h"
+
+/**
+ * @brief Operations of a transport; every one receives the transport state.
+ */
+typedef struct {
+    const char *name;
+    // Issues one SPI message; returns the bytes transferred, or -1 with errno set
+    int (*transfer)(void *priv, struct spi_ioc_transfer *segments, size_t count);
+    // Changes the default clock frequency of the bus
+    int (*set_speed)(void *priv, uint32_t speed_hz);
+    // File descriptor that polls readable while an edge is pending
+    int (*event_fd)(void *priv);
+    // Consumes up to max pending edges; returns the number of rising edges, whose
+    // CLOCK_MONOTONIC times are stored oldest first, 0 for none, -1 on error
+    int (*read_events)(void *priv, uint64_t *timestamps_ns, unsigned int max);
+    // Releases the device and the transport state
+    void (*close)(void *priv);
+} spi_transport_ops_t;
+
+extern const spi_transport_ops_t spi_loopback_transport;
+
+/**
+ * @brief Creates a simulated slave.
+ *
+ * @param params Behaviour of the slave, or NULL for the defaults.
+ * @param speed_hz Initial clock frequency, used when clock modelling is on.
+ * @return The transport state, or NULL on failure.
+ */
+void *spi_loopback_open(const spi_loopback_params_t *params, uint32_t speed_hz);
+
+#endif // SPI_TRANSPORT_H
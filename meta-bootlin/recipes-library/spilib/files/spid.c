@@ -0,0 +1,742 @@
+/**
+ * @file spid.c
+ * @brief Daemon sharing one SPI slave between processes.
+ *
+ * spid is the only process touching the spidev node and the interrupt line,
+ * so no process can mistake the response to another one's request for its
+ * own. Clients connect to a UNIX socket and get shared memory submission
+ * and completion rings with eventfd doorbells (see spid_proto.h). The daemon
+ * takes one request from every client in turn, submits it to the device
+ * pipeline and routes each response back to the client that sent the
+ * request, by sequence tag. Frames matching no request go to the clients
+ * subscribed to their function ID.
+ */
+
+#define _GNU_SOURCE
+#include "spi_lib.h"
+#include "spid_client.h"
+#include "spid_proto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SPID_MAX_CLIENTS 16U
+#define SPID_MAX_EVENTS 32
+#define SPID_EXPIRY_TICK_MS 10      // Wakeup period for request deadlines while requests are pending
+#define SPID_PENDING_SIZE 256U      // Requests tracked by the low byte of their sequence tag
+#define SPID_SOCKET_MODE 0660
+
+/**
+ * @brief Kinds of file descriptors watched by the event loop.
+ */
+typedef enum {
+    WATCH_LISTEN,
+    WATCH_SIGNAL,
+    WATCH_DEVICE,
+    WATCH_SOCKET,
+    WATCH_DOORBELL
+} watch_kind_t;
+
+/**
+ * @brief One connected client.
+ */
+typedef struct {
+    int socket_fd;
+    int submit_fd;                  // Rung by the client after queueing requests
+    int complete_fd;                // Rung by the daemon after posting completions
+    spid_shm_t *shm;
+    uint8_t subscribed[32];         // Bit per function ID of the unsolicited frames wanted
+    int posted;                     // Completions posted since the last doorbell
+} client_t;
+
+/**
+ * @brief Request handed to the device, indexed by its sequence byte.
+ */
+typedef struct {
+    client_t *client;               // NULL once the client has disconnected
+    uint64_t tag;
+    uint8_t slot;
+    uint8_t used;
+} pending_t;
+
+/**
+ * @brief State of the daemon.
+ */
+typedef struct {
+    spi_ctx_t *ctx;
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;
+    client_t *clients[SPID_MAX_CLIENTS];
+    size_t next_client;             // Client served first in the next round
+    pending_t pending[SPID_PENDING_SIZE];
+} spid_t;
+
+/**
+ * @brief Settings of the daemon, from the command line.
+ */
+typedef struct {
+    spi_config_t config;
+    spi_loopback_params_t loopback;
+    const char *socket_path;
+    spi_protocol_t protocol;
+    spi_read_mode_t read_mode;
+    unsigned int depth;
+} spid_options_t;
+
+/**
+ * @brief Builds the epoll user data of a watched file descriptor.
+ *
+ * @param kind What the file descriptor is.
+ * @param index Client index for client file descriptors.
+ * @return The epoll user data.
+ */
+static uint64_t watch_token(watch_kind_t kind, size_t index) {
+    return ((uint64_t)kind << 32U) | (uint64_t)index;
+}
+
+/**
+ * @brief Adds a file descriptor to the event loop.
+ *
+ * @param spid The daemon.
+ * @param fd The file descriptor to watch for input.
+ * @param kind What the file descriptor is.
+ * @param index Client index for client file descriptors.
+ * @return 0 on success, -1 on error.
+ */
+static int watch(spid_t *spid, int fd, watch_kind_t kind, size_t index) {
+    struct epoll_event event;
+
+    (void)memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = watch_token(kind, index);
+    return epoll_ctl(spid->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * @brief Appends a completion to the completion ring of a client.
+ *
+ * @param client The client.
+ * @param cqe The completion; its payload is copied to the slot it names.
+ * @param payload The response payload, NULL if none.
+ */
+static void post_completion(client_t *client, const spid_cqe_t *cqe, const uint8_t *payload) {
+    spid_shm_t *shm = client->shm;
+    unsigned int tail = atomic_load_explicit(&shm->cq_tail, memory_order_relaxed);
+
+    if (payload != NULL) {
+        (void)memcpy(shm->slots[cqe->slot], payload, cqe->payload_size);
+    }
+    shm->cq[tail % SPID_CQ_ENTRIES] = *cqe;
+    atomic_store_explicit(&shm->cq_tail, tail + 1U, memory_order_release);
+    client->posted = 1;
+}
+
+/**
+ * @brief Passes a frame that matched no request to the subscribed clients.
+ *
+ * Room for the completions of every request a client can have outstanding
+ * is kept free, so a client that does not consume unsolicited frames only
+ * loses those.
+ *
+ * @param spid The daemon.
+ * @param resp The frame.
+ */
+static void broadcast_unsolicited(spid_t *spid, const spi_response_t *resp) {
+    for (size_t i = 0U; i < SPID_MAX_CLIENTS; i++) {
+        client_t *client = spid->clients[i];
+        if ((client == NULL) || ((client->subscribed[resp->function_id / 8U] & (1U << (resp->function_id % 8U))) == 0U)) {
+            continue;
+        }
+
+        spid_shm_t *shm = client->shm;
+        unsigned int tail = atomic_load_explicit(&shm->cq_tail, memory_order_relaxed);
+        unsigned int used = tail - atomic_load_explicit(&shm->cq_head, memory_order_acquire);
+        if (used > SPID_CQ_ENTRIES - SPID_SQ_ENTRIES - 1U) {
+            atomic_fetch_add_explicit(&shm->cq_dropped, 1UL, memory_order_relaxed);
+            continue;
+        }
+
+        spid_cqe_t cqe;
+        (void)memset(&cqe, 0, sizeof(cqe));
+        cqe.function_id = resp->function_id;
+        cqe.slot = (uint8_t)SPID_UNSOLICITED_SLOT(tail);
+        cqe.error = (uint8_t)SPI_SUCCESS;
+        cqe.flags = SPID_CQE_UNSOLICITED;
+        cqe.payload_size = resp->payload_size;
+        cqe.sequence = resp->sequence;
+        post_completion(client, &cqe, resp->payload);
+    }
+}
+
+/**
+ * @brief Handler of every function ID: routes frames back to the clients.
+ *
+ * @param error Result of the request, or SPI_SUCCESS for unsolicited frames.
+ * @param resp The response.
+ * @param user The daemon.
+ */
+static void route_response(spi_error_t error, spi_response_t *resp, void *user) {
+    spid_t *spid = user;
+
+    // The sequence of an unsolicited frame may equal the one of a request
+    // still queued in the library, so it is never looked up
+    if (resp->unsolicited != 0U) {
+        broadcast_unsolicited(spid, resp);
+        return;
+    }
+
+    pending_t *pending = &spid->pending[resp->sequence % SPID_PENDING_SIZE];
+    if (!pending->used) {
+        return;
+    }
+
+    pending->used = 0U;
+    if (pending->client == NULL) {
+        return;
+    }
+
+    spid_cqe_t cqe;
+    (void)memset(&cqe, 0, sizeof(cqe));
+    cqe.tag = pending->tag;
+    cqe.function_id = resp->function_id;
+    cqe.slot = pending->slot;
+    cqe.error = (uint8_t)error;
+    cqe.sequence = resp->sequence;
+    if ((error == SPI_SUCCESS) && (resp->payload != NULL)) {
+        cqe.payload_size = resp->payload_size;
+    }
+    post_completion(pending->client, &cqe, (cqe.payload_size > 0U) ? resp->payload : NULL);
+}
+
+/**
+ * @brief Releases the resources of a client.
+ *
+ * @param client The client.
+ */
+static void free_client(client_t *client) {
+    if (client->shm != NULL) {
+        (void)munmap(client->shm, sizeof(spid_shm_t));
+    }
+    if (client->complete_fd >= 0) {
+        (void)close(client->complete_fd);
+    }
+    if (client->submit_fd >= 0) {
+        (void)close(client->submit_fd);
+    }
+    (void)close(client->socket_fd);
+    free(client);
+}
+
+/**
+ * @brief Disconnects a client; its outstanding requests complete unseen.
+ *
+ * @param spid The daemon.
+ * @param index Index of the client.
+ */
+static void drop_client(spid_t *spid, size_t index) {
+    client_t *client = spid->clients[index];
+
+    for (size_t i = 0U; i < SPID_PENDING_SIZE; i++) {
+        if (spid->pending[i].client == client) {
+            spid->pending[i].client = NULL;
+        }
+    }
+    spid->clients[index] = NULL;
+    free_client(client);  // Closing the descriptors removes them from the epoll set
+    (void)printf("Client %zu disconnected\n", index);
+}
+
+/**
+ * @brief Completes a malformed submission without sending it.
+ *
+ * @param client The client.
+ * @param sqe The submission.
+ */
+static void reject_submission(client_t *client, const spid_sqe_t *sqe) {
+    spid_cqe_t cqe;
+
+    (void)memset(&cqe, 0, sizeof(cqe));
+    cqe.tag = sqe->tag;
+    cqe.function_id = sqe->function_id;
+    cqe.slot = sqe->slot;
+    cqe.error = (uint8_t)SPI_ERROR_INVALID_FORMAT;
+    post_completion(client, &cqe, NULL);
+}
+
+/**
+ * @brief Submits one queued request of a client to the device.
+ *
+ * @param spid The daemon.
+ * @param client The client.
+ * @return 1 if a request was consumed, 0 if the client has none queued,
+ *         -1 if the device cannot take more requests for now, -2 if the
+ *         client corrupted its submission ring.
+ */
+static int submit_one(spid_t *spid, client_t *client) {
+    spid_shm_t *shm = client->shm;
+    unsigned int head = atomic_load_explicit(&shm->sq_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&shm->sq_tail, memory_order_acquire);
+
+    if (head == tail) {
+        return 0;
+    }
+    if (tail - head > SPID_SQ_ENTRIES) {
+        return -2;
+    }
+
+    // Copy the entry: the client can rewrite shared memory at any time
+    spid_sqe_t sqe = shm->sq[head % SPID_SQ_ENTRIES];
+    if ((sqe.slot >= SPID_SQ_ENTRIES) || (sqe.payload_size > SPID_SLOT_SIZE)) {
+        reject_submission(client, &sqe);
+        atomic_store_explicit(&shm->sq_head, head + 1U, memory_order_release);
+        return 1;
+    }
+
+    // The callback of a failed transfer runs before spi_submit() returns
+    pending_t *pending = &spid->pending[spi_next_sequence(spid->ctx) % SPID_PENDING_SIZE];
+    if (pending->used) {
+        return -1;
+    }
+    pending->client = client;
+    pending->tag = sqe.tag;
+    pending->slot = sqe.slot;
+    pending->used = 1U;
+
+    if (spi_submit(spid->ctx, sqe.function_id, shm->slots[sqe.slot], sqe.payload_size, NULL) < 0) {
+        pending->used = 0U;
+        if (errno == EAGAIN) {
+            return -1;
+        }
+        reject_submission(client, &sqe);
+    }
+    atomic_store_explicit(&shm->sq_head, head + 1U, memory_order_release);
+    return 1;
+}
+
+/**
+ * @brief Moves queued requests from the clients to the device.
+ *
+ * Every round takes at most one request per client, starting one client
+ * further each round, so a client with a deep queue cannot starve the
+ * others. Stops when the queues are empty or the device is full; the
+ * client that was refused is served first once room frees up.
+ *
+ * @param spid The daemon.
+ */
+static void arbitrate(spid_t *spid) {
+    for (;;) {
+        int progress = 0;
+
+        for (size_t n = 0U; n < SPID_MAX_CLIENTS; n++) {
+            size_t index = (spid->next_client + n) % SPID_MAX_CLIENTS;
+            if (spid->clients[index] == NULL) {
+                continue;
+            }
+
+            int ret = submit_one(spid, spid->clients[index]);
+            if (ret == -2) {
+                (void)fprintf(stderr, "Client %zu overran its submission ring\n", index);
+                drop_client(spid, index);
+                continue;
+            }
+            if (ret < 0) {
+                spid->next_client = index;
+                return;
+            }
+            progress |= ret;
+        }
+
+        spid->next_client = (spid->next_client + 1U) % SPID_MAX_CLIENTS;
+        if (!progress) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Rings the completion doorbell of every client with new completions.
+ *
+ * @param spid The daemon.
+ */
+static void ring_doorbells(spid_t *spid) {
+    uint64_t one = 1U;
+
+    for (size_t i = 0U; i < SPID_MAX_CLIENTS; i++) {
+        client_t *client = spid->clients[i];
+        if ((client != NULL) && client->posted) {
+            client->posted = 0;
+            (void)write(client->complete_fd, &one, sizeof(one));
+        }
+    }
+}
+
+/**
+ * @brief Sends the hello message and the client file descriptors.
+ *
+ * @param socket_fd The client socket.
+ * @param fds Shared memory, submit doorbell and complete doorbell.
+ * @return 0 on success, -1 on error.
+ */
+static int send_hello(int socket_fd, const int fds[3]) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 3U)];
+    } control;
+    spid_hello_t hello = {SPID_PROTO_MAGIC, SPID_PROTO_VERSION, (uint32_t)sizeof(spid_shm_t)};
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg;
+
+    (void)memset(&control, 0, sizeof(control));
+    (void)memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3U);
+    (void)memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3U);
+
+    return (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(hello)) ? 0 : -1;
+}
+
+/**
+ * @brief Accepts a client and hands it its shared memory and doorbells.
+ *
+ * @param spid The daemon.
+ */
+static void accept_client(spid_t *spid) {
+    int socket_fd = accept4(spid->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socket_fd < 0) {
+        perror("Failed to accept client");
+        return;
+    }
+
+    size_t index = 0U;
+    while ((index < SPID_MAX_CLIENTS) && (spid->clients[index] != NULL)) {
+        index++;
+    }
+    client_t *client = (index < SPID_MAX_CLIENTS) ? calloc(1, sizeof(*client)) : NULL;
+    if (client == NULL) {
+        (void)fprintf(stderr, "Rejecting client: too many clients\n");
+        (void)close(socket_fd);
+        return;
+    }
+    client->socket_fd = socket_fd;
+    client->submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    client->complete_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    int shm_fd = memfd_create("spid-client", MFD_CLOEXEC);
+    if ((client->submit_fd < 0) || (client->complete_fd < 0) || (shm_fd < 0) ||
+        (ftruncate(shm_fd, (off_t)sizeof(spid_shm_t)) < 0)) {
+        perror("Failed to set up client");
+        if (shm_fd >= 0) {
+            (void)close(shm_fd);
+        }
+        free_client(client);
+        return;
+    }
+
+    void *shm = mmap(NULL, sizeof(spid_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("Failed to map client memory");
+        (void)close(shm_fd);
+        free_client(client);
+        return;
+    }
+    client->shm = shm;
+    client->shm->magic = SPID_PROTO_MAGIC;
+    client->shm->version = SPID_PROTO_VERSION;
+
+    int fds[3] = {shm_fd, client->submit_fd, client->complete_fd};
+    int ret = send_hello(socket_fd, fds);
+    (void)close(shm_fd);
+    if ((ret < 0) || (watch(spid, socket_fd, WATCH_SOCKET, index) < 0) ||
+        (watch(spid, client->submit_fd, WATCH_DOORBELL, index) < 0)) {
+        perror("Failed to register client");
+        free_client(client);
+        return;
+    }
+
+    spid->clients[index] = client;
+    (void)printf("Client %zu connected\n", index);
+}
+
+/**
+ * @brief Reads the control messages of a client, or notices it hung up.
+ *
+ * @param spid The daemon.
+ * @param index Index of the client.
+ */
+static void read_control(spid_t *spid, size_t index) {
+    client_t *client = spid->clients[index];
+    spid_control_t control;
+
+    for (;;) {
+        ssize_t received = recv(client->socket_fd, &control, sizeof(control), 0);
+        if (received < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR)) {
+                return;
+            }
+            break;
+        }
+        if (received == 0) {
+            break;
+        }
+        if ((received == (ssize_t)sizeof(control)) && (control.type == SPID_CONTROL_SUBSCRIBE)) {
+            uint8_t bit = (uint8_t)(1U << (control.function_id % 8U));
+            if (control.enable) {
+                client->subscribed[control.function_id / 8U] |= bit;
+            } else {
+                client->subscribed[control.function_id / 8U] &= (uint8_t)~bit;
+            }
+        }
+    }
+    drop_client(spid, index);
+}
+
+/**
+ * @brief Creates the listening socket.
+ *
+ * @param path Path of the socket; a stale socket file is replaced.
+ * @return The socket, or -1 on error.
+ */
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void)strcpy(addr.sun_path, path);
+    (void)unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (chmod(path, SPID_SOCKET_MODE) < 0) ||
+        (listen(fd, (int)SPID_MAX_CLIENTS) < 0)) {
+        int saved_errno = errno;
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Serves clients until SIGINT or SIGTERM.
+ *
+ * @param spid The daemon.
+ * @return 0 on a clean shutdown, -1 on error.
+ */
+static int serve(spid_t *spid) {
+    struct epoll_event events[SPID_MAX_EVENTS];
+
+    for (;;) {
+        int timeout_ms = (spi_pending_requests(spid->ctx) > 0U) ? SPID_EXPIRY_TICK_MS : -1;
+        int count = epoll_wait(spid->epoll_fd, events, SPID_MAX_EVENTS, timeout_ms);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for events");
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            watch_kind_t kind = (watch_kind_t)(events[i].data.u64 >> 32U);
+            size_t index = (size_t)(events[i].data.u64 & 0xFFFFFFFFU);
+            uint64_t value;
+
+            switch (kind) {
+            case WATCH_LISTEN:
+                accept_client(spid);
+                break;
+            case WATCH_SIGNAL:
+                return 0;
+            case WATCH_SOCKET:
+                if (spid->clients[index] != NULL) {
+                    read_control(spid, index);
+                }
+                break;
+            case WATCH_DOORBELL:
+                if (spid->clients[index] != NULL) {
+                    (void)read(spid->clients[index]->submit_fd, &value, sizeof(value));
+                }
+                break;
+            case WATCH_DEVICE:
+            default:
+                break;
+            }
+        }
+
+        // Services interrupts and deadlines, then refills the pipeline
+        if (spi_dispatch(spid->ctx) < 0) {
+            perror("Failed to service SPI device");
+        }
+        arbitrate(spid);
+        ring_doorbells(spid);
+    }
+}
+
+/**
+ * @brief Prints the command line help.
+ *
+ * @param program Name of the executable.
+ */
+static void usage(const char *program) {
+    (void)fprintf(stderr,
+                  "Usage: %s [-d spidev] [-g gpiochip] [-p pin] [-s speed_hz] [-v 1|2] [-r fixed|prefixed]\n"
+                  "          [-n depth] [-S socket] [-L]\n"
+                  "  -d  spidev node (default /dev/spidev0.0)\n"
+                  "  -g  GPIO chip of the interrupt line (default /dev/gpiochip3)\n"
+                  "  -p  Offset of the interrupt line (default 15)\n"
+                  "  -s  SPI clock frequency in Hz\n"
+                  "  -v  Framing protocol version (default 1)\n"
+                  "  -r  Read mode (default fixed)\n"
+                  "  -n  Requests in flight at the slave (default 1)\n"
+                  "  -S  Socket path (default " SPID_SOCKET_PATH ")\n"
+                  "  -L  Serve the loopback slave instead of the hardware\n",
+                  program);
+}
+
+/**
+ * @brief Parses the command line.
+ *
+ * @param argc Argument count.
+ * @param argv Arguments.
+ * @param options The settings to fill.
+ * @return 0 to run, 1 to exit successfully, -1 on a usage error.
+ */
+static int parse_options(int argc, char *argv[], spid_options_t *options) {
+    int opt;
+
+    (void)memset(options, 0, sizeof(*options));
+    spi_config_init(&options->config);
+    spi_loopback_params_init(&options->loopback);
+    options->socket_path = SPID_SOCKET_PATH;
+    options->protocol = SPI_PROTOCOL_V1;
+    options->read_mode = SPI_READ_FIXED;
+    options->depth = 1U;
+
+    while ((opt = getopt(argc, argv, "d:g:p:s:v:r:n:S:Lh")) != -1) {
+        switch (opt) {
+        case 'd':
+            options->config.spi_device = optarg;
+            break;
+        case 'g':
+            options->config.gpio_chip = optarg;
+            break;
+        case 'p':
+            options->config.gpio_pin = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            options->config.speed_hz = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            options->protocol = (strcmp(optarg, "2") == 0) ? SPI_PROTOCOL_V2 : SPI_PROTOCOL_V1;
+            break;
+        case 'r':
+            if (strcmp(optarg, "prefixed") == 0) {
+                options->read_mode = SPI_READ_LENGTH_PREFIXED;
+            } else if (strcmp(optarg, "fixed") == 0) {
+                options->read_mode = SPI_READ_FIXED;
+            } else {
+                return -1;
+            }
+            break;
+        case 'n':
+            options->depth = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            options->socket_path = optarg;
+            break;
+        case 'L':
+            options->config.backend = SPI_BACKEND_LOOPBACK;
+            options->config.loopback = &options->loopback;
+            break;
+        default:
+            return (opt == 'h') ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    spid_options_t options;
+    spid_t spid;
+    sigset_t signals;
+
+    int ret = parse_options(argc, argv, &options);
+    if (ret != 0) {
+        usage(argv[0]);
+        return (ret > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    (void)memset(&spid, 0, sizeof(spid));
+    spid.ctx = spi_open(&options.config);
+    if (spid.ctx == NULL) {
+        return EXIT_FAILURE;
+    }
+    spi_set_protocol(spid.ctx, options.protocol);
+    (void)spi_set_read_mode(spid.ctx, options.read_mode);
+    spi_pipeline_set_depth(spid.ctx, options.depth);
+    for (unsigned int function_id = 0U; function_id < 256U; function_id++) {
+        spi_register_handler(spid.ctx, (uint8_t)function_id, route_response, &spid);
+    }
+
+    (void)sigemptyset(&signals);
+    (void)sigaddset(&signals, SIGINT);
+    (void)sigaddset(&signals, SIGTERM);
+    (void)sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int status = EXIT_FAILURE;
+    spid.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    spid.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    spid.listen_fd = open_listener(options.socket_path);
+    if ((spid.signal_fd < 0) || (spid.epoll_fd < 0) || (spid.listen_fd < 0)) {
+        perror("Failed to set up spid");
+    } else if ((watch(&spid, spid.listen_fd, WATCH_LISTEN, 0U) < 0) ||
+               (watch(&spid, spid.signal_fd, WATCH_SIGNAL, 0U) < 0) ||
+               (watch(&spid, spi_get_event_fd(spid.ctx), WATCH_DEVICE, 0U) < 0)) {
+        perror("Failed to watch spid file descriptors");
+    } else if (serve(&spid) == 0) {
+        status = EXIT_SUCCESS;
+    }
+
+    for (size_t i = 0U; i < SPID_MAX_CLIENTS; i++) {
+        if (spid.clients[i] != NULL) {
+            drop_client(&spid, i);
+        }
+    }
+    if (spid.listen_fd >= 0) {
+        (void)close(spid.listen_fd);
+        (void)unlink(options.socket_path);
+    }
+    if (spid.epoll_fd >= 0) {
+        (void)close(spid.epoll_fd);
+    }
+    if (spid.signal_fd >= 0) {
+        (void)close(spid.signal_fd);
+    }
+    spi_release(spid.ctx);
+    return status;
+}
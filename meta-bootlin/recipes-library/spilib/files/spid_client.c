@@ -0,0 +1,325 @@
+#include "spid_client.h"
+#include "spid_proto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SPID_HELLO_FDS 3U  // Shared memory, submit doorbell, complete doorbell
+
+/**
+ * @brief State of one connection to the daemon.
+ */
+struct spid_client {
+    int socket_fd;
+    int submit_fd;        // Rung after queueing requests
+    int complete_fd;      // Rung by the daemon after posting completions
+    spid_shm_t *shm;
+    uint64_t free_slots;  // Bit n set while request slot n is free
+};
+
+/**
+ * @brief Receives the hello message and the file descriptors attached to it.
+ *
+ * @param socket_fd The connected socket.
+ * @param hello The hello message to fill.
+ * @param fds Set to the attached file descriptors.
+ * @return 0 on success, -1 with errno set.
+ */
+static int receive_hello(int socket_fd, spid_hello_t *hello, int fds[SPID_HELLO_FDS]) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * SPID_HELLO_FDS)];
+    } control;
+    struct iovec iov = {hello, sizeof(*hello)};
+    struct msghdr msg;
+
+    (void)memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((received != (ssize_t)sizeof(*hello)) || (cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) ||
+        (cmsg->cmsg_type != SCM_RIGHTS) || (cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SPID_HELLO_FDS))) {
+        errno = EPROTO;
+        return -1;
+    }
+    (void)memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SPID_HELLO_FDS);
+
+    if ((hello->magic != SPID_PROTO_MAGIC) || (hello->version != SPID_PROTO_VERSION) ||
+        (hello->shm_size != sizeof(spid_shm_t))) {
+        for (unsigned int i = 0U; i < SPID_HELLO_FDS; i++) {
+            (void)close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Connects to the daemon.
+ *
+ * @param path Socket of the daemon, NULL for SPID_SOCKET_PATH.
+ * @return The connection, or NULL with errno set.
+ */
+spid_client_t *spid_connect(const char *path) {
+    struct sockaddr_un addr;
+    spid_hello_t hello;
+    int fds[SPID_HELLO_FDS];
+
+    if (path == NULL) {
+        path = SPID_SOCKET_PATH;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    spid_client_t *client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+
+    client->socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->socket_fd < 0) {
+        free(client);
+        return NULL;
+    }
+
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void)strcpy(addr.sun_path, path);
+    if ((connect(client->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (receive_hello(client->socket_fd, &hello, fds) < 0)) {
+        int saved_errno = errno;
+        (void)close(client->socket_fd);
+        free(client);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    void *shm = mmap(NULL, sizeof(spid_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    int saved_errno = errno;
+    (void)close(fds[0]);
+    if (shm == MAP_FAILED) {
+        (void)close(fds[1]);
+        (void)close(fds[2]);
+        (void)close(client->socket_fd);
+        free(client);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    client->shm = shm;
+    client->submit_fd = fds[1];
+    client->complete_fd = fds[2];
+    client->free_slots = ~(uint64_t)0;
+    return client;
+}
+
+/**
+ * @brief Closes a connection.
+ *
+ * @param client The connection.
+ */
+void spid_disconnect(spid_client_t *client) {
+    if (client == NULL) {
+        return;
+    }
+    (void)munmap(client->shm, sizeof(spid_shm_t));
+    (void)close(client->complete_fd);
+    (void)close(client->submit_fd);
+    (void)close(client->socket_fd);
+    free(client);
+}
+
+/**
+ * @brief Reserves a payload buffer in shared memory.
+ *
+ * @param client The connection.
+ * @param slot Set to the slot of the buffer.
+ * @return The buffer, or NULL with errno set to EAGAIN.
+ */
+uint8_t *spid_alloc(spid_client_t *client, unsigned int *slot) {
+    if (client->free_slots == 0U) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    *slot = (unsigned int)__builtin_ctzll(client->free_slots);
+    client->free_slots &= client->free_slots - 1U;
+    return client->shm->slots[*slot];
+}
+
+/**
+ * @brief Queues a request whose payload was written to a buffer of spid_alloc().
+ *
+ * A request slot is only freed by the completion of its request, so the
+ * submission ring, which has one entry per slot, always has room.
+ *
+ * @param client The connection.
+ * @param slot The slot returned by spid_alloc().
+ * @param function_id The function ID for the request.
+ * @param payload_size Size of the payload in bytes.
+ * @param tag Returned in the completion of the request.
+ * @return 0 on success, -1 with errno set.
+ */
+int spid_submit(spid_client_t *client, unsigned int slot, uint8_t function_id, uint16_t payload_size, uint64_t tag) {
+    spid_shm_t *shm = client->shm;
+
+    if ((slot >= SPID_SQ_ENTRIES) || ((client->free_slots & ((uint64_t)1 << slot)) != 0U) ||
+        (payload_size > SPID_SLOT_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned int tail = atomic_load_explicit(&shm->sq_tail, memory_order_relaxed);
+    spid_sqe_t *sqe = &shm->sq[tail % SPID_SQ_ENTRIES];
+    sqe->tag = tag;
+    sqe->function_id = function_id;
+    sqe->slot = (uint8_t)slot;
+    sqe->payload_size = payload_size;
+    sqe->reserved = 0U;
+    atomic_store_explicit(&shm->sq_tail, tail + 1U, memory_order_release);
+
+    uint64_t one = 1U;
+    if (write(client->submit_fd, &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+        // Only fails if the counter is saturated, i.e. the doorbell is already pending
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies a payload to shared memory and queues the request.
+ *
+ * @param client The connection.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size Size of the payload in bytes.
+ * @param tag Returned in the completion of the request.
+ * @return 0 on success, -1 with errno set.
+ */
+int spid_send(spid_client_t *client, uint8_t function_id, const uint8_t *payload, uint16_t payload_size,
+              uint64_t tag) {
+    unsigned int slot;
+
+    if (payload_size > SPID_SLOT_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint8_t *buffer = spid_alloc(client, &slot);
+    if (buffer == NULL) {
+        return -1;
+    }
+    (void)memcpy(buffer, payload, payload_size);
+    return spid_submit(client, slot, function_id, payload_size, tag);
+}
+
+/**
+ * @brief Enables or disables delivery of unsolicited frames of a function ID.
+ *
+ * @param client The connection.
+ * @param function_id The function ID.
+ * @param enable Non-zero to subscribe, zero to unsubscribe.
+ * @return 0 on success, -1 with errno set.
+ */
+int spid_subscribe(spid_client_t *client, uint8_t function_id, int enable) {
+    spid_control_t control;
+
+    (void)memset(&control, 0, sizeof(control));
+    control.type = SPID_CONTROL_SUBSCRIBE;
+    control.function_id = function_id;
+    control.enable = (uint8_t)(enable != 0);
+    return (send(client->socket_fd, &control, sizeof(control), MSG_NOSIGNAL) == (ssize_t)sizeof(control)) ? 0 : -1;
+}
+
+/**
+ * @brief Returns the completion doorbell.
+ *
+ * @param client The connection.
+ * @return The eventfd file descriptor.
+ */
+int spid_event_fd(const spid_client_t *client) {
+    return client->complete_fd;
+}
+
+/**
+ * @brief Waits for completions and passes them to a callback.
+ *
+ * @param client The connection.
+ * @param timeout_ms Maximum time to wait if none is posted, -1 to wait forever.
+ * @param callback Called for every completion.
+ * @param user Passed to the callback.
+ * @return Number of completions, or -1 with errno set.
+ */
+int spid_process(spid_client_t *client, int timeout_ms, spid_completion_cb_t callback, void *user) {
+    spid_shm_t *shm = client->shm;
+    unsigned int head = atomic_load_explicit(&shm->cq_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&shm->cq_tail, memory_order_acquire);
+    uint64_t count;
+
+    for (;;) {
+        if ((head == tail) && (timeout_ms != 0)) {
+            struct pollfd pfd = {client->complete_fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready <= 0) {
+                return ready;
+            }
+        }
+
+        // Consume the doorbell before the ring, so no completion goes unnoticed
+        (void)read(client->complete_fd, &count, sizeof(count));
+        tail = atomic_load_explicit(&shm->cq_tail, memory_order_acquire);
+
+        // A doorbell rung for completions already consumed wakes up for nothing
+        if ((head != tail) || (timeout_ms == 0)) {
+            break;
+        }
+    }
+
+    int completed = 0;
+    for (; head != tail; head++) {
+        const spid_cqe_t *cqe = &shm->cq[head % SPID_CQ_ENTRIES];
+        spid_completion_t completion;
+
+        completion.tag = cqe->tag;
+        completion.error = (spi_error_t)cqe->error;
+        completion.function_id = cqe->function_id;
+        completion.sequence = cqe->sequence;
+        completion.unsolicited = ((cqe->flags & SPID_CQE_UNSOLICITED) != 0U);
+        completion.payload = shm->slots[cqe->slot % (SPID_SQ_ENTRIES + SPID_CQ_ENTRIES)];
+        completion.payload_size = (cqe->payload_size <= SPID_SLOT_SIZE) ? cqe->payload_size : 0U;
+        callback(user, &completion);
+
+        if (!completion.unsolicited && (cqe->slot < SPID_SQ_ENTRIES)) {
+            client->free_slots |= (uint64_t)1 << cqe->slot;
+        }
+        atomic_store_explicit(&shm->cq_head, head + 1U, memory_order_release);
+        completed++;
+    }
+    return completed;
+}
+
+/**
+ * @brief Returns the number of unsolicited frames lost because the completion ring was full.
+ *
+ * @param client The connection.
+ * @return The number of frames lost.
+ */
+unsigned long spid_dropped(const spid_client_t *client) {
+    return atomic_load_explicit(&client->shm->cq_dropped, memory_order_relaxed);
+}
@@ -0,0 +1,159 @@
+/**
+ * @file spid_client.h
+ * @brief Client interface of the spid bus daemon.
+ *
+ * spid owns the spidev node and the interrupt line of a SPI slave and
+ * shares them between processes. Each client gets its own shared memory
+ * submission and completion rings: payloads are written straight into the
+ * shared memory and responses are read from it, and the daemon arbitrates
+ * between clients round-robin. Requests and completions are signalled with
+ * eventfd doorbells, so a client integrates into any poll() based loop.
+ */
+
+#ifndef SPID_CLIENT_H
+#define SPID_CLIENT_H
+
+#include <stdint.h>
+#include "spi_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built with hidden visibility; only what this header declares is exported
+#pragma GCC visibility push(default)
+
+#define SPID_SOCKET_PATH "/run/spid.sock"  /**< Default socket of the daemon */
+#define SPID_MAX_OUTSTANDING 64U           /**< Requests a client can have outstanding */
+
+/**
+ * @brief Opaque connection to the daemon.
+ *
+ * A connection is not thread-safe; drive each one from one thread at a time.
+ */
+typedef struct spid_client spid_client_t;
+
+/**
+ * @brief A completed request or an unsolicited frame.
+ */
+typedef struct {
+    uint64_t tag;             /**< Tag passed to spid_submit(), 0 for unsolicited frames */
+    spi_error_t error;        /**< Result of the request */
+    uint8_t function_id;      /**< Function ID of the response */
+    uint16_t sequence;        /**< Sequence tag the daemon gave the request */
+    int unsolicited;          /**< Non-zero for a frame that matched no request */
+    const uint8_t *payload;   /**< Response payload in shared memory, valid during the callback */
+    uint16_t payload_size;    /**< Size of the payload in bytes */
+} spid_completion_t;
+
+/**
+ * @brief Callback receiving completions from spid_process().
+ *
+ * @param user The user context passed to spid_process().
+ * @param completion The completion.
+ */
+typedef void (*spid_completion_cb_t)(void *user, const spid_completion_t *completion);
+
+/**
+ * @brief Connects to the daemon.
+ *
+ * @param path Socket of the daemon, NULL for SPID_SOCKET_PATH.
+ * @return The connection, or NULL with errno set.
+ */
+spid_client_t *spid_connect(const char *path);
+
+/**
+ * @brief Closes a connection.
+ *
+ * Requests still outstanding are completed by the daemon and discarded.
+ *
+ * @param client The connection.
+ */
+void spid_disconnect(spid_client_t *client);
+
+/**
+ * @brief Reserves a payload buffer in shared memory.
+ *
+ * The payload written to the buffer is transmitted without being copied
+ * again by the client library; spid_submit() hands the buffer back.
+ *
+ * @param client The connection.
+ * @param slot Set to the slot of the buffer, to be passed to spid_submit().
+ * @return A buffer of 1024 bytes, or NULL with errno set to EAGAIN if
+ *         SPID_MAX_OUTSTANDING requests are outstanding.
+ */
+uint8_t *spid_alloc(spid_client_t *client, unsigned int *slot);
+
+/**
+ * @brief Queues a request whose payload was written to a buffer of spid_alloc().
+ *
+ * @param client The connection.
+ * @param slot The slot returned by spid_alloc().
+ * @param function_id The function ID for the request.
+ * @param payload_size Size of the payload in bytes, at most 1024.
+ * @param tag Returned in the completion of the request.
+ * @return 0 on success, -1 with errno set to EINVAL if the slot or size is invalid.
+ */
+int spid_submit(spid_client_t *client, unsigned int slot, uint8_t function_id, uint16_t payload_size, uint64_t tag);
+
+/**
+ * @brief Copies a payload to shared memory and queues the request.
+ *
+ * @param client The connection.
+ * @param function_id The function ID for the request.
+ * @param payload The payload data to send.
+ * @param payload_size Size of the payload in bytes, at most 1024.
+ * @param tag Returned in the completion of the request.
+ * @return 0 on success, -1 with errno set to EAGAIN or EMSGSIZE.
+ */
+int spid_send(spid_client_t *client, uint8_t function_id, const uint8_t *payload, uint16_t payload_size,
+              uint64_t tag);
+
+/**
+ * @brief Enables or disables delivery of unsolicited frames of a function ID.
+ *
+ * Frames that match no request are delivered to every client subscribed to
+ * their function ID. A client not consuming its completions loses them
+ * rather than blocking the bus.
+ *
+ * @param client The connection.
+ * @param function_id The function ID.
+ * @param enable Non-zero to subscribe, zero to unsubscribe.
+ * @return 0 on success, -1 with errno set.
+ */
+int spid_subscribe(spid_client_t *client, uint8_t function_id, int enable);
+
+/**
+ * @brief Returns the completion doorbell, readable when completions are posted.
+ *
+ * @param client The connection.
+ * @return The eventfd file descriptor.
+ */
+int spid_event_fd(const spid_client_t *client);
+
+/**
+ * @brief Waits for completions and passes them to a callback.
+ *
+ * @param client The connection.
+ * @param timeout_ms Maximum time to wait if none is posted, -1 to wait forever.
+ * @param callback Called for every completion, in the order posted.
+ * @param user Passed to the callback.
+ * @return Number of completions, or -1 with errno set.
+ */
+int spid_process(spid_client_t *client, int timeout_ms, spid_completion_cb_t callback, void *user);
+
+/**
+ * @brief Returns the number of unsolicited frames lost because the completion ring was full.
+ *
+ * @param client The connection.
+ * @return The number of frames lost.
+ */
+unsigned long spid_dropped(const spid_client_t *client);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SPID_CLIENT_H
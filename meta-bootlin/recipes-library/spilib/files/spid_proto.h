@@ -0,0 +1,98 @@
+/**
+ * @file spid_proto.h
+ * @brief Internal interface between the spid daemon and its clients.
+ *
+ * A client connects to the UNIX socket of the daemon and is handed a shared
+ * memory region and two eventfd doorbells. The region holds a submission
+ * ring written by the client, a completion ring written by the daemon and
+ * the payload slots both rings refer to. The client rings the submit
+ * doorbell after queueing requests; the daemon rings the complete doorbell
+ * after posting completions. A request slot stays owned by the daemon until
+ * its completion is posted and receives the response payload.
+ */
+
+#ifndef SPID_PROTO_H
+#define SPID_PROTO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SPID_PROTO_MAGIC 0x53504944U  // "SPID"
+#define SPID_PROTO_VERSION 1U
+#define SPID_CACHE_LINE_SIZE 64
+#define SPID_SQ_ENTRIES 64U    // Submission ring size, also the number of request slots
+#define SPID_CQ_ENTRIES 128U   // Completion ring size, also the number of unsolicited slots
+#define SPID_SLOT_SIZE 1024U   // Largest payload of a frame
+
+// Unsolicited frames are written to the slot of their completion ring position
+#define SPID_UNSOLICITED_SLOT(position) (SPID_SQ_ENTRIES + ((position) % SPID_CQ_ENTRIES))
+
+#define SPID_CQE_UNSOLICITED 0x01U  // Completion carries a frame that matched no request
+
+#define SPID_CONTROL_SUBSCRIBE 1U  // Enable or disable unsolicited frames of a function ID
+
+/**
+ * @brief Request queued by a client.
+ */
+typedef struct {
+    uint64_t tag;           // Returned in the completion
+    uint8_t function_id;
+    uint8_t slot;           // Request slot holding the payload
+    uint16_t payload_size;
+    uint32_t reserved;
+} spid_sqe_t;
+
+/**
+ * @brief Completion posted by the daemon.
+ */
+typedef struct {
+    uint64_t tag;           // Tag of the request, 0 for unsolicited frames
+    uint8_t function_id;
+    uint8_t slot;           // Slot holding the response payload
+    uint8_t error;          // spi_error_t
+    uint8_t flags;          // SPID_CQE_*
+    uint16_t payload_size;
+    uint16_t sequence;      // Sequence tag the daemon gave the request
+} spid_cqe_t;
+
+/**
+ * @brief Layout of the shared memory region of one client.
+ *
+ * Both rings are single producer, single consumer; head and tail are free
+ * running and only ever written by their owner.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Alignas(SPID_CACHE_LINE_SIZE) atomic_uint sq_head;  // Written by the daemon only
+    _Alignas(SPID_CACHE_LINE_SIZE) atomic_uint sq_tail;  // Written by the client only
+    _Alignas(SPID_CACHE_LINE_SIZE) atomic_uint cq_head;  // Written by the client only
+    _Alignas(SPID_CACHE_LINE_SIZE) atomic_uint cq_tail;  // Written by the daemon only
+    _Alignas(SPID_CACHE_LINE_SIZE) atomic_ulong cq_dropped;  // Unsolicited frames without room
+    spid_sqe_t sq[SPID_SQ_ENTRIES];
+    spid_cqe_t cq[SPID_CQ_ENTRIES];
+    _Alignas(SPID_CACHE_LINE_SIZE) uint8_t slots[SPID_SQ_ENTRIES + SPID_CQ_ENTRIES][SPID_SLOT_SIZE];
+} spid_shm_t;
+
+/**
+ * @brief First message on a connection, sent by the daemon.
+ *
+ * Carries the shared memory, submit doorbell and complete doorbell file
+ * descriptors, in that order, as SCM_RIGHTS.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shm_size;
+} spid_hello_t;
+
+/**
+ * @brief Message sent by a client over its connection.
+ */
+typedef struct {
+    uint32_t type;          // SPID_CONTROL_*
+    uint8_t function_id;
+    uint8_t enable;
+} spid_control_t;
+
+#endif // SPID_PROTO_H